@@ -0,0 +1,167 @@
+/* regress-batch.c
+ *
+ * Command line batch fitting of spectra, without graphical interface.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "batch-fit.h"
+#include "recipe.h"
+#include "dispers-classes.h"
+#include "dispers-library.h"
+#include "error-messages.h"
+
+static void
+usage(FILE *f)
+{
+    fprintf(f,
+            "Usage: regress-batch [options] RECIPE [SPECTRUM ...]\n"
+            "Fit the spectra with the given recipe and write the results in CSV format,\n"
+            "in the order of the spectra.\n\n"
+            "Options:\n"
+            "  -j N        fit the spectra using N threads (default 1)\n"
+            "  -i N        read the spectra in advance using N threads (default 2)\n"
+            "  -q N        read in advance at most N spectra (default 2 x total threads)\n"
+            "  -o FILE     write the results to FILE instead of the standard output\n"
+            "  -J FILE     record the results in the journal FILE; if the batch is run\n"
+            "              again the spectra already recorded are not fitted again\n"
+            "  -l FILE     fit the spectra listed in FILE, one for each line\n"
+            "  -d DESCR    fit the spectra given by a descriptor like \"name-###.dat[1-25]\"\n"
+            "  -s I/N      fit only the shard I of N of the spectra, with I from 1 to N;\n"
+            "              the index of each spectrum in the whole batch is kept so that\n"
+            "              the results of the shards can be joined with regress-merge\n"
+            "  -h          show this help\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct batch_files *files = batch_files_new();
+    struct recipe *recipe;
+    str_ptr error_msg = NULL;
+    const char *out_filename = NULL;
+    FILE *out = stdout;
+    struct batch_fit_options options[1];
+    int shard = 0, nb_shards = 1;
+    int opt, status;
+
+    batch_fit_options_set_default(options);
+
+    while((opt = getopt(argc, argv, "j:i:q:o:J:l:d:s:h")) != -1) {
+        switch(opt) {
+        case 'j':
+            options->nb_threads = atoi(optarg);
+            if(options->nb_threads < 1) {
+                fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'i':
+            options->nb_io_threads = atoi(optarg);
+            if(options->nb_io_threads < 1) {
+                fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'q':
+            options->queue_size = atoi(optarg);
+            if(options->queue_size < 1) {
+                fprintf(stderr, "Invalid queue size: %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'o':
+            out_filename = optarg;
+            break;
+        case 'J':
+            options->journal_filename = optarg;
+            break;
+        case 'l':
+            if(batch_files_add_list(files, optarg, &error_msg)) {
+                fprintf(stderr, "%s\n", CSTR(error_msg));
+                return 2;
+            }
+            break;
+        case 'd':
+            if(batch_files_add_descr(files, optarg)) {
+                fprintf(stderr, "Invalid spectra descriptor: %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 's':
+            if(sscanf(optarg, "%d/%d", &shard, &nb_shards) != 2 ||
+                    nb_shards < 1 || shard < 1 || shard > nb_shards) {
+                fprintf(stderr, "Invalid shard: %s\n", optarg);
+                return 2;
+            }
+            shard--;
+            break;
+        case 'h':
+            usage(stdout);
+            return 0;
+        default:
+            usage(stderr);
+            return 2;
+        }
+    }
+
+    if(optind >= argc) {
+        usage(stderr);
+        return 2;
+    }
+
+    init_class_list();
+    dispers_library_init();
+
+    recipe = recipe_load(argv[optind], &error_msg);
+    if(!recipe) {
+        fprintf(stderr, "%s\n", CSTR(error_msg));
+        return 1;
+    }
+
+    for(optind++; optind < argc; optind++) {
+        batch_files_add(files, argv[optind]);
+    }
+
+    batch_files_shard(files, shard, nb_shards);
+
+    if(out_filename) {
+        out = fopen(out_filename, "w");
+        if(!out) {
+            fprintf(stderr, "Cannot open output file \"%s\"\n", out_filename);
+            return 1;
+        }
+    }
+
+    status = batch_fit_run(recipe, files, options, out, &error_msg);
+    if(status) {
+        fprintf(stderr, "%s\n", CSTR(error_msg));
+        free_error_message(error_msg);
+    }
+
+    if(out_filename) {
+        fclose(out);
+    }
+
+    recipe_free(recipe);
+    batch_files_free(files);
+
+    return status;
+}
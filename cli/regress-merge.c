@@ -0,0 +1,251 @@
+/* regress-merge.c
+ *
+ * Join the results of the shards of a batch written by regress-batch.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "str.h"
+
+/* A result line with the index of the spectrum in the batch. */
+struct merge_row {
+    int index;
+    int seq;
+    str_t line;
+};
+
+struct merge_rows {
+    int number;
+    int alloc;
+    struct merge_row *values;
+};
+
+static void
+usage(FILE *f)
+{
+    fprintf(f,
+            "Usage: regress-merge [options] FILE ...\n"
+            "Join the results of the shards of a batch written by regress-batch\n"
+            "in a single file ordered by the index of the spectra. The exit status\n"
+            "is 1 if the results of some spectra of the batch are missing.\n\n"
+            "Options:\n"
+            "  -o FILE     write the results to FILE instead of the standard output\n"
+            "  -h          show this help\n");
+}
+
+static int
+merge_row_compare(const void *a, const void *b)
+{
+    const struct merge_row *ra = a, *rb = b;
+    if(ra->index != rb->index) {
+        return (ra->index < rb->index ? -1 : 1);
+    }
+    return ra->seq - rb->seq;
+}
+
+static void
+report_missing(int first, int last)
+{
+    if(first == last) {
+        fprintf(stderr, "Missing results for the spectrum of index %i\n", first);
+    } else {
+        fprintf(stderr, "Missing results for the spectra of index %i to %i\n", first, last);
+    }
+}
+
+/* Read the results of a file. Its last line gives the size of the
+   batch, that should be the same for all the files. */
+static int
+read_results(const char *filename, str_t header, struct merge_rows *rows,
+             int *batch_size)
+{
+    FILE *f = fopen(filename, "r");
+    str_t line;
+    int lineno, size = -1;
+
+    if(!f) {
+        fprintf(stderr, "Cannot open file \"%s\"\n", filename);
+        return 1;
+    }
+
+    str_init(line, 128);
+
+    if(str_getline(line, f) < 0) {
+        fprintf(stderr, "%s: missing header\n", filename);
+        goto read_fail;
+    }
+    if(STR_LENGTH(header) == 0) {
+        str_copy(header, line);
+    } else if(strcmp(CSTR(header), CSTR(line)) != 0) {
+        fprintf(stderr, "%s: the header is different from the one of the other files\n", filename);
+        goto read_fail;
+    }
+
+    for(lineno = 2; str_getline(line, f) >= 0; lineno++) {
+        struct merge_row *r;
+        char *tail;
+        long index;
+
+        if(STR_LENGTH(line) == 0) continue;
+
+        if(size >= 0) {
+            fprintf(stderr, "%s:%i: line after the batch size\n", filename, lineno);
+            goto read_fail;
+        }
+
+        if(CSTR(line)[0] == '#') {
+            if(sscanf(CSTR(line), "# batch size %d", &size) != 1 || size < 0) {
+                fprintf(stderr, "%s:%i: invalid line\n", filename, lineno);
+                goto read_fail;
+            }
+            continue;
+        }
+
+        index = strtol(CSTR(line), &tail, 10);
+        if(tail == CSTR(line) || *tail != ',' || index < 0) {
+            fprintf(stderr, "%s:%i: invalid line\n", filename, lineno);
+            goto read_fail;
+        }
+
+        if(rows->number >= rows->alloc) {
+            rows->alloc = (rows->alloc > 0 ? 2 * rows->alloc : 256);
+            rows->values = erealloc(rows->values, rows->alloc * sizeof(struct merge_row));
+        }
+        r = rows->values + rows->number;
+        r->index = index;
+        r->seq = rows->number;
+        str_init_from_str(r->line, line);
+        rows->number++;
+    }
+
+    /* The batch size is written only when all the spectra are done. */
+    if(size < 0) {
+        fprintf(stderr, "%s: missing batch size, the batch may have been interrupted\n", filename);
+        goto read_fail;
+    }
+    if(*batch_size >= 0 && size != *batch_size) {
+        fprintf(stderr, "%s: the batch size is different from the one of the other files\n", filename);
+        goto read_fail;
+    }
+    *batch_size = size;
+
+    str_free(line);
+    fclose(f);
+    return 0;
+
+read_fail:
+    str_free(line);
+    fclose(f);
+    return 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct merge_rows rows[1] = {{0, 0, NULL}};
+    const char *out_filename = NULL;
+    FILE *out = stdout;
+    str_t header;
+    int opt, k, next, batch_size = -1, status = 0;
+
+    while((opt = getopt(argc, argv, "o:h")) != -1) {
+        switch(opt) {
+        case 'o':
+            out_filename = optarg;
+            break;
+        case 'h':
+            usage(stdout);
+            return 0;
+        default:
+            usage(stderr);
+            return 2;
+        }
+    }
+
+    if(optind >= argc) {
+        usage(stderr);
+        return 2;
+    }
+
+    str_init(header, 128);
+    for(k = optind; k < argc; k++) {
+        if(read_results(argv[k], header, rows, &batch_size)) {
+            return 1;
+        }
+    }
+
+    qsort(rows->values, rows->number, sizeof(struct merge_row), merge_row_compare);
+
+    if(rows->number > 0 && rows->values[rows->number - 1].index >= batch_size) {
+        fprintf(stderr, "The index %i is out of the batch of size %i\n",
+                rows->values[rows->number - 1].index, batch_size);
+        return 1;
+    }
+
+    /* The same spectrum may be given by more than one file, for example
+       if a shard was run twice, but the results should agree. */
+    for(k = 1; k < rows->number; k++) {
+        const struct merge_row *r = rows->values + k;
+        if(r->index == r[-1].index && strcmp(CSTR(r->line), CSTR(r[-1].line)) != 0) {
+            fprintf(stderr, "Different results for the spectrum of index %i\n", r->index);
+            return 1;
+        }
+    }
+
+    if(out_filename) {
+        out = fopen(out_filename, "w");
+        if(!out) {
+            fprintf(stderr, "Cannot open output file \"%s\"\n", out_filename);
+            return 1;
+        }
+    }
+
+    fprintf(out, "%s\n", CSTR(header));
+    for(k = 0, next = 0; k < rows->number; k++) {
+        const struct merge_row *r = rows->values + k;
+
+        if(k > 0 && r->index == r[-1].index) continue;
+
+        if(r->index > next) {
+            report_missing(next, r->index - 1);
+            status = 1;
+        }
+        fprintf(out, "%s\n", CSTR(r->line));
+        next = r->index + 1;
+    }
+    if(next < batch_size) {
+        report_missing(next, batch_size - 1);
+        status = 1;
+    }
+    fprintf(out, "# batch size %i\n", batch_size);
+
+    if(out_filename) {
+        fclose(out);
+    }
+
+    for(k = 0; k < rows->number; k++) {
+        str_free(rows->values[k].line);
+    }
+    free(rows->values);
+    str_free(header);
+
+    return status;
+}
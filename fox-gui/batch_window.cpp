@@ -1,5 +1,6 @@
 #include "batch_window.h"
 #include "grid-search.h"
+#include "recipe.h"
 #include "regress_pro_window.h"
 #include "error-messages.h"
 
@@ -55,34 +56,36 @@ int batch_window::batch_run(fit_recipe *recipe, str_ptr *error_msg)
 
     table->removeRange(0, table->samples_number() - 1, 1, table->getNumColumns() - 1);
 
-    fit_engine *fit = fit_engine_new();
-    fit_engine_bind(fit, recipe->stack, recipe->config, recipe->parameters);
+    compiled_recipe *cr = recipe_compile(recipe->stack, recipe->config, recipe->parameters, recipe->seeds_list);
 
     FXString result;
     for (int i = 0; i < table->samples_number(); i++) {
         FXString name = table->getItemText(i, 0);
         spectrum *s = load_gener_spectrum(name.text(), error_msg);
         if (!s) {
+            compiled_recipe_free(cr);
             return 1;
         }
         double chisq;
-        fit_engine_prepare(fit, s);
-        lmfit_grid(fit, recipe->seeds_list, &chisq, NULL, NULL, LMFIT_PRESERVE_STACK,
-                   window_process_events, this);
+        int status;
+        if (compiled_recipe_fit(cr, s, &status, &chisq, window_process_events, this, error_msg)) {
+            spectra_free(s);
+            compiled_recipe_free(cr);
+            return 1;
+        }
 
         unsigned j;
         for (j = 0; j < recipe->parameters->number; j++) {
-            result.format("%g", gsl_vector_get(fit->run->results, j));
+            result.format("%g", gsl_vector_get(cr->fit->run->results, j));
             table->setItemText(i, j + 1, result);
         }
         result.format("%g", chisq);
         table->setItemText(i, j + 1, result);
 
-        fit_engine_disable(fit);
         spectra_free(s);
     }
 
-    fit_engine_free(fit);
+    compiled_recipe_free(cr);
     return 0;
 }
 
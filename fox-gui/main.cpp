@@ -20,10 +20,18 @@
 
 #include "regress_pro_window.h"
 
+#ifdef DEBUG_REGRESS
+#include "test-deriv.h"
+#endif
+
 int main(int argc,char *argv[])
 {
     regress_pro app;
 
+#ifdef DEBUG_REGRESS
+    test_deriv_cases();
+#endif
+
     // Open display
     app.init(argc, argv);
     new FXToolTip(&app);
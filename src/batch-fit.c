@@ -0,0 +1,389 @@
+#include <pthread.h>
+
+#include <gsl/gsl_errno.h>
+
+#include "batch-fit.h"
+#include "batch-journal.h"
+#include "common.h"
+#include "fit-engine.h"
+#include "error-messages.h"
+#include "str-util.h"
+#include "worker-pool.h"
+
+/* A spectrum read in advance. The slot of index "k % queue_size" is
+   reserved to the spectrum "index", its content is valid once "loaded"
+   is set. */
+struct batch_slot {
+    int index;
+    int loaded;
+    struct spectrum *spectrum;
+    str_ptr error_msg;
+};
+
+/* A result line waiting for the results of the previous spectra to be
+   written. */
+struct batch_row {
+    int ready;
+    str_t line;
+};
+
+/* The batch runs as a pipeline of three stages. The I/O threads read
+   the spectra, in order, into the ring of slots. The compute threads
+   take the spectra from the slots, fit them and store the result lines
+   in the ring of rows. The lines are written as soon as all the
+   previous ones are. Both rings have "queue_size" elements and a stage
+   waits when the next stage falls behind, so the memory used does not
+   depend on the number of spectra. */
+struct batch_fit {
+    struct recipe *recipe;
+    const struct batch_files *files;
+    /* One compiled recipe for each compute thread. */
+    struct compiled_recipe **compiled;
+
+    int queue_size;
+    int nb_io_threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t loaded_cond;
+    pthread_cond_t freed_cond;
+    pthread_cond_t written_cond;
+
+    struct batch_slot *slots;
+    int next_load;
+
+    struct batch_row *rows;
+    int next_write;
+
+    FILE *out;
+
+    /* The journal, if any, and for each spectrum the result recorded in
+       the journal by a previous run or NULL. */
+    struct batch_journal *journal;
+    const char **done;
+};
+
+static void
+write_header(struct batch_fit *b)
+{
+    const struct fit_parameters *fps = b->recipe->parameters;
+    str_t line, pname;
+    size_t j;
+
+    str_init(line, 64);
+    str_init(pname, 16);
+
+    str_copy_c(line, "index");
+    str_append_csv_field(line, "file");
+    for(j = 0; j < fps->number; j++) {
+        get_param_name(&fps->values[j], pname);
+        str_append_csv_field(line, CSTR(pname));
+    }
+    str_append_csv_field(line, "chisq");
+    str_append_csv_field(line, "status");
+
+    fprintf(b->out, "%s\n", CSTR(line));
+    fflush(b->out);
+
+    str_free(pname);
+    str_free(line);
+}
+
+static void *
+batch_io_thread(void *data)
+{
+    struct batch_fit *b = data;
+
+    pthread_mutex_lock(&b->lock);
+    for(;;) {
+        const int k = b->next_load;
+        struct batch_slot *slot = b->slots + k % b->queue_size;
+        struct spectrum *s;
+        str_ptr error_msg = NULL;
+
+        if(k >= b->files->number) break;
+        b->next_load++;
+
+        while(slot->index != k) {
+            pthread_cond_wait(&b->freed_cond, &b->lock);
+        }
+        pthread_mutex_unlock(&b->lock);
+
+        s = NULL;
+        if(!b->done[k]) {
+            s = load_gener_spectrum(CSTR(b->files->names[k]), &error_msg);
+        }
+
+        pthread_mutex_lock(&b->lock);
+        slot->spectrum = s;
+        slot->error_msg = error_msg;
+        slot->loaded = 1;
+        pthread_cond_broadcast(&b->loaded_cond);
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    return NULL;
+}
+
+/* Store the result line of the spectrum "k" and write all the lines
+   that are ready in the order of the spectra. If "result" is not NULL
+   it is recorded in the journal. */
+static void
+batch_write_row(struct batch_fit *b, int k, str_t line, const char *result)
+{
+    struct batch_row *row = b->rows + k % b->queue_size;
+
+    pthread_mutex_lock(&b->lock);
+    str_copy(row->line, line);
+    row->ready = 1;
+
+    if(b->journal && result) {
+        batch_journal_append(b->journal, CSTR(b->files->names[k]), result);
+        if(batch_journal_sync_due(b->journal)) {
+            batch_journal_sync(b->journal);
+        }
+    }
+
+    for(row = b->rows + b->next_write % b->queue_size; row->ready;
+            row = b->rows + b->next_write % b->queue_size) {
+        fprintf(b->out, "%s\n", CSTR(row->line));
+        row->ready = 0;
+        b->next_write++;
+    }
+    fflush(b->out);
+
+    pthread_cond_broadcast(&b->written_cond);
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void
+batch_fit_task(void *data, int k, int thread)
+{
+    struct batch_fit *b = data;
+    struct compiled_recipe *cr = b->compiled[thread];
+    struct batch_slot *slot = b->slots + k % b->queue_size;
+    const size_t nb_params = b->recipe->parameters->number;
+    str_ptr error_msg = NULL;
+    struct spectrum *s = NULL;
+    str_t line, result;
+    double chisq;
+    int fitted = 0;
+    size_t j;
+
+    /* The tasks are started in order so the spectra with a lower index
+       are already being fitted and the waits below always end. */
+    pthread_mutex_lock(&b->lock);
+    while(k >= b->next_write + b->queue_size) {
+        pthread_cond_wait(&b->written_cond, &b->lock);
+    }
+    if(b->nb_io_threads > 0) {
+        while(slot->index != k || !slot->loaded) {
+            pthread_cond_wait(&b->loaded_cond, &b->lock);
+        }
+        s = slot->spectrum;
+        error_msg = slot->error_msg;
+        slot->index += b->queue_size;
+        slot->loaded = 0;
+        pthread_cond_broadcast(&b->freed_cond);
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    if(b->nb_io_threads == 0 && !b->done[k]) {
+        /* No I/O thread could be started. */
+        s = load_gener_spectrum(CSTR(b->files->names[k]), &error_msg);
+    }
+
+    /* The result fields, without the leading comma, are the ones
+       recorded in the journal. */
+    str_init(result, 128);
+
+    if(s) {
+        int status;
+        if(compiled_recipe_fit(cr, s, &status, &chisq, NULL, NULL, &error_msg) == 0) {
+            const gsl_vector *x = cr->fit->run->results;
+            for(j = 0; j < nb_params; j++) {
+                str_printf_add(result, ",%.8g", gsl_vector_get(x, j));
+            }
+            str_printf_add(result, ",%g", chisq);
+            str_append_csv_field(result, status == GSL_SUCCESS ? "ok" : gsl_strerror(status));
+            fitted = 1;
+        }
+        spectra_free(s);
+    } else if(b->done[k]) {
+        str_append_c(result, b->done[k], ',');
+    }
+
+    if(error_msg) {
+        for(j = 0; j < nb_params + 1; j++) {
+            str_append_c(result, "", ',');
+        }
+        str_append_csv_field(result, CSTR(error_msg));
+        free_error_message(error_msg);
+    }
+
+    str_init(line, 128);
+    str_printf(line, "%i", b->files->index[k]);
+    str_append_csv_field(line, CSTR(b->files->names[k]));
+    str_append(line, result, 0);
+
+    /* The spectra that could not be fitted are not recorded so that they
+       are retried when the batch is resumed. */
+    batch_write_row(b, k, line, fitted ? CSTR(result) + 1 : NULL);
+
+    str_free(result);
+    str_free(line);
+}
+
+void
+batch_fit_options_set_default(struct batch_fit_options *opt)
+{
+    opt->nb_threads = 1;
+    opt->nb_io_threads = 2;
+    opt->queue_size = 0;
+    opt->journal_filename = NULL;
+}
+
+int
+batch_fit_run(struct recipe *recipe, const struct batch_files *files,
+              const struct batch_fit_options *opt, FILE *out,
+              str_ptr *error_msg)
+{
+    struct batch_fit b[1];
+    struct worker_pool *pool = NULL;
+    struct fit_config cfg[1];
+    pthread_t *io_threads;
+    int nb_threads = opt->nb_threads, nb_io_threads = opt->nb_io_threads;
+    int k;
+
+    if(recipe->parameters->number == 0) {
+        *error_msg = new_error_message(RECIPE_CHECK, "The recipe has no fit parameters");
+        return 1;
+    }
+    if(check_fit_parameters(recipe->stack, recipe->parameters, error_msg) != 0) {
+        return 1;
+    }
+
+    b->journal = NULL;
+    if(opt->journal_filename) {
+        str_t digest;
+        str_init(digest, 16);
+        recipe_digest(recipe, digest);
+        /* The fit parameters, the chi square and the status. */
+        b->journal = batch_journal_open(opt->journal_filename, CSTR(digest),
+                                        recipe->parameters->number + 2, error_msg);
+        str_free(digest);
+        if(!b->journal) {
+            return 1;
+        }
+    }
+
+    b->done = emalloc((files->number > 0 ? files->number : 1) * sizeof(const char *));
+    for(k = 0; k < files->number; k++) {
+        const char *name = CSTR(files->names[k]);
+        b->done[k] = (b->journal ? batch_journal_lookup(b->journal, name) : NULL);
+    }
+
+    if(nb_threads > files->number) {
+        nb_threads = files->number;
+    }
+    if(nb_threads > 1) {
+        pool = worker_pool_new(nb_threads);
+        nb_threads = worker_pool_threads(pool);
+    } else {
+        nb_threads = 1;
+    }
+
+    if(nb_io_threads > files->number) {
+        nb_io_threads = files->number;
+    }
+    if(nb_io_threads < 1) {
+        nb_io_threads = 1;
+    }
+
+    /* The parallelism is on the spectra so each fit engine runs in a
+       single thread. */
+    cfg[0] = recipe->config[0];
+    cfg->nb_threads = 1;
+
+    b->recipe = recipe;
+    b->files = files;
+    b->out = out;
+
+    b->queue_size = opt->queue_size;
+    if(b->queue_size <= 0) {
+        b->queue_size = 2 * (nb_threads + nb_io_threads);
+    }
+
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->loaded_cond, NULL);
+    pthread_cond_init(&b->freed_cond, NULL);
+    pthread_cond_init(&b->written_cond, NULL);
+
+    b->slots = emalloc(b->queue_size * sizeof(struct batch_slot));
+    b->rows = emalloc(b->queue_size * sizeof(struct batch_row));
+    for(k = 0; k < b->queue_size; k++) {
+        b->slots[k].index = k;
+        b->slots[k].loaded = 0;
+        b->rows[k].ready = 0;
+        str_init(b->rows[k].line, 128);
+    }
+    b->next_load = 0;
+    b->next_write = 0;
+
+    b->compiled = emalloc(nb_threads * sizeof(struct compiled_recipe *));
+    for(k = 0; k < nb_threads; k++) {
+        b->compiled[k] = recipe_compile(recipe->stack, cfg, recipe->parameters,
+                                        recipe->seeds);
+    }
+
+    write_header(b);
+
+    io_threads = emalloc(nb_io_threads * sizeof(pthread_t));
+    for(k = 0; k < nb_io_threads; k++) {
+        if(pthread_create(&io_threads[k], NULL, batch_io_thread, b)) {
+            /* Continue with the threads that we have been able to start. */
+            nb_io_threads = k;
+            break;
+        }
+    }
+    b->nb_io_threads = nb_io_threads;
+
+    if(pool) {
+        worker_pool_run(pool, batch_fit_task, b, files->number);
+        worker_pool_free(pool);
+    } else {
+        for(k = 0; k < files->number; k++) {
+            batch_fit_task(b, k, 0);
+        }
+    }
+
+    for(k = 0; k < nb_io_threads; k++) {
+        pthread_join(io_threads[k], NULL);
+    }
+    free(io_threads);
+
+    fprintf(out, "# batch size %i\n", files->batch_size);
+    fflush(out);
+
+    for(k = 0; k < nb_threads; k++) {
+        compiled_recipe_free(b->compiled[k]);
+    }
+    free(b->compiled);
+
+    for(k = 0; k < b->queue_size; k++) {
+        str_free(b->rows[k].line);
+    }
+    free(b->rows);
+    free(b->slots);
+
+    if(b->journal) {
+        batch_journal_close(b->journal);
+    }
+    free(b->done);
+
+    pthread_cond_destroy(&b->loaded_cond);
+    pthread_cond_destroy(&b->freed_cond);
+    pthread_cond_destroy(&b->written_cond);
+    pthread_mutex_destroy(&b->lock);
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef BATCH_FIT_H
+#define BATCH_FIT_H
+
+#include <stdio.h>
+
+#include "defs.h"
+#include "batch.h"
+#include "recipe.h"
+#include "str.h"
+
+__BEGIN_DECLS
+
+struct batch_fit_options {
+    /* Number of threads fitting the spectra, each one with its own
+       compiled recipe. */
+    int nb_threads;
+    /* Number of threads reading the spectra in advance. */
+    int nb_io_threads;
+    /* Maximum number of spectra read and not yet fitted and of results
+       waiting to be written. If zero it is chosen from the number of
+       threads. */
+    int queue_size;
+    /* If not NULL the results are recorded in this journal and the
+       spectra already recorded with the same recipe are not fitted
+       again. */
+    const char *journal_filename;
+};
+
+extern void batch_fit_options_set_default(struct batch_fit_options *opt);
+
+/* Fit all the spectra of a batch with the same recipe. The batch runs
+   as a pipeline: the spectra are read in advance by the I/O threads,
+   fitted by the compute threads and the results are written in the
+   order of the spectra. A CSV line with the index in the batch and the
+   name of the spectrum, the fit parameters, the chi square and the
+   status is written to "out" for each spectrum. A spectrum that cannot
+   be loaded or fitted gives a line with the error message and does not
+   stop the batch. When all the spectra are done a last line
+   "# batch size N" gives the number of spectra of the whole batch, of
+   which "files" may be only a shard. Returns non zero if the recipe or
+   the journal cannot be used. */
+extern int batch_fit_run(struct recipe *recipe, const struct batch_files *files,
+                         const struct batch_fit_options *opt, FILE *out,
+                         str_ptr *error_msg);
+
+__END_DECLS
+
+#endif
@@ -0,0 +1,240 @@
+#include <string.h>
+#include <stdlib.h>
+#ifdef WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "batch-journal.h"
+#include "common.h"
+#include "error-messages.h"
+#include "str-util.h"
+
+/* Order of the record in the file, used to keep the last record of a
+   spectrum. */
+struct journal_record {
+    struct batch_journal_entry entry;
+    int seq;
+};
+
+static int
+journal_record_compare(const void *a, const void *b)
+{
+    const struct journal_record *ra = a, *rb = b;
+    int cmp = strcmp(CSTR(ra->entry.path), CSTR(rb->entry.path));
+    return (cmp != 0 ? cmp : ra->seq - rb->seq);
+}
+
+/* Return the number of fields of a CSV line or -1 if it is not well
+   formed. */
+static int
+csv_count_fields(const char *p, str_t field)
+{
+    int n = 0;
+
+    for(;;) {
+        p = str_read_csv_field(field, p);
+        if(!p) {
+            return -1;
+        }
+        n++;
+        if(*p != ',') break;
+        p++;
+    }
+
+    return (*p == 0 ? n : -1);
+}
+
+static void
+journal_read(struct batch_journal *j, const char *text, int nb_fields)
+{
+    struct journal_record *records = NULL;
+    int nb_records = 0, alloc = 0, k;
+    const char *line, *eol;
+    str_t field;
+
+    str_init(field, 64);
+
+    for(line = text; (eol = strchr(line, '\n')) != NULL; line = eol + 1) {
+        struct journal_record *r;
+        const char *end, *p = str_read_csv_field(field, line);
+
+        if(!p || *p != ',' || strcmp(CSTR(field), CSTR(j->recipe_digest)) != 0) {
+            continue;
+        }
+
+        p = str_read_csv_field(field, p + 1);
+        if(!p || p > eol || *p != ',') {
+            continue;
+        }
+
+        if(nb_records >= alloc) {
+            alloc = (alloc > 0 ? 2 * alloc : 64);
+            records = erealloc(records, alloc * sizeof(struct journal_record));
+        }
+
+        /* A carriage return from a file written on Windows is changed in
+           a space by str_loadfile. */
+        for(end = eol; end > p + 1 && end[-1] == ' '; end--) { }
+
+        r = records + nb_records;
+        str_init_from_str(r->entry.path, field);
+        str_init(r->entry.result, 64);
+        str_copy_c_substr(r->entry.result, p + 1, end - (p + 1));
+
+        if(csv_count_fields(CSTR(r->entry.result), field) != nb_fields) {
+            str_free(r->entry.path);
+            str_free(r->entry.result);
+            continue;
+        }
+
+        r->seq = nb_records;
+        nb_records++;
+    }
+
+    str_free(field);
+
+    qsort(records, nb_records, sizeof(struct journal_record), journal_record_compare);
+
+    j->entries = emalloc((nb_records > 0 ? nb_records : 1) * sizeof(struct batch_journal_entry));
+    j->nb_entries = 0;
+    for(k = 0; k < nb_records; k++) {
+        struct batch_journal_entry *e = &records[k].entry;
+        if(k + 1 < nb_records && strcmp(CSTR(e->path), CSTR(records[k+1].entry.path)) == 0) {
+            str_free(e->path);
+            str_free(e->result);
+            continue;
+        }
+        j->entries[j->nb_entries++] = *e;
+    }
+
+    free(records);
+}
+
+struct batch_journal *
+batch_journal_open(const char *filename, const char *recipe_digest,
+                   int nb_fields, str_ptr *error_msg)
+{
+    struct batch_journal *j;
+    const char *last;
+    FILE *f;
+    str_t text;
+    int status;
+
+    f = fopen(filename, "a");
+    if(!f) {
+        *error_msg = new_error_message(LOADING_FILE_ERROR, "Cannot open journal file \"%s\"", filename);
+        return NULL;
+    }
+
+    str_init(text, 1024);
+    if(str_loadfile(filename, text) != 0) {
+        *error_msg = new_error_message(LOADING_FILE_ERROR, "Cannot read journal file \"%s\"", filename);
+        str_free(text);
+        fclose(f);
+        return NULL;
+    }
+
+    /* An incomplete last line is a record whose write was interrupted.
+       It is removed so that the new records start on a new line. */
+    last = strrchr(CSTR(text), '\n');
+    str_trunc(text, last ? last - CSTR(text) + 1 : 0);
+#ifdef WIN32
+    status = _chsize(_fileno(f), STR_LENGTH(text));
+#else
+    status = ftruncate(fileno(f), STR_LENGTH(text));
+#endif
+    if(status != 0) {
+        *error_msg = new_error_message(LOADING_FILE_ERROR, "Cannot write journal file \"%s\"", filename);
+        str_free(text);
+        fclose(f);
+        return NULL;
+    }
+
+    j = emalloc(sizeof(struct batch_journal));
+    j->file = f;
+    str_init_from_c(j->recipe_digest, recipe_digest);
+    journal_read(j, CSTR(text), nb_fields);
+    str_free(text);
+
+    j->nb_pending = 0;
+    j->last_sync = time(NULL);
+
+    return j;
+}
+
+const char *
+batch_journal_lookup(const struct batch_journal *j, const char *path)
+{
+    int lo = 0, hi = j->nb_entries;
+
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(path, CSTR(j->entries[mid].path));
+        if(cmp == 0) {
+            return CSTR(j->entries[mid].result);
+        } else if(cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    return NULL;
+}
+
+void
+batch_journal_append(struct batch_journal *j, const char *path,
+                     const char *result)
+{
+    str_t line;
+
+    str_init(line, 128);
+    str_copy(line, j->recipe_digest);
+    str_append_csv_field(line, path);
+    str_append_c(line, result, ',');
+    fprintf(j->file, "%s\n", CSTR(line));
+    str_free(line);
+
+    j->nb_pending++;
+}
+
+int
+batch_journal_sync_due(const struct batch_journal *j)
+{
+    if(j->nb_pending >= BATCH_JOURNAL_SYNC_RECORDS) {
+        return 1;
+    }
+    return (j->nb_pending > 0 && time(NULL) - j->last_sync >= BATCH_JOURNAL_SYNC_SECONDS);
+}
+
+void
+batch_journal_sync(struct batch_journal *j)
+{
+    fflush(j->file);
+#ifdef WIN32
+    _commit(_fileno(j->file));
+#else
+    fsync(fileno(j->file));
+#endif
+    j->nb_pending = 0;
+    j->last_sync = time(NULL);
+}
+
+void
+batch_journal_close(struct batch_journal *j)
+{
+    int k;
+
+    batch_journal_sync(j);
+    fclose(j->file);
+
+    for(k = 0; k < j->nb_entries; k++) {
+        str_free(j->entries[k].path);
+        str_free(j->entries[k].result);
+    }
+    free(j->entries);
+    str_free(j->recipe_digest);
+    free(j);
+}
@@ -0,0 +1,69 @@
+#ifndef BATCH_JOURNAL_H
+#define BATCH_JOURNAL_H
+
+#include <stdio.h>
+#include <time.h>
+
+#include "defs.h"
+#include "str.h"
+
+__BEGIN_DECLS
+
+/* The journal is synced to disk when this number of records have been
+   appended or when this number of seconds have passed since the last
+   sync, whatever comes first. */
+#define BATCH_JOURNAL_SYNC_RECORDS 64
+#define BATCH_JOURNAL_SYNC_SECONDS 5
+
+struct batch_journal_entry {
+    str_t path;
+    str_t result;
+};
+
+/* Append-only record of the results of a batch so that an interrupted
+   batch can be resumed. Each line of the file is a record in CSV
+   format with the digest of the recipe, the path of the spectrum and
+   the result fields. The records of other recipes or with a number of
+   result fields different from the expected one are ignored and, if a
+   spectrum appears more than once, the last record is used. An
+   incomplete last line, as left by an interrupted write, is removed
+   from the file when it is opened. */
+struct batch_journal {
+    FILE *file;
+    str_t recipe_digest;
+
+    /* Records read from the file for the recipe, sorted by path. */
+    int nb_entries;
+    struct batch_journal_entry *entries;
+
+    int nb_pending;
+    time_t last_sync;
+};
+
+/* Open the journal, creating it if it does not exist, and read the
+   records of the recipe with "nb_fields" result fields. Return NULL if
+   it cannot be opened. */
+extern struct batch_journal *
+batch_journal_open(const char *filename, const char *recipe_digest,
+                   int nb_fields, str_ptr *error_msg);
+
+/* Return the result fields recorded for the spectrum or NULL. */
+extern const char *batch_journal_lookup(const struct batch_journal *j,
+                                        const char *path);
+
+/* Append a record to the journal. It is written to disk only at the
+   next sync. */
+extern void batch_journal_append(struct batch_journal *j, const char *path,
+                                 const char *result);
+
+/* Return 1 if the records appended since the last sync should be
+   written to disk. */
+extern int  batch_journal_sync_due(const struct batch_journal *j);
+extern void batch_journal_sync(struct batch_journal *j);
+
+/* Sync and close the journal. */
+extern void batch_journal_close(struct batch_journal *j);
+
+__END_DECLS
+
+#endif
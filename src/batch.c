@@ -1,6 +1,9 @@
 
+#include <ctype.h>
 #include <string.h>
 #include "batch.h"
+#include "common.h"
+#include "error-messages.h"
 
 int
 batch_descr_parse(const char *descr, struct spectra_lst *bspec,
@@ -63,11 +66,17 @@ batch_descr_parse(const char *descr, struct spectra_lst *bspec,
             bspec->stride = 1;
         }
 
-        if(*next == ']') {
-            return 0;
+        if(*next != ']') {
+            return 1;
         }
 
-        return 1;
+        /* An empty range or a stride less than one would not give a
+           valid sequence of files. */
+        if(bspec->stride < 1 || bspec->stop < bspec->start) {
+            return 1;
+        }
+
+        return 0;
     } else {
         bspec->start = bspec->stop = 0;
         bspec->stride = 1;
@@ -93,3 +102,117 @@ get_batch_filename(str_t sname, struct spectra_lst *batch, int *iter)
 
     return 1;
 }
+
+struct batch_files *
+batch_files_new(void)
+{
+    struct batch_files *files = emalloc(sizeof(struct batch_files));
+    files->number = 0;
+    files->alloc = 16;
+    files->names = emalloc(files->alloc * sizeof(str_t));
+    files->index = emalloc(files->alloc * sizeof(int));
+    files->batch_size = 0;
+    return files;
+}
+
+void
+batch_files_free(struct batch_files *files)
+{
+    int k;
+    for(k = 0; k < files->number; k++) {
+        str_free(files->names[k]);
+    }
+    free(files->names);
+    free(files->index);
+    free(files);
+}
+
+void
+batch_files_add(struct batch_files *files, const char *name)
+{
+    if(files->number >= files->alloc) {
+        str_t *old = files->names;
+        files->alloc *= 2;
+        files->names = emalloc(files->alloc * sizeof(str_t));
+        memcpy(files->names, old, files->number * sizeof(str_t));
+        free(old);
+        files->index = erealloc(files->index, files->alloc * sizeof(int));
+    }
+    str_init_from_c(files->names[files->number], name);
+    files->index[files->number] = files->number;
+    files->number++;
+    files->batch_size = files->number;
+}
+
+int
+batch_files_add_descr(struct batch_files *files, const char *descr)
+{
+    struct spectra_lst bspec[1];
+    str_t name;
+    int iter;
+
+    str_init(bspec->name, 64);
+    if(batch_descr_parse(descr, bspec, 1)) {
+        str_free(bspec->name);
+        return 1;
+    }
+    bspec->single_file = 0;
+
+    str_init(name, 64);
+    for(iter = bspec->start; get_batch_filename(name, bspec, &iter); ) {
+        batch_files_add(files, CSTR(name));
+    }
+
+    str_free(name);
+    str_free(bspec->name);
+    return 0;
+}
+
+int
+batch_files_add_list(struct batch_files *files, const char *filename,
+                     str_ptr *error_msg)
+{
+    FILE *f = fopen(filename, "r");
+    str_t ln;
+
+    if(f == NULL) {
+        *error_msg = new_error_message(LOADING_FILE_ERROR, "File \"%s\" does not exists or cannot be opened", filename);
+        return 1;
+    }
+
+    str_init(ln, 64);
+    while(str_getline(ln, f) >= 0) {
+        int len = STR_LENGTH(ln);
+        /* The trailing spaces, including the carriage return of a list
+           written on Windows, are not part of the file name. */
+        while(len > 0 && isspace((unsigned char) CSTR(ln)[len - 1])) {
+            len--;
+        }
+        str_trunc(ln, len);
+        if(len > 0) {
+            batch_files_add(files, CSTR(ln));
+        }
+    }
+
+    str_free(ln);
+    fclose(f);
+    return 0;
+}
+
+void
+batch_files_shard(struct batch_files *files, int shard, int nb_shards)
+{
+    int j, k;
+
+    for(j = 0, k = 0; j < files->number; j++) {
+        if(files->index[j] % nb_shards != shard) {
+            str_free(files->names[j]);
+            continue;
+        }
+        /* Move the name without copying it. */
+        files->names[k][0] = files->names[j][0];
+        files->index[k] = files->index[j];
+        k++;
+    }
+    files->number = k;
+}
@@ -14,12 +14,45 @@ struct spectra_lst {
     int length;
 };
 
+/* Ordered list of the spectra files of a batch. For each file "index"
+   is its position in the whole batch, that differs from the position
+   in the list when only a shard of the batch is kept. "batch_size" is
+   the number of files of the whole batch. */
+struct batch_files {
+    int number;
+    int alloc;
+    str_t *names;
+    int *index;
+    int batch_size;
+};
+
 extern int get_batch_filename(str_t sname, struct spectra_lst *batch,
                               int *iter);
 
 extern int batch_descr_parse(const char *descr, struct spectra_lst *bspec,
                              int extended);
 
+extern struct batch_files * batch_files_new(void);
+extern void batch_files_free(struct batch_files *files);
+extern void batch_files_add(struct batch_files *files, const char *name);
+
+/* Add the files given by an extended descriptor like "name-###.dat[1-25]"
+   or "name-###.dat[1-25,2]". Return non zero if the descriptor is not
+   valid or if the range is empty or the stride is less than one. */
+extern int batch_files_add_descr(struct batch_files *files, const char *descr);
+
+/* Add the files listed in a text file, one for each line. Trailing
+   spaces are removed and empty lines are ignored. */
+extern int batch_files_add_list(struct batch_files *files, const char *filename,
+                                str_ptr *error_msg);
+
+/* Keep only the shard "shard" of "nb_shards", numbered from zero, of the
+   files. The shard is made of the files whose index modulo nb_shards
+   is "shard" so that the shards of a batch are disjoint and cover the
+   whole batch. For the files given by a descriptor the shard is itself
+   a range, with the stride multiplied by nb_shards. */
+extern void batch_files_shard(struct batch_files *files, int shard, int nb_shards);
+
 __END_DECLS
 
 #endif
@@ -10,4 +10,12 @@ typedef enum {
     POL_P = 1
 } polar_t;
 
+/* Kernel functions that are always inlined so that they can be
+   specialized for a fixed number of mediums. */
+#ifdef __GNUC__
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+#else
+#define KERNEL_INLINE static inline
+#endif
+
 #endif
\ No newline at end of file
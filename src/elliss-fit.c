@@ -1,7 +1,9 @@
 #include "elliss-fit.h"
 #include "fit-engine.h"
 #include "elliss.h"
+#include "kernel-f32.h"
 #include "test-deriv.h"
+#include "worker-pool.h"
 
 /* helper function */
 #include "elliss-get-jacob.h"
@@ -33,7 +35,8 @@ elliss_fit_test_deriv(struct fit_engine *fit)
         }
 
         test_elliss_deriv(s->config.system,
-                          nb_med, actual.ns, phi0, actual.ths, lambda, anlz);
+                          nb_med, actual.ns, phi0, s->config.numap, actual.ths,
+                          &fit->stack->repeat, lambda, anlz);
     }
 }
 #endif
@@ -73,11 +76,43 @@ get_parameter_jacobian(fit_param_t const *fp, stack_t const *stack,
     }
 }
 
-int
-elliss_fit_fdf(const gsl_vector *x, void *params, gsl_vector *f,
-               gsl_matrix * jacob)
+/* Buffers used to evaluate a range of points. They belong either to the
+   fit run or to one of its workers. */
+struct elliss_eval_state {
+    stack_t *stack;
+    struct stack_cache *cache;
+    gsl_vector *jac_th;
+    cmpl_vector *jac_n;
+    struct elliss_workspace *ws;
+    /* Index of the point stored in the first row of f and jacob. */
+    size_t row0;
+};
+
+static void
+elliss_eval_state_init(struct fit_engine *fit, int thread,
+                       struct elliss_eval_state *st)
+{
+    if(thread == 0) {
+        st->stack  = fit->stack;
+        st->cache  = &fit->run->cache;
+        st->jac_th = fit->run->jac_th;
+        st->jac_n  = fit->run->jac_n.ell;
+        st->ws     = fit->run->elliss_ws;
+    } else {
+        struct fit_worker *w = fit->run->workers + (thread - 1);
+        st->stack  = w->stack;
+        st->cache  = &w->cache;
+        st->jac_th = w->jac_th;
+        st->jac_n  = w->jac_n.ell;
+        st->ws     = w->elliss_ws;
+    }
+    st->row0 = 0;
+}
+
+static void
+elliss_fit_fdf_range(struct fit_engine *fit, struct elliss_eval_state *st,
+                     size_t j0, size_t j1, gsl_vector *f, gsl_matrix *jacob)
 {
-    struct fit_engine *fit = params;
     struct spectrum *s = fit->run->spectr;
     size_t nb_med = fit->stack->nb;
     struct {
@@ -88,77 +123,267 @@ elliss_fit_fdf(const gsl_vector *x, void *params, gsl_vector *f,
         gsl_vector *th;
         cmpl_vector *n;
     } wjacob;
-    size_t npt = spectra_points(s);
+    /* Number of points stored in f and jacob. The rows of beta follow the
+       ones of alpha. */
+    const size_t nrows = (f ? f->size : (jacob ? jacob->size1 : 0)) / 2;
     const enum se_type se_type = GET_SE_TYPE(fit->run->system_kind);
+    const struct stack_cache *tables = &fit->run->cache;
+    const struct elliss_kernels *kernels = &fit->run->elliss_kernels;
+    const int use_tables = (st->cache->th_only && tables->rc_full_spectr &&
+                            !REPEAT_BLOCK_IS_ACTIVE(&st->stack->repeat));
     size_t j;
 
-    /* STEP 1 : We apply the actual values of the fit parameters
-                to the stack. */
-
-    fit_engine_commit_parameters(fit, x);
-
-    /* STEP 2 : From the stack we retrive the thicknesses and RIs
-                informations. */
+    actual.ths = stack_get_ths_list(st->stack);
 
-    actual.ths = stack_get_ths_list(fit->stack);
+    wjacob.th = (jacob ? st->jac_th : NULL);
+    wjacob.n  = (jacob && !st->cache->th_only ? st->jac_n : NULL);
 
-    wjacob.th = (jacob ? fit->run->jac_th : NULL);
-    wjacob.n  = (jacob && !fit->run->cache.th_only ? fit->run->jac_n.ell : NULL);
+    if(! use_tables) {
+        fit_engine_update_media(fit, st->stack, j0, j1, jacob != NULL);
+    }
 
-    for(j = 0; j < npt; j++) {
+    for(j = j0; j < j1; j++) {
         float const * spectr_data = spectra_get_values(s, j);
         const double lambda     = spectr_data[0];
         const double meas_alpha = spectr_data[1];
         const double meas_beta  = spectr_data[2];
         const double phi0 = s->config.aoi;
         const double anlz = s->config.analyzer;
+        const double numap = s->config.numap;
         struct elliss_ab theory[1];
 
-        if(fit->run->cache.th_only) {
-            actual.ns = fit->run->cache.ns_full_spectr + j * nb_med;
-        } else {
-            actual.ns = fit->run->cache.ns;
-            stack_get_ns_list(fit->stack, actual.ns, lambda);
-        }
-
         /* STEP 3 : We call the ellipsometer kernel function */
 
-
-        mult_layer_se_jacob(se_type,
-                            nb_med, actual.ns, phi0, actual.ths, lambda,
-                            anlz, theory, wjacob.th, wjacob.n);
+        if(use_tables) {
+            kernels->precomp(se_type, nb_med,
+                             tables->rc_full_spectr + j * tables->rc_stride,
+                             tables->beta_full_spectr + j * (nb_med - 2),
+                             actual.ths, anlz, theory, wjacob.th, st->ws);
+        } else {
+            actual.ns = fit->run->cache.ns_full_spectr + j * nb_med;
+            kernels->jacob(se_type,
+                           nb_med, actual.ns, phi0, numap, actual.ths,
+                           &st->stack->repeat, lambda,
+                           anlz, theory, wjacob.th, wjacob.n, st->ws);
+        }
 
         if(f != NULL) {
-            gsl_vector_set(f, j,       theory->alpha - meas_alpha);
-            gsl_vector_set(f, npt + j, theory->beta  - meas_beta);
+            gsl_vector_set(f, j - st->row0,         theory->alpha - meas_alpha);
+            gsl_vector_set(f, nrows + j - st->row0, theory->beta  - meas_beta);
         }
 
         if(jacob) {
-            struct deriv_info * ideriv = fit->run->cache.deriv_info;
+            struct deriv_info * ideriv = st->cache->deriv_info;
             struct elliss_ab jac[1];
-            size_t kp, ic;
+            size_t kp;
 
-            if(! fit->run->cache.th_only) {
-                for(ic = 0; ic < nb_med; ic++) {
-                    ideriv[ic].is_valid = 0;
-                }
+            if(! st->cache->th_only) {
+                fit_engine_load_media_deriv(fit, j, ideriv);
             }
 
             for(kp = 0; kp < fit->parameters->number; kp++) {
                 fit_param_t *fp = fit->parameters->values + kp;
 
-                get_parameter_jacobian(fp, fit->stack, ideriv, lambda,
+                get_parameter_jacobian(fp, st->stack, ideriv, lambda,
                                        wjacob.th, wjacob.n, jac);
 
-                gsl_matrix_set(jacob, j,       kp, jac->alpha);
-                gsl_matrix_set(jacob, npt + j, kp, jac->beta);
+                gsl_matrix_set(jacob, j - st->row0,         kp, jac->alpha);
+                gsl_matrix_set(jacob, nrows + j - st->row0, kp, jac->beta);
             }
         }
     }
+}
+
+/* Compute only the residuals using the single precision kernels. */
+static void
+elliss_fit_f32_range(struct fit_engine *fit, struct elliss_eval_state *st,
+                     size_t j0, size_t j1, gsl_vector *f)
+{
+#define NB_F32_STATIC 16
+    struct spectrum *s = fit->run->spectr;
+    const struct stack_cache *tables = &fit->run->cache;
+    const int nb_med = fit->stack->nb;
+    const size_t nrows = f->size / 2;
+    const enum se_type se_type = GET_SE_TYPE(fit->run->system_kind);
+    const float phi0 = s->config.aoi;
+    const float anlz = s->config.analyzer;
+    double const * ths = stack_get_ths_list(st->stack);
+    float ds_static[NB_F32_STATIC], *ds = ds_static;
+    cmplf ns_static[NB_F32_STATIC], *ns = ns_static;
+    size_t j;
+    int k;
+
+    if(REPEAT_BLOCK_IS_ACTIVE(&st->stack->repeat) || s->config.numap > 0.0) {
+        elliss_fit_fdf_range(fit, st, j0, j1, f, NULL);
+        return;
+    }
+
+    if(nb_med > NB_F32_STATIC) {
+        ds = emalloc(nb_med * sizeof(float));
+        ns = emalloc(nb_med * sizeof(cmplf));
+    }
+
+    for(k = 0; k < nb_med - 2; k++) {
+        ds[k] = ths[k];
+    }
+
+    fit_engine_update_media(fit, st->stack, j0, j1, 0);
+
+    for(j = j0; j < j1; j++) {
+        float const * spectr_data = spectra_get_values(s, j);
+        const double lambda = spectr_data[0];
+        float e[2];
+
+        if(st->cache->th_only && tables->rc_f32_full_spectr) {
+            const cmplf *rc = (const cmplf *) tables->rc_f32_full_spectr;
+            const cmplf *beta = (const cmplf *) tables->beta_f32_full_spectr;
+            mult_layer_se_precomp_f32(se_type, nb_med,
+                                      rc + j * tables->rc_stride,
+                                      beta + j * (nb_med - 2), ds, anlz, e);
+        } else {
+            const cmpl *nsd = tables->ns_full_spectr + j * nb_med;
+
+            for(k = 0; k < nb_med; k++) {
+                ns[k] = nsd[k];
+            }
+
+            mult_layer_se_f32(se_type, nb_med, ns, phi0, ds, lambda, anlz, e);
+        }
+
+        gsl_vector_set(f, j - st->row0,         e[0] - spectr_data[1]);
+        gsl_vector_set(f, nrows + j - st->row0, e[1] - spectr_data[2]);
+    }
+
+    if(nb_med > NB_F32_STATIC) {
+        free(ds);
+        free(ns);
+    }
+#undef NB_F32_STATIC
+}
+
+struct elliss_parallel_job {
+    struct fit_engine *fit;
+    gsl_vector *f;
+    gsl_matrix *jacob;
+    /* Use the single precision kernels, residuals only. */
+    int single;
+};
+
+static void
+elliss_fit_fdf_task(void *data, int task, int thread)
+{
+    struct elliss_parallel_job *job = data;
+    struct fit_engine *fit = job->fit;
+    const size_t npt = spectra_points(fit->run->spectr);
+    const size_t j0 = task * FIT_WORKER_CHUNK;
+    const size_t j1 = (j0 + FIT_WORKER_CHUNK < npt ? j0 + FIT_WORKER_CHUNK : npt);
+    struct elliss_eval_state st[1];
+
+    elliss_eval_state_init(fit, thread, st);
+
+    if(job->single) {
+        elliss_fit_f32_range(fit, st, j0, j1, job->f);
+    } else {
+        elliss_fit_fdf_range(fit, st, j0, j1, job->f, job->jacob);
+    }
+}
+
+static int
+elliss_fit_eval(const gsl_vector *x, void *params, gsl_vector *f,
+                gsl_matrix * jacob, int single)
+{
+    struct fit_engine *fit = params;
+    const size_t npt = spectra_points(fit->run->spectr);
+
+    /* STEP 1 : We apply the actual values of the fit parameters
+                to the stack. */
+
+    fit_engine_commit_parameters(fit, x);
+
+    /* STEP 2 : The spectrum is evaluated, in parallel by chunks if
+                a worker pool is available. */
+
+    if(fit->run->pool) {
+        struct elliss_parallel_job job[1] = {{fit, f, jacob, single}};
+        const int nb_tasks = (npt + FIT_WORKER_CHUNK - 1) / FIT_WORKER_CHUNK;
+        fit_engine_sync_workers(fit, x);
+        worker_pool_run(fit->run->pool, elliss_fit_fdf_task, job, nb_tasks);
+    } else {
+        struct elliss_eval_state st[1];
+        elliss_eval_state_init(fit, 0, st);
+        if(single) {
+            elliss_fit_f32_range(fit, st, 0, npt, f);
+        } else {
+            elliss_fit_fdf_range(fit, st, 0, npt, f, jacob);
+        }
+    }
+
+    fit_engine_clean_media(fit, jacob != NULL);
+
+    return GSL_SUCCESS;
+}
+
+/* Evaluate a chunk of points in the buffers of the thread and add it to
+   its normal equations. */
+static void
+elliss_fit_normal_task(void *data, int task, int thread)
+{
+    struct fit_engine *fit = data;
+    struct fit_normal_acc *acc = fit->run->normal_acc + thread;
+    const size_t npt = spectra_points(fit->run->spectr);
+    const size_t j0 = task * FIT_WORKER_CHUNK;
+    const size_t j1 = (j0 + FIT_WORKER_CHUNK < npt ? j0 + FIT_WORKER_CHUNK : npt);
+    gsl_vector_view fv = gsl_vector_view_array(acc->f, 2 * (j1 - j0));
+    gsl_matrix_view jv = gsl_matrix_view_array(acc->jacob, 2 * (j1 - j0), fit->parameters->number);
+    struct elliss_eval_state st[1];
+
+    elliss_eval_state_init(fit, thread, st);
+    st->row0 = j0;
+
+    elliss_fit_fdf_range(fit, st, j0, j1, &fv.vector, &jv.matrix);
+    fit_normal_acc_add(acc, &fv.vector, &jv.matrix);
+}
+
+int
+elliss_fit_normal(const gsl_vector *x, void *params, gsl_matrix *jtj,
+                  gsl_vector *jtr, double *sumsq)
+{
+    struct fit_engine *fit = params;
+    const size_t npt = spectra_points(fit->run->spectr);
+    const int nb_tasks = (npt + FIT_WORKER_CHUNK - 1) / FIT_WORKER_CHUNK;
+    int k;
+
+    fit_engine_commit_parameters(fit, x);
+    fit_engine_normal_reset(fit);
+
+    if(fit->run->pool) {
+        fit_engine_sync_workers(fit, x);
+        worker_pool_run(fit->run->pool, elliss_fit_normal_task, fit, nb_tasks);
+    } else {
+        for(k = 0; k < nb_tasks; k++) {
+            elliss_fit_normal_task(fit, k, 0);
+        }
+    }
+
+    fit_engine_clean_media(fit, 1);
+    fit_engine_normal_sum(fit, jtj, jtr, sumsq);
 
     return GSL_SUCCESS;
 }
 
+int
+elliss_fit_fdf(const gsl_vector *x, void *params, gsl_vector *f,
+               gsl_matrix * jacob)
+{
+    return elliss_fit_eval(x, params, f, jacob, 0);
+}
+
+int
+elliss_fit_f32(const gsl_vector *x, void *params, gsl_vector * f)
+{
+    return elliss_fit_eval(x, params, f, NULL, 1);
+}
+
 int
 elliss_fit_f(const gsl_vector *x, void *params, gsl_vector * f)
 {
@@ -170,3 +395,46 @@ elliss_fit_df(const gsl_vector *x, void *params, gsl_matrix *jacob)
 {
     return elliss_fit_fdf(x, params, NULL, jacob);
 }
+
+int
+elliss_fit_f_bounded(const gsl_vector *x, void *params, gsl_vector *f,
+                     double bound, double *sumsq)
+{
+    struct fit_engine *fit = params;
+    const size_t npt = spectra_points(fit->run->spectr);
+    struct elliss_eval_state st[1];
+    double ssq = 0.0;
+    size_t j0, j;
+
+    elliss_eval_state_init(fit, 0, st);
+    fit_engine_commit_parameters(fit, x);
+
+    for(j0 = 0; j0 < npt; j0 += FIT_BOUND_CHECK_POINTS) {
+        size_t j1 = j0 + FIT_BOUND_CHECK_POINTS;
+
+        if(j1 > npt) {
+            j1 = npt;
+        }
+        if(fit->config->grid_single) {
+            elliss_fit_f32_range(fit, st, j0, j1, f);
+        } else {
+            elliss_fit_fdf_range(fit, st, j0, j1, f, NULL);
+        }
+
+        for(j = j0; j < j1; j++) {
+            const double ra = gsl_vector_get(f, j);
+            const double rb = gsl_vector_get(f, npt + j);
+            ssq += ra * ra + rb * rb;
+        }
+
+        if(ssq > bound) {
+            *sumsq = ssq;
+            return FIT_EVAL_PRUNED;
+        }
+    }
+
+    fit_engine_clean_media(fit, 0);
+
+    *sumsq = ssq;
+    return GSL_SUCCESS;
+}
@@ -13,6 +13,21 @@ extern int      elliss_fit_f(const gsl_vector *x, void *params,
 extern int      elliss_fit_df(const gsl_vector *x,
                               void *params, gsl_matrix *jacob);
 
+/* Same as elliss_fit_f but using the single precision kernels. */
+extern int      elliss_fit_f32(const gsl_vector *x, void *params,
+                               gsl_vector * f);
+
+/* Normal equations function, see fit_normal_func_t. */
+extern int      elliss_fit_normal(const gsl_vector *x, void *params,
+                                  gsl_matrix *jtj, gsl_vector *jtr,
+                                  double *sumsq);
+
+/* Bounded residual function, see fit_bounded_func_t. It uses the single
+   precision kernels if the config requests them for the grid search. */
+extern int      elliss_fit_f_bounded(const gsl_vector *x, void *params,
+                                     gsl_vector *f, double bound,
+                                     double *sumsq);
+
 #ifdef DEBUG_REGRESS
 
 struct fit_engine;
@@ -6,11 +6,13 @@
 #include "elliss-get-jacob.h"
 
 int
-elliss_multifit_fdf(const gsl_vector *x, void *params, gsl_vector *f,
-                    gsl_matrix * jacob)
+elliss_multifit_sample_fdf(struct multi_fit_engine *fit, int sample,
+                           gsl_vector *f, gsl_matrix *jacob, size_t priv_col)
 {
-    struct multi_fit_engine *fit = params;
-    size_t nb_med = fit->stack_list[0]->nb;
+    struct spectrum *spectrum = fit->spectra_list[sample];
+    stack_t *stack = fit->stack_list[sample];
+    struct multi_fit_sample *fs = fit->samples + sample;
+    size_t nb_med = stack->nb;
     struct {
         double const * ths;
         cmpl * ns;
@@ -19,106 +21,87 @@ elliss_multifit_fdf(const gsl_vector *x, void *params, gsl_vector *f,
         gsl_vector *th;
         cmpl_vector *n;
     } stack_jacob;
-    size_t samples_number = fit->samples_number;
     const enum se_type se_type = GET_SE_TYPE(fit->system_kind);
-    size_t j, j_sample, sample;
+    size_t npt = spectra_points(spectrum);
+    size_t j;
+
+    /* STEP 2 : From the stack we retrive the thicknesses and RIs
+                informations. */
+
+    actual.ths = stack_get_ths_list(stack);
 
-    /* STEP 1 : We apply the actual values of the fit parameters
-                to the stack. */
+    stack_jacob.th = (jacob ? fs->jac_th    : NULL);
+    stack_jacob.n  = (jacob ? fs->jac_n.ell : NULL);
 
-    multi_fit_engine_commit_parameters(fit, x);
+    for(j = 0; j < npt; j++) {
+        float const * spectr_data = spectra_get_values(spectrum, j);
+        const double lambda     = spectr_data[0];
+        const double meas_alpha = spectr_data[1];
+        const double meas_beta  = spectr_data[2];
+        const double phi0 = spectrum->config.aoi;
+        const double anlz = spectrum->config.analyzer;
+        const double numap = spectrum->config.numap;
+        struct elliss_ab theory[1];
 
-    j_sample = 0;
-    for(sample = 0; sample < samples_number; sample++) {
-        struct spectrum *spectrum = fit->spectra_list[sample];
-        size_t npt = spectra_points(spectrum);
+        actual.ns = fs->cache.ns;
+        stack_get_ns_list(stack, actual.ns, lambda);
 
-        /* STEP 2 : From the stack we retrive the thicknesses and RIs
-        informations. */
+        /* STEP 3 : We call the ellipsometer kernel function */
 
-        actual.ths = stack_get_ths_list(fit->stack_list[sample]);
+        mult_layer_se_jacob(se_type,
+                            nb_med, actual.ns, phi0, numap, actual.ths,
+                            &stack->repeat, lambda,
+                            anlz, theory, stack_jacob.th, stack_jacob.n,
+                            fs->elliss_ws);
 
-        stack_jacob.th = (jacob ? fit->jac_th    : NULL);
-        stack_jacob.n  = (jacob ? fit->jac_n.ell : NULL);
+        if(f != NULL) {
+            gsl_vector_set(f, j,       theory->alpha - meas_alpha);
+            gsl_vector_set(f, j + npt, theory->beta  - meas_beta);
+        }
 
-        for(j = 0; j < npt; j++, j_sample++) {
-            float const * spectr_data = spectra_get_values(spectrum, j);
-            const double lambda     = spectr_data[0];
-            const double meas_alpha = spectr_data[1];
-            const double meas_beta  = spectr_data[2];
-            const double phi0 = spectrum->config.aoi;
-            const double anlz = spectrum->config.analyzer;
-            struct elliss_ab theory[1];
+        if(jacob) {
+            struct deriv_info * ideriv = fs->cache.deriv_info;
+            struct elliss_ab jac[1];
+            size_t kp, ic;
 
-            actual.ns = fit->cache.ns;
-            stack_get_ns_list(fit->stack_list[sample], actual.ns, lambda);
+            for(ic = 0; ic < nb_med; ic++) {
+                ideriv[ic].is_valid = 0;
+            }
 
-            /* STEP 3 : We call the ellipsometer kernel function */
+            for(kp = 0; kp < fit->common_parameters->number; kp++) {
+                fit_param_t const *fp = fit->common_parameters->values + kp;
 
-            mult_layer_se_jacob(se_type,
-                                nb_med, actual.ns, phi0, actual.ths, lambda,
-                                anlz, theory, stack_jacob.th, stack_jacob.n);
+                get_parameter_jacobian(fp, stack, ideriv, lambda,
+                                       stack_jacob.th, stack_jacob.n,
+                                       jac);
 
-            if(f != NULL) {
-                gsl_vector_set(f, j_sample,       theory->alpha - meas_alpha);
-                gsl_vector_set(f, j_sample + npt, theory->beta  - meas_beta);
+                gsl_matrix_set(jacob, j,       kp, jac->alpha);
+                gsl_matrix_set(jacob, j + npt, kp, jac->beta);
             }
 
-            if(jacob) {
-                struct deriv_info * ideriv = fit->cache.deriv_info;
-                const size_t nb_comm_params = fit->common_parameters->number;
-                const size_t nb_priv_params = fit->private_parameters->number;
-                size_t nb_params =					\
-                                                    nb_comm_params + nb_priv_params * samples_number;
-                struct elliss_ab jac[1];
-                size_t kp, ikp, ic;
-
-                for(ic = 0; ic < nb_med; ic++) {
-                    ideriv[ic].is_valid = 0;
-                }
-
-                for(kp = 0; kp < nb_comm_params; kp++) {
-                    fit_param_t const *fp = fit->common_parameters->values + kp;
-
-                    get_parameter_jacobian(fp, fit->stack_list[sample],
-                                           ideriv, lambda,
-                                           stack_jacob.th, stack_jacob.n,
-                                           jac);
-
-                    gsl_matrix_set(jacob, j_sample,       kp, jac->alpha);
-                    gsl_matrix_set(jacob, j_sample + npt, kp, jac->beta);
-                }
-
-                for(ikp = 0; ikp < nb_priv_params * sample; ikp++, kp++) {
-                    gsl_matrix_set(jacob, j_sample,       kp, 0.0);
-                    gsl_matrix_set(jacob, j_sample + npt, kp, 0.0);
-                }
-
-                for(ikp = 0; ikp < nb_priv_params; kp++, ikp++) {
-                    fit_param_t *fp = fit->private_parameters->values + ikp;
-
-                    get_parameter_jacobian(fp, fit->stack_list[sample],
-                                           ideriv, lambda,
-                                           stack_jacob.th, stack_jacob.n,
-                                           jac);
-
-                    gsl_matrix_set(jacob, j_sample,       kp, jac->alpha);
-                    gsl_matrix_set(jacob, j_sample + npt, kp, jac->beta);
-                }
-
-                for(/* */; kp < nb_params; kp++) {
-                    gsl_matrix_set(jacob, j_sample,       kp, 0.0);
-                    gsl_matrix_set(jacob, j_sample + npt, kp, 0.0);
-                }
+            for(kp = 0; kp < fit->private_parameters->number; kp++) {
+                fit_param_t *fp = fit->private_parameters->values + kp;
+
+                get_parameter_jacobian(fp, stack, ideriv, lambda,
+                                       stack_jacob.th, stack_jacob.n,
+                                       jac);
+
+                gsl_matrix_set(jacob, j,       priv_col + kp, jac->alpha);
+                gsl_matrix_set(jacob, j + npt, priv_col + kp, jac->beta);
             }
         }
-
-        j_sample += npt;
     }
 
     return GSL_SUCCESS;
 }
 
+int
+elliss_multifit_fdf(const gsl_vector *x, void *params, gsl_vector *f,
+                    gsl_matrix * jacob)
+{
+    return multi_fit_engine_fdf(params, x, f, jacob);
+}
+
 int
 elliss_multifit_f(const gsl_vector *x, void *params, gsl_vector * f)
 {
@@ -18,6 +18,8 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
  */
 
+#include <assert.h>
+
 #include "elliss.h"
 
 static inline cmpl
@@ -26,45 +28,39 @@ csqr(cmpl x)
     return x*x;
 }
 
-static cmpl
-refl_coeff(cmpl nt, cmpl cost, cmpl nb, cmpl cosb, polar_t pol)
+/* Fresnel coefficients for the S and P polarizations. The products
+   common to both the polarizations are computed only once. */
+static inline void
+refl_coeff_sp(cmpl nt, cmpl cost, cmpl nb, cmpl cosb, cmpl r[2])
 {
-    cmpl rc;
-
-    if(pol == POL_P) {
-        rc = (nb*cost - nt*cosb) / (nb*cost + nt*cosb);
-    } else {
-        rc = (nt*cost - nb*cosb) / (nt*cost + nb*cosb);
-    }
+    const cmpl a = nt*cost, b = nb*cosb;
+    const cmpl c = nb*cost, d = nt*cosb;
 
-    return rc;
+    r[POL_S] = (a - b) / (a + b);
+    r[POL_P] = (c - d) / (c + d);
 }
 
 /* NB: drdnt given by this procedure is conceptually wrong if the
    medium of "nt" is the topmost medium (environment). That's because
    we assume that the angle of incidence is fixed a priori. */
-static cmpl
-refl_coeff_ext(cmpl nt, cmpl cost,
-               cmpl nb, cmpl cosb,
-               cmpl * drdnt, cmpl * drdnb, polar_t pol)
+static inline void
+refl_coeff_ext_sp(cmpl nt, cmpl cost, cmpl nb, cmpl cosb,
+                  cmpl r[2], cmpl drdnt[2], cmpl drdnb[2])
 {
-    cmpl rc;
-
-    if(pol == POL_P) {
-        cmpl den = nb*cost + nt*cosb;
-        cmpl isqden = 1 / csqr(den);
-        rc = (nb*cost - nt*cosb) / den;
-        *drdnt = - 2.0 * cosb * nb * (2*cost*cost-1) * isqden / cost;
-        *drdnb =   2.0 * cost * nt * (2*cosb*cosb-1) * isqden / cosb;
-    } else {
-        cmpl den = nt*cost + nb*cosb;
-        cmpl isqden = 1 / csqr(den);
-        rc = (nt*cost - nb*cosb) / den;
-        *drdnt =   2.0 * cosb * nb * isqden / cost;
-        *drdnb = - 2.0 * cost * nt * isqden / cosb;
-    }
+    const cmpl a = nt*cost, b = nb*cosb;
+    const cmpl c = nb*cost, d = nt*cosb;
+    const cmpl den_s = a + b, den_p = c + d;
+    const cmpl isqden_s = 1 / csqr(den_s), isqden_p = 1 / csqr(den_p);
+    const cmpl icost = 1 / cost, icosb = 1 / cosb;
+
+    r[POL_S] = (a - b) * den_s * isqden_s;
+    r[POL_P] = (c - d) * den_p * isqden_p;
 
-    return rc;
+    drdnt[POL_S] =   2.0 * b * isqden_s * icost;
+    drdnb[POL_S] = - 2.0 * a * isqden_s * icosb;
+
+    drdnt[POL_P] = - 2.0 * b * (2*cost*cost-1) * isqden_p * icost;
+    drdnb[POL_P] =   2.0 * a * (2*cosb*cosb-1) * isqden_p * icosb;
 }
 
 static cmpl
@@ -74,9 +70,122 @@ snell_cos(cmpl nsin0, cmpl nlyr)
     return csqrt(1.0 - csqr(s));
 }
 
+/* Scratch used to evaluate the repeated copies of a block of layers. */
+struct elliss_repeat {
+    /* NULL if there is no repeated block. */
+    const struct repeat_block *block;
+    /* The steps of the block for the S and then the P polarization. */
+    struct repeat_step *steps;
+    cmpl *work;
+    /* For each polarization, derivatives of the reflection coefficient
+       after the repeated copies respect to the thicknesses and refractive
+       indexes of the block (2 * length values) and respect to the
+       coefficient below the copies. */
+    cmpl *jac;
+    cmpl dfdR[2];
+};
+
+/* The repeated copies of the block are applied just before the step
+   "first + length - 2", the step that enters the last medium of the
+   topmost copy. */
+#define REPEAT_STEP(rep) ((rep)->first + (rep)->length - 2)
+
+/* Apply the lower copies of the repeated block to R for both the
+   polarizations. The derivatives are computed for the thicknesses only if
+   jacob == 1 and also for the refractive indexes if jacob == 2. */
 static void
+apply_repeat(struct elliss_repeat *rp, const cmpl ns[], cmpl nsin0,
+             const double ds[], double omega, cmpl R[], int jacob)
+{
+    const int first = rp->block->first, length = rp->block->length;
+    struct repeat_step *steps[2] = {rp->steps, rp->steps + length};
+    polar_t p;
+    int i;
+
+    for(i = 0; i < length; i++) {
+        cmpl nt = ns[i == 0 ? first + length - 1 : first + i - 1];
+        cmpl nc = ns[first + i];
+        cmpl cost = snell_cos(nsin0, nt), cosc = snell_cos(nsin0, nc);
+        double th = ds[first + i - 1];
+        cmpl beta = - 2.0 * I * omega * nc * cosc;
+        cmpl rho = cexp(beta * THICKNESS_TO_NM(th));
+        cmpl drhodth = rho * beta * THICKNESS_TO_NM(1.0);
+        cmpl r[2], drdnt[2], drdnb[2];
+
+        if(jacob == 2) {
+            cmpl drhodn = - 2.0 * I * rho * omega * THICKNESS_TO_NM(th) / cosc;
+            refl_coeff_ext_sp(nt, cost, nc, cosc, r, drdnt, drdnb);
+            for(p = 0; p <= 1; p++) {
+                steps[p][i].drdnt = drdnt[p];
+                steps[p][i].drdnb = drdnb[p];
+                steps[p][i].drhodn = drhodn;
+            }
+        } else {
+            refl_coeff_sp(nt, cost, nc, cosc, r);
+        }
+
+        for(p = 0; p <= 1; p++) {
+            steps[p][i].r = r[p];
+            steps[p][i].rho = rho;
+            steps[p][i].drhodth = drhodth;
+        }
+    }
+
+    for(p = 0; p <= 1; p++) {
+        cmpl *pjac = rp->jac + 2 * length * p;
+        R[p] = repeat_block_apply(length, rp->block->times, steps[p], R[p],
+                                  (jacob ? &rp->dfdR[p] : NULL),
+                                  (jacob ? pjac : NULL),
+                                  (jacob == 2 ? pjac + length : NULL),
+                                  rp->work);
+    }
+}
+
+/* Backward sweep of the adjoint method for one polarization. On entry
+   jacth[j] and jacn[j+1] contain the derivatives of the reflection
+   coefficient obtained at the step "j" of the recursion and dfdR[j] the
+   derivative of the step "j" respect to the reflection coefficient of the
+   step before. On exit they are the derivatives of the final reflection
+   coefficient. */
+KERNEL_INLINE void
+adjoint_sweep(int nb, const cmpl dfdR[], cmpl *jacth, cmpl *jacn,
+              const struct elliss_repeat *rp, polar_t p)
+{
+    const struct repeat_block *rep = rp->block;
+    cmpl pf = 1.0, pf_repeat = 0.0;
+    int j;
+
+    for(j = 0; j < nb - 2; j++) {
+        jacth[j] *= pf;
+        if(jacn) {
+            jacn[j+1] *= pf;
+        }
+        pf *= dfdR[j];
+        if(rep && j == REPEAT_STEP(rep)) {
+            pf_repeat = pf;
+            pf *= rp->dfdR[p];
+        }
+    }
+
+    if(jacn) {
+        jacn[nb-1] *= pf;
+    }
+
+    if(rep) {
+        const cmpl *pjac = rp->jac + 2 * rep->length * p;
+        for(j = 0; j < rep->length; j++) {
+            jacth[rep->first + j - 1] += pf_repeat * pjac[j];
+            if(jacn) {
+                jacn[rep->first + j] += pf_repeat * pjac[rep->length + j];
+            }
+        }
+    }
+}
+
+KERNEL_INLINE void
 mult_layer_refl(int nb, const cmpl ns[], cmpl nsin0,
-                const double ds[], double lambda, cmpl R[])
+                const double ds[], double lambda, cmpl R[],
+                struct elliss_repeat *rp)
 {
     const double omega = 2 * M_PI / lambda;
     cmpl cosc, cost;
@@ -91,14 +200,17 @@ mult_layer_refl(int nb, const cmpl ns[], cmpl nsin0,
     cost = snell_cos(nsin0, nptr[0]);
     cosc = snell_cos(nsin0, nptr[1]);
 
-    R[0] = refl_coeff(nptr[0], cost, nptr[1], cosc, POL_S);
-    R[1] = refl_coeff(nptr[0], cost, nptr[1], cosc, POL_P);
+    refl_coeff_sp(nptr[0], cost, nptr[1], cosc, R);
 
     for(j = nb - 3; j >= 0; j--) {
         cmpl r[2], rho, beta;
         double th = ds[j];
         polar_t p;
 
+        if(rp->block && j == REPEAT_STEP(rp->block)) {
+            apply_repeat(rp, ns, nsin0, ds, omega, R, 0);
+        }
+
         nptr --;
 
         cosc = cost;
@@ -107,18 +219,19 @@ mult_layer_refl(int nb, const cmpl ns[], cmpl nsin0,
         beta = - 2.0 * I * omega * nptr[1] * cosc;
         rho = cexp(beta * THICKNESS_TO_NM(th));
 
-        for(p = 0; p <= 1; p++) {
-            r[p] = refl_coeff(nptr[0], cost, nptr[1], cosc, p);
+        refl_coeff_sp(nptr[0], cost, nptr[1], cosc, r);
 
-            R[p] = (r[p] + R[p] * rho) / (1 + r[p] * R[p] * rho);
+        for(p = 0; p <= 1; p++) {
+            const cmpl Rrho = R[p] * rho;
+            R[p] = (r[p] + Rrho) / (1 + r[p] * Rrho);
         }
     }
 }
 
-static void
+KERNEL_INLINE void
 mult_layer_refl_jacob_th(int nb, const cmpl ns[], cmpl nsin0,
                          const double ds[], double lambda, cmpl R[],
-                         cmpl *jacth)
+                         cmpl *jacth, cmpl *dfdR, struct elliss_repeat *rp)
 {
     const double omega = 2 * M_PI / lambda;
     const int nblyr = nb - 2;
@@ -134,14 +247,16 @@ mult_layer_refl_jacob_th(int nb, const cmpl ns[], cmpl nsin0,
     cost = snell_cos(nsin0, nptr[0]);
     cosc = snell_cos(nsin0, nptr[1]);
 
-    R[0] = refl_coeff(nptr[0], cost, nptr[1], cosc, POL_S);
-    R[1] = refl_coeff(nptr[0], cost, nptr[1], cosc, POL_P);
+    refl_coeff_sp(nptr[0], cost, nptr[1], cosc, R);
 
     for(j = nb - 3; j >= 0; j--) {
         cmpl r[2], rho, beta, drhodth;
         double th = ds[j];
         polar_t p;
-        int k;
+
+        if(rp->block && j == REPEAT_STEP(rp->block)) {
+            apply_repeat(rp, ns, nsin0, ds, omega, R, 1);
+        }
 
         nptr --;
 
@@ -152,34 +267,29 @@ mult_layer_refl_jacob_th(int nb, const cmpl ns[], cmpl nsin0,
         rho = cexp(beta * THICKNESS_TO_NM(th));
         drhodth = rho * beta * THICKNESS_TO_NM(1.0);
 
-        for(p = 0; p <= 1; p++) {
-            cmpl dfdR, dfdrho;
-            cmpl *pjacth = jacth + (p == 0 ? 0 : nblyr);
-            cmpl den, isqden;
-
-            r[p] = refl_coeff(nptr[0], cost, nptr[1], cosc, p);
-
-            den = 1 + r[p] * R[p] * rho;
-            isqden = 1 / csqr(den);
-            dfdR = rho * (1 - r[p]*r[p]) * isqden;
+        refl_coeff_sp(nptr[0], cost, nptr[1], cosc, r);
 
-            for(k = nblyr; k > j+1; k--) {
-                pjacth[k-1] *= dfdR;
-            }
-
-            dfdrho = R[p] * (1 - r[p]*r[p]) * isqden;
+        for(p = 0; p <= 1; p++) {
+            const cmpl Rrho = R[p] * rho;
+            const cmpl den = 1 + r[p] * Rrho;
+            const cmpl num = (1 - r[p]*r[p]) / csqr(den);
 
-            pjacth[j] = dfdrho * drhodth;
+            dfdR[p * nblyr + j]  = rho * num;
+            jacth[p * nblyr + j] = R[p] * num * drhodth;
 
-            R[p] = (r[p] + R[p] * rho) / den;
+            R[p] = (r[p] + Rrho) / den;
         }
     }
+
+    adjoint_sweep(nb, dfdR,         jacth,         NULL, rp, POL_S);
+    adjoint_sweep(nb, dfdR + nblyr, jacth + nblyr, NULL, rp, POL_P);
 }
 
-static void
+KERNEL_INLINE void
 mult_layer_refl_jacob(int nb, const cmpl ns[], cmpl nsin0,
                       const double ds[], double lambda, cmpl R[],
-                      cmpl *jacth, cmpl *jacn)
+                      cmpl *jacth, cmpl *jacn, cmpl *dfdR,
+                      struct elliss_repeat *rp)
 {
     const double omega = 2 * M_PI / lambda;
     const int nblyr = nb - 2;
@@ -196,10 +306,7 @@ mult_layer_refl_jacob(int nb, const cmpl ns[], cmpl nsin0,
     cost = snell_cos(nsin0, nptr[0]);
     cosc = snell_cos(nsin0, nptr[1]);
 
-    R[0] = refl_coeff_ext(nptr[0], cost, nptr[1], cosc,
-                          &drdnt[0], &drdnb[0], POL_S);
-    R[1] = refl_coeff_ext(nptr[0], cost, nptr[1], cosc,
-                          &drdnt[1], &drdnb[1], POL_P);
+    refl_coeff_ext_sp(nptr[0], cost, nptr[1], cosc, R, drdnt, drdnb);
 
     jacn[nb-1]      = drdnb[0];
     jacn[nb + nb-1] = drdnb[1];
@@ -211,7 +318,12 @@ mult_layer_refl_jacob(int nb, const cmpl ns[], cmpl nsin0,
         cmpl r[2], rho, beta, drhodn, drhodth;
         double th = ds[j];
         polar_t p;
-        int k;
+
+        if(rp->block && j == REPEAT_STEP(rp->block)) {
+            apply_repeat(rp, ns, nsin0, ds, omega, R, 2);
+            jacn[j+1]      *= rp->dfdR[0];
+            jacn[nb + j+1] *= rp->dfdR[1];
+        }
 
         nptr --;
 
@@ -223,81 +335,168 @@ mult_layer_refl_jacob(int nb, const cmpl ns[], cmpl nsin0,
         drhodth = rho * beta * THICKNESS_TO_NM(1.0);
         drhodn = - 2.0 * I * rho * omega * THICKNESS_TO_NM(th) / cosc;
 
+        refl_coeff_ext_sp(nptr[0], cost, nptr[1], cosc, r, drdnt, drdnb);
+
         for(p = 0; p <= 1; p++) {
-            cmpl dfdR, dfdr, dfdrho;
-            cmpl *pjacn  = jacn  + (p == 0 ? 0 : nb);
-            cmpl *pjacth = jacth + (p == 0 ? 0 : nblyr);
-            cmpl den, isqden;
+            cmpl *pjacn = jacn + p * nb;
+            const cmpl Rrho = R[p] * rho;
+            const cmpl den = 1 + r[p] * Rrho;
+            const cmpl isqden = 1 / csqr(den);
+            const cmpl dfdr = (1 - csqr(Rrho)) * isqden;
+            const cmpl dfdrho = R[p] * (1 - r[p]*r[p]) * isqden;
+            const cmpl g = rho * (1 - r[p]*r[p]) * isqden;
+
+            dfdR[p * nblyr + j] = g;
+
+            /* Derivatives of the reflection coefficient of this step only,
+               they are propagated by the backward sweep. */
+            pjacn[j+1] = g * pjacn[j+1] + dfdr * drdnb[p] + dfdrho * drhodn;
+            pjacn[j] = (j == 0 ? 0.0 : dfdr * drdnt[p]);
 
-            r[p] = refl_coeff_ext(nptr[0], cost, nptr[1], cosc,
-                                  &drdnt[p], &drdnb[p], p);
+            jacth[p * nblyr + j] = dfdrho * drhodth;
 
-            den = 1 + r[p] * R[p] * rho;
-            isqden = 1 / csqr(den);
-            dfdR = rho * (1 - r[p]*r[p]) * isqden;
+            R[p] = (r[p] + Rrho) / den;
+        }
+    }
 
-            for(k = nb - 1; k > j+1; k--) {
-                pjacn[k] *= dfdR;
-            }
+    adjoint_sweep(nb, dfdR,         jacth,         jacn,      rp, POL_S);
+    adjoint_sweep(nb, dfdR + nblyr, jacth + nblyr, jacn + nb, rp, POL_P);
+}
 
-            for(k = nblyr; k > j+1; k--) {
-                pjacth[k-1] *= dfdR;
-            }
+/* Nodes and weights of the Gauss-Chebyshev quadrature of the second kind
+   used to average over the angular spread of the beam. The weights are
+   normalized so that their sum is one. */
+#define NA_NODES 5
+
+static const double na_nodes[NA_NODES] = {
+    -0.86602540378443865, -0.5, 0.0, 0.5, 0.86602540378443865
+};
+
+static const double na_weights[NA_NODES] = {
+    1.0/12.0, 1.0/4.0, 1.0/3.0, 1.0/4.0, 1.0/12.0
+};
+
+/* Reflection coefficients averaged over the angles of incidence of the
+   nodes. The sine of the angles are given by "sinphi". All the nodes are
+   evaluated together layer by layer so that the quantities that do not
+   depend on the angle are computed only once. */
+KERNEL_INLINE void
+mult_layer_refl_na_batch(int nb, const cmpl ns[], const double sinphi[],
+                         const double ds[], double lambda, cmpl R[])
+{
+    const double omega = 2 * M_PI / lambda;
+    cmpl cost[NA_NODES], cosc[NA_NODES], Rq[2][NA_NODES];
+    cmpl q;
+    int j, k;
 
-            dfdr = (1 - csqr(R[p]*rho)) * isqden;
-            dfdrho = R[p] * (1 - r[p]*r[p]) * isqden;
+    q = ns[0] / ns[nb-1];
+    for(k = 0; k < NA_NODES; k++) {
+        cosc[k] = csqrt(1.0 - csqr(q * sinphi[k]));
+    }
 
-            pjacn[j+1] = dfdR * pjacn[j+1] + dfdr * drdnb[p] + dfdrho * drhodn;
-            pjacn[j] = (j == 0 ? 0.0 : dfdr * drdnt[p]);
+    for(j = nb - 2; j >= 0; j--) {
+        const cmpl nt = ns[j], nc = ns[j+1];
+        const cmpl bpre = (j < nb - 2 ? - 2.0 * I * omega * nc * THICKNESS_TO_NM(ds[j]) : 0.0);
 
-            pjacth[j] = dfdrho * drhodth;
+        q = ns[0] / nt;
 
-            R[p] = (r[p] + R[p] * rho) / den;
+        for(k = 0; k < NA_NODES; k++) {
+            cmpl r[2];
+            polar_t p;
+
+            cost[k] = csqrt(1.0 - csqr(q * sinphi[k]));
+            refl_coeff_sp(nt, cost[k], nc, cosc[k], r);
+
+            if(j == nb - 2) {
+                Rq[POL_S][k] = r[POL_S];
+                Rq[POL_P][k] = r[POL_P];
+            } else {
+                const cmpl rho = cexp(bpre * cosc[k]);
+                for(p = 0; p <= 1; p++) {
+                    const cmpl Rrho = Rq[p][k] * rho;
+                    Rq[p][k] = (r[p] + Rrho) / (1 + r[p] * Rrho);
+                }
+            }
+
+            cosc[k] = cost[k];
         }
     }
+
+    R[POL_S] = R[POL_P] = 0.0;
+    for(k = 0; k < NA_NODES; k++) {
+        R[POL_S] += na_weights[k] * Rq[POL_S][k];
+        R[POL_P] += na_weights[k] * Rq[POL_P][k];
+    }
 }
 
-#if 0
+/* Reflection coefficients, and optionally their derivatives, averaged
+   over the angular spread of a beam of numerical aperture "numap". The
+   averaged derivatives are stored in ws->na_jac_th and ws->na_jac_n. */
 static void
-multlayer_refl_na(int nb, const cmpl ns[], cmpl nsin0,
-                  const double ds[], double lambda, cmpl R[],
-                  double numap)
+mult_layer_refl_na(int nb, const cmpl ns[], double phi0, double numap,
+                   const double ds[], double lambda, cmpl R[],
+                   int jacob_th, int jacob_n, struct elliss_workspace *ws,
+                   struct elliss_repeat *rp)
 {
-    const int ndiv = 16;
-    double phi0 = asin(creal(nsin0 / ns[0]));  // should be real
-    double dphi = asin(numap);
-    double xr[3];
-    int j;
+    const double dphi = asin(numap);
+    const int nblyr = nb - 2;
+    double sinphi[NA_NODES];
+    int j, k;
+
+    for(k = 0; k < NA_NODES; k++) {
+        sinphi[k] = sin(phi0 + dphi * na_nodes[k]);
+    }
 
-    R[0] = R[1] = 0.0i;
+    if(!jacob_th && !rp->block) {
+        mult_layer_refl_na_batch(nb, ns, sinphi, ds, lambda, R);
+        return;
+    }
 
-    xr[2] = -1.0;
-    for(j = -ndiv/2 + 1; j <= ndiv/2; j++) {
-        double dxr;
-        int k, klim;
+    R[POL_S] = R[POL_P] = 0.0;
 
-        xr[0] = xr[2];
-        xr[2] = sin(2 * j * M_PI_2 / ndiv);
-        xr[1] = (xr[0] + xr[2]) / 2;
+    if(jacob_th) {
+        for(j = 0; j < 2 * nblyr; j++) {
+            ws->na_jac_th[j] = 0.0;
+        }
+    }
 
-        dxr = xr[2] - xr[0];
+    if(jacob_n) {
+        for(j = 0; j < 2 * nb; j++) {
+            ws->na_jac_n[j] = 0.0;
+        }
+    }
 
-        klim = (j == ndiv/2 ? 2 : 3);
+    for(k = 0; k < NA_NODES; k++) {
+        const cmpl nsin0 = ns[0] * sinphi[k];
+        const double w = na_weights[k];
+        cmpl Rx[2];
+
+        if(jacob_th && jacob_n) {
+            mult_layer_refl_jacob(nb, ns, nsin0, ds, lambda, Rx, ws->jac_th,
+                                  ws->jac_n, ws->dfdR, rp);
+        } else if(jacob_th) {
+            mult_layer_refl_jacob_th(nb, ns, nsin0, ds, lambda, Rx,
+                                     ws->jac_th, ws->dfdR, rp);
+        } else {
+            mult_layer_refl(nb, ns, nsin0, ds, lambda, Rx, rp);
+        }
 
-        for(k = 1; k < klim; k++) {
-            const int sc[3] = {1, 4, 2};
-            cmpl nsin0x = ns[0] * sin(phi0 + dphi * xr[k]);
-            double rf = sqrt(1 - xr[k] * xr[k]);
-            cmpl Rx[2];
+        R[POL_S] += w * Rx[POL_S];
+        R[POL_P] += w * Rx[POL_P];
 
-            mult_layer_refl(nb, ns, nsin0x, ds, lambda, Rx);
+        if(jacob_th) {
+            for(j = 0; j < 2 * nblyr; j++) {
+                ws->na_jac_th[j] += w * ws->jac_th[j];
+            }
+        }
 
-            R[0] += rf * sc[k] * dxr * Rx[0] / (6 * M_PI_2);
-            R[1] += rf * sc[k] * dxr * Rx[1] / (6 * M_PI_2);
+        if(jacob_n) {
+            for(j = 0; j < 2 * nb; j++) {
+                ws->na_jac_n[j] += w * ws->jac_n[j];
+            }
         }
     }
 }
-#endif
 
 /* NB: In this case we are treating a Psi-Delta spectrum and
    the fields named alpha and beta corresponds actually to
@@ -353,42 +552,105 @@ se_ab_der(cmpl R[], cmpl dR[], double tanlz, cmpl *dalpha, cmpl *dbeta)
     *dbeta = 2 * tanlz * z * isqden;
 }
 
+static void
+set_jacob_th(enum se_type type, int nblyr, cmpl R[], const cmpl jacth[],
+             double tanlz, gsl_vector *jacob_th)
+{
+    int j;
+
+    for(j = 0; j < nblyr; j++) {
+        struct {
+            cmpl alpha, beta;
+        } d;
+        cmpl dR[2] = {jacth[j], jacth[nblyr+j]};
+
+        if(type == SE_ALPHA_BETA) {
+            se_ab_der(R, dR, tanlz, &d.alpha, &d.beta);
+        } else {
+            se_psidel_der(R, dR, &d.alpha, &d.beta);
+        }
+
+        gsl_vector_set(jacob_th, j, creal(d.alpha));
+        gsl_vector_set(jacob_th, nblyr+j, creal(d.beta));
+    }
+}
+
+struct elliss_workspace *
+elliss_workspace_alloc(size_t nb)
+{
+    struct elliss_workspace *ws = emalloc(sizeof(struct elliss_workspace));
+    ws->nb = nb;
+    ws->jac_th = emalloc(2 * nb * sizeof(cmpl));
+    ws->jac_n  = emalloc(2 * nb * sizeof(cmpl));
+    ws->dfdR   = emalloc(2 * nb * sizeof(cmpl));
+    ws->repeat_steps = emalloc(2 * nb * sizeof(struct repeat_step));
+    ws->repeat_work  = emalloc(REPEAT_BLOCK_WORKSPACE(nb) * sizeof(cmpl));
+    ws->repeat_jac   = emalloc(4 * nb * sizeof(cmpl));
+    ws->na_jac_th = emalloc(2 * nb * sizeof(cmpl));
+    ws->na_jac_n  = emalloc(2 * nb * sizeof(cmpl));
+    return ws;
+}
+
 void
-mult_layer_se_jacob(enum se_type type,
-                    size_t _nb, const cmpl ns[], double phi0,
-                    const double ds[], double lambda,
-                    double anlz, ell_ab_t e,
-                    gsl_vector *jacob_th, cmpl_vector *jacob_n)
+elliss_workspace_free(struct elliss_workspace *ws)
+{
+    free(ws->jac_th);
+    free(ws->jac_n);
+    free(ws->dfdR);
+    free(ws->repeat_steps);
+    free(ws->repeat_work);
+    free(ws->repeat_jac);
+    free(ws->na_jac_th);
+    free(ws->na_jac_n);
+    free(ws);
+}
+
+KERNEL_INLINE void
+se_jacob_kernel(enum se_type type,
+                const int nb, const cmpl ns[], double phi0, double numap,
+                const double ds[], const struct repeat_block *rep,
+                double lambda, double anlz, ell_ab_t e,
+                gsl_vector *jacob_th, cmpl_vector *jacob_n,
+                struct elliss_workspace *ws)
 {
-#define NB_JAC_STATIC 10
-    static struct {
-        cmpl th[2*NB_JAC_STATIC], n[2*NB_JAC_STATIC];
-    } jacs;
     struct {
         cmpl *th, *n;
-    } jac;
-    const int nb = _nb, nblyr = nb - 2;
-    int use_static = (nb <= NB_JAC_STATIC);
+    } jac = {NULL, NULL};
+    struct elliss_repeat rp[1];
+    const int nblyr = nb - 2;
     double tanlz = tan(anlz);
     cmpl R[2], nsin0;
     size_t j;
 
-    if(use_static) {
-        jac.th = jacs.th;
-        jac.n  = jacs.n;
-    } else {
-        jac.th = emalloc(2*nb*sizeof(cmpl));
-        jac.n  = emalloc(2*nb*sizeof(cmpl));
-    }
+    rp->block = (REPEAT_BLOCK_IS_ACTIVE(rep) ? rep : NULL);
 
-    nsin0 = ns[0] * csin((cmpl) phi0);
+    if(jacob_th || jacob_n || rp->block) {
+        assert(ws != NULL && ws->nb >= (size_t) nb);
+        jac.th = ws->jac_th;
+        jac.n  = ws->jac_n;
+        rp->steps = ws->repeat_steps;
+        rp->work  = ws->repeat_work;
+        rp->jac   = ws->repeat_jac;
+    }
 
-    if(jacob_th && jacob_n) {
-        mult_layer_refl_jacob(nb, ns, nsin0, ds, lambda, R, jac.th, jac.n);
+    if(numap > 0.0) {
+        mult_layer_refl_na(nb, ns, phi0, numap, ds, lambda, R,
+                           jacob_th != NULL, jacob_n != NULL, ws, rp);
+        if(jacob_th) {
+            jac.th = ws->na_jac_th;
+            jac.n  = ws->na_jac_n;
+        }
+    } else if(jacob_th && jacob_n) {
+        nsin0 = ns[0] * csin((cmpl) phi0);
+        mult_layer_refl_jacob(nb, ns, nsin0, ds, lambda, R, jac.th, jac.n,
+                              ws->dfdR, rp);
     } else if(jacob_th) {
-        mult_layer_refl_jacob_th(nb, ns, nsin0, ds, lambda, R, jac.th);
+        nsin0 = ns[0] * csin((cmpl) phi0);
+        mult_layer_refl_jacob_th(nb, ns, nsin0, ds, lambda, R, jac.th,
+                                 ws->dfdR, rp);
     } else {
-        mult_layer_refl(nb, ns, nsin0, ds, lambda, R);
+        nsin0 = ns[0] * csin((cmpl) phi0);
+        mult_layer_refl(nb, ns, nsin0, ds, lambda, R, rp);
     }
 
     if(type == SE_ALPHA_BETA) {
@@ -419,25 +681,171 @@ mult_layer_se_jacob(enum se_type type,
     }
 
     if(jacob_th) {
-        for(j = 0; j < (size_t) nblyr; j++) {
-            struct {
-                cmpl alpha, beta;
-            } d;
-            cmpl dR[2] = {jac.th[j], jac.th[nblyr+j]};
+        set_jacob_th(type, nblyr, R, jac.th, tanlz, jacob_th);
+    }
+}
 
-            if(type == SE_ALPHA_BETA) {
-                se_ab_der(R, dR, tanlz, &d.alpha, &d.beta);
-            } else {
-                se_psidel_der(R, dR, &d.alpha, &d.beta);
+void
+mult_layer_se_jacob(enum se_type type,
+                    size_t nb, const cmpl ns[], double phi0, double numap,
+                    const double ds[], const struct repeat_block *rep,
+                    double lambda, double anlz, ell_ab_t e,
+                    gsl_vector *jacob_th, cmpl_vector *jacob_n,
+                    struct elliss_workspace *ws)
+{
+    se_jacob_kernel(type, nb, ns, phi0, numap, ds, rep, lambda, anlz, e,
+                    jacob_th, jacob_n, ws);
+}
+
+void
+mult_layer_se_table(size_t _nb, const cmpl ns[], double phi0, double lambda,
+                    cmpl rc[], cmpl beta[])
+{
+    const double omega = 2 * M_PI / lambda;
+    const int nb = _nb;
+    const cmpl nsin0 = ns[0] * csin((cmpl) phi0);
+    cmpl cost, cosc, r[2];
+    int j;
+
+    cosc = snell_cos(nsin0, ns[0]);
+    for(j = 0; j < nb - 1; j++) {
+        cost = cosc;
+        cosc = snell_cos(nsin0, ns[j+1]);
+
+        refl_coeff_sp(ns[j], cost, ns[j+1], cosc, r);
+        rc[j]          = r[POL_S];
+        rc[nb - 1 + j] = r[POL_P];
+
+        if(j < nb - 2) {
+            beta[j] = - 2.0 * I * omega * ns[j+1] * cosc * THICKNESS_TO_NM(1.0);
+        }
+    }
+}
+
+KERNEL_INLINE void
+se_precomp_kernel(enum se_type type, const int nb,
+                  const cmpl rc[], const cmpl beta[], const double ds[],
+                  double anlz, ell_ab_t e, gsl_vector *jacob_th,
+                  struct elliss_workspace *ws)
+{
+    const struct elliss_repeat norep[1] = {{NULL}};
+    const int nblyr = nb - 2;
+    double tanlz = tan(anlz);
+    cmpl R[2];
+    polar_t p;
+    int j;
+
+    assert(jacob_th == NULL || (ws != NULL && ws->nb >= (size_t) nb));
+
+    R[POL_S] = rc[nb-2];
+    R[POL_P] = rc[2*nb-3];
+
+    /* Both the polarizations are computed in the same pass since they
+       share the phase factor of each layer. */
+    if(jacob_th) {
+        for(j = nb - 3; j >= 0; j--) {
+            const cmpl rho = cexp(beta[j] * ds[j]);
+            const cmpl drhodth = rho * beta[j];
+
+            for(p = 0; p <= 1; p++) {
+                const cmpl r = rc[p * (nb - 1) + j];
+                const cmpl Rrho = R[p] * rho;
+                const cmpl den = 1 + r * Rrho;
+                const cmpl num = (1 - r*r) / csqr(den);
+
+                ws->dfdR[p * nblyr + j]   = rho * num;
+                ws->jac_th[p * nblyr + j] = R[p] * num * drhodth;
+
+                R[p] = (r + Rrho) / den;
             }
+        }
+
+        adjoint_sweep(nb, ws->dfdR, ws->jac_th, NULL, norep, POL_S);
+        adjoint_sweep(nb, ws->dfdR + nblyr, ws->jac_th + nblyr, NULL, norep, POL_P);
+    } else {
+        for(j = nb - 3; j >= 0; j--) {
+            const cmpl rho = cexp(beta[j] * ds[j]);
 
-            gsl_vector_set(jacob_th, j, creal(d.alpha));
-            gsl_vector_set(jacob_th, nblyr+j, creal(d.beta));
+            for(p = 0; p <= 1; p++) {
+                const cmpl r = rc[p * (nb - 1) + j];
+                const cmpl Rrho = R[p] * rho;
+                R[p] = (r + Rrho) / (1 + r * Rrho);
+            }
         }
     }
 
-    if(! use_static) {
-        free(jac.th);
-        free(jac.n);
+    if(type == SE_ALPHA_BETA) {
+        se_ab(R, tanlz, e);
+    } else {
+        se_psidel(R, e);
+    }
+
+    if(jacob_th) {
+        set_jacob_th(type, nblyr, R, ws->jac_th, tanlz, jacob_th);
+    }
+}
+
+void
+mult_layer_se_precomp(enum se_type type, size_t nb,
+                      const cmpl rc[], const cmpl beta[], const double ds[],
+                      double anlz, ell_ab_t e, gsl_vector *jacob_th,
+                      struct elliss_workspace *ws)
+{
+    se_precomp_kernel(type, nb, rc, beta, ds, anlz, e, jacob_th, ws);
+}
+
+/* Variants of the kernels for a fixed number of mediums. Since the kernels
+   are inlined the compiler can fully unroll the loops over the layers. */
+#define SE_SPECIALIZE(N) \
+static void \
+mult_layer_se_jacob_ ## N(enum se_type type, \
+                          size_t nb, const cmpl ns[], double phi0, \
+                          double numap, const double ds[], \
+                          const struct repeat_block *rep, \
+                          double lambda, double anlz, ell_ab_t e, \
+                          gsl_vector *jacob_th, cmpl_vector *jacob_n, \
+                          struct elliss_workspace *ws) \
+{ \
+    se_jacob_kernel(type, N, ns, phi0, numap, ds, rep, lambda, anlz, e, \
+                    jacob_th, jacob_n, ws); \
+} \
+static void \
+mult_layer_se_precomp_ ## N(enum se_type type, size_t nb, \
+                            const cmpl rc[], const cmpl beta[], \
+                            const double ds[], double anlz, ell_ab_t e, \
+                            gsl_vector *jacob_th, \
+                            struct elliss_workspace *ws) \
+{ \
+    se_precomp_kernel(type, N, rc, beta, ds, anlz, e, jacob_th, ws); \
+}
+
+SE_SPECIALIZE(3)
+SE_SPECIALIZE(4)
+SE_SPECIALIZE(5)
+SE_SPECIALIZE(6)
+
+void
+mult_layer_se_select(size_t nb, struct elliss_kernels *k)
+{
+    switch(nb) {
+    case 3:
+        k->jacob = mult_layer_se_jacob_3;
+        k->precomp = mult_layer_se_precomp_3;
+        break;
+    case 4:
+        k->jacob = mult_layer_se_jacob_4;
+        k->precomp = mult_layer_se_precomp_4;
+        break;
+    case 5:
+        k->jacob = mult_layer_se_jacob_5;
+        k->precomp = mult_layer_se_precomp_5;
+        break;
+    case 6:
+        k->jacob = mult_layer_se_jacob_6;
+        k->precomp = mult_layer_se_precomp_6;
+        break;
+    default:
+        k->jacob = mult_layer_se_jacob;
+        k->precomp = mult_layer_se_precomp;
     }
 }
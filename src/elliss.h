@@ -26,6 +26,7 @@
 #include "common.h"
 #include "cmpl.h"
 #include "ellipsometry-decls.h"
+#include "repeat-block.h"
 
 enum se_type {
     SE_ALPHA_BETA = 0,
@@ -40,11 +41,79 @@ struct elliss_ab {
 typedef struct elliss_ab  ell_ab_t[1];
 typedef struct elliss_ab *ell_ab_ptr;
 
+/* Scratch memory used by mult_layer_se_jacob to compute the derivatives
+   for a stack of up to "nb" mediums. It is owned by the caller so that
+   the kernel does not need any static or heap allocated storage. */
+struct elliss_workspace {
+    size_t nb;
+    cmpl *jac_th;
+    cmpl *jac_n;
+    /* Per-step factors recorded for the adjoint sweep. */
+    cmpl *dfdR;
+    /* Used to evaluate a repeated block of layers. */
+    struct repeat_step *repeat_steps;
+    cmpl *repeat_work;
+    cmpl *repeat_jac;
+    /* Derivatives averaged over the angular spread of the beam. */
+    cmpl *na_jac_th;
+    cmpl *na_jac_n;
+};
+
+extern struct elliss_workspace *elliss_workspace_alloc(size_t nb);
+extern void elliss_workspace_free(struct elliss_workspace *ws);
+
+/* The workspace "ws" is required only if jacob_th or jacob_n are not NULL
+   or if "rep" is a repeated block of layers. If "numap" is greater than
+   zero the reflection coefficients are averaged over the angular spread
+   of a beam with the given numerical aperture. */
 extern void
 mult_layer_se_jacob(enum se_type type,
-                    size_t nb, const cmpl ns[], double phi0,
-                    const double ds[], double lambda,
-                    double anlz, ell_ab_t e,
-                    gsl_vector *jacob_th, cmpl_vector *jacob_n);
+                    size_t nb, const cmpl ns[], double phi0, double numap,
+                    const double ds[], const struct repeat_block *rep,
+                    double lambda, double anlz, ell_ab_t e,
+                    gsl_vector *jacob_th, cmpl_vector *jacob_n,
+                    struct elliss_workspace *ws);
+
+/* Compute for the given wavelength the Fresnel coefficients of the nb - 1
+   interfaces, for the S and then the P polarization, and the phase rates
+   of the nb - 2 layers such that rho = exp(beta * thickness). */
+extern void
+mult_layer_se_table(size_t nb, const cmpl ns[], double phi0, double lambda,
+                    cmpl rc[], cmpl beta[]);
+
+/* Same as mult_layer_se_jacob but using the tables computed by
+   mult_layer_se_table. Only the derivatives respect to the thicknesses
+   can be computed. */
+extern void
+mult_layer_se_precomp(enum se_type type, size_t nb,
+                      const cmpl rc[], const cmpl beta[], const double ds[],
+                      double anlz, ell_ab_t e, gsl_vector *jacob_th,
+                      struct elliss_workspace *ws);
+
+typedef void (*elliss_jacob_kernel_t)(enum se_type type,
+                                      size_t nb, const cmpl ns[], double phi0,
+                                      double numap, const double ds[],
+                                      const struct repeat_block *rep,
+                                      double lambda, double anlz, ell_ab_t e,
+                                      gsl_vector *jacob_th,
+                                      cmpl_vector *jacob_n,
+                                      struct elliss_workspace *ws);
+
+typedef void (*elliss_precomp_kernel_t)(enum se_type type, size_t nb,
+                                        const cmpl rc[], const cmpl beta[],
+                                        const double ds[], double anlz,
+                                        ell_ab_t e, gsl_vector *jacob_th,
+                                        struct elliss_workspace *ws);
+
+/* Kernels, equivalent to mult_layer_se_jacob and mult_layer_se_precomp,
+   to be used for a given number of mediums. */
+struct elliss_kernels {
+    elliss_jacob_kernel_t jacob;
+    elliss_precomp_kernel_t precomp;
+};
+
+/* Select the kernels specialized for "nb" mediums if available or the
+   generic ones otherwise. */
+extern void mult_layer_se_select(size_t nb, struct elliss_kernels *k);
 
 #endif
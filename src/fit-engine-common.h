@@ -14,6 +14,29 @@ struct stack_cache {
     cmpl *ns;
     struct deriv_info * deriv_info;
     cmpl *ns_full_spectr;
+    /* When th_only is set, Fresnel coefficients and phase rates for each
+       point of the spectrum as given by mult_layer_refl_ni_table or
+       mult_layer_se_table. The number of values for each point is
+       rc_stride and nb_med - 2, respectively. */
+    cmpl *rc_full_spectr;
+    cmpl *beta_full_spectr;
+    int rc_stride;
+    /* Single precision copies of the tables above, with each complex
+       value stored as two floats. They are built only if the grid search
+       uses the single precision kernels. */
+    float *rc_f32_full_spectr;
+    float *beta_f32_full_spectr;
+    /* When th_only is not set, ns_full_spectr holds the refractive
+       indexes for each point of the spectrum and dn_full_spectr their
+       derivatives respect to the dispersion parameters, dn_stride values
+       for each point. The derivatives of the medium "i" start at
+       dn_offset[i], or it is -1 if none of its parameters is fitted. Only
+       the mediums flagged in ns_dirty or dn_dirty are recomputed when the
+       spectrum is evaluated. */
+    cmpl *dn_full_spectr;
+    int *dn_offset;
+    int dn_stride;
+    char *ns_dirty, *dn_dirty;
 };
 
 struct fit_config {
@@ -23,6 +46,25 @@ struct fit_config {
     int subsampling;
     struct spectral_range spectr_range;
     double epsabs, epsrel;
+    /* Number of threads used to evaluate the spectrum. */
+    int nb_threads;
+    /* Rank the nodes of the grid search using the single precision
+       kernels. The final fit is always done in double precision. */
+    int grid_single;
+    /* If greater than zero the grid search computes only the residuals
+       at each node and runs the short LM search only for the given
+       number of best nodes. */
+    int grid_nb_best;
+    /* If greater than zero the grid search evaluates the given number of
+       quasi-random points over the seed ranges instead of the full grid. */
+    int grid_nb_samples;
+    /* Use the Levenberg-Marquardt solver based on the normal equations
+       for the final fit. In the multi-sample fit the normal equations
+       are solved sample by sample. */
+    int lm_normal;
+    /* In reflectometry eliminate the PID_FIRSTMUL parameter by variable
+       projection. */
+    int vp_rmult;
 };
 
 __END_DECLS
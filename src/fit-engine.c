@@ -20,6 +20,7 @@
 
 #include <assert.h>
 #include <string.h>
+#include <gsl/gsl_blas.h>
 #include "fit-engine.h"
 #include "refl-fit.h"
 #include "refl-kernel.h"
@@ -27,6 +28,7 @@
 #include "elliss.h"
 #include "error-messages.h"
 #include "minsampling.h"
+#include "worker-pool.h"
 
 
 static void build_fit_engine_cache(struct fit_engine *f);
@@ -56,7 +58,18 @@ build_stack_cache(struct stack_cache *cache, stack_t *stack,
 
     cache->th_only = th_only_optimize;
 
+    cache->rc_full_spectr = NULL;
+    cache->beta_full_spectr = NULL;
+    cache->rc_f32_full_spectr = NULL;
+    cache->beta_f32_full_spectr = NULL;
+    cache->dn_full_spectr = NULL;
+    cache->dn_offset = NULL;
+    cache->dn_stride = 0;
+    cache->ns_dirty = NULL;
+    cache->dn_dirty = NULL;
+
     if(th_only_optimize) {
+        enum system_kind syskind = spectr->config.system;
         int k, npt = spectra_points(spectr);
         cmpl *ns;
 
@@ -66,6 +79,33 @@ build_stack_cache(struct stack_cache *cache, stack_t *stack,
             double lambda = get_lambda_by_index(spectr, k);
             stack_get_ns_list(stack, ns, lambda);
         }
+
+        /* Since the refractive indexes are fixed the Fresnel coefficients
+           and the phase rates are computed once for all. The tables are
+           for a single angle of incidence so they are not used when the
+           beam has a numerical aperture. */
+        if(syskind == SYSTEM_REFLECTOMETER ||
+                ((syskind == SYSTEM_ELLISS_AB || syskind == SYSTEM_ELLISS_PSIDEL) &&
+                 spectr->config.numap == 0.0)) {
+            const int nbeta = nb_med - 2;
+
+            cache->rc_stride = (syskind == SYSTEM_REFLECTOMETER ? 1 : 2) * (nb_med - 1);
+            cache->rc_full_spectr = emalloc(cache->rc_stride * npt * sizeof(cmpl));
+            cache->beta_full_spectr = emalloc((nbeta > 0 ? nbeta * npt : 1) * sizeof(cmpl));
+
+            for(k = 0; k < npt; k++) {
+                double lambda = get_lambda_by_index(spectr, k);
+                cmpl *rc = cache->rc_full_spectr + k * cache->rc_stride;
+                cmpl *beta = cache->beta_full_spectr + k * nbeta;
+
+                ns = cache->ns_full_spectr + k * nb_med;
+                if(syskind == SYSTEM_REFLECTOMETER) {
+                    mult_layer_refl_ni_table(nb_med, ns, lambda, rc, beta);
+                } else {
+                    mult_layer_se_table(nb_med, ns, spectr->config.aoi, lambda, rc, beta);
+                }
+            }
+        }
     } else {
         cache->ns_full_spectr = NULL;
     }
@@ -73,6 +113,32 @@ build_stack_cache(struct stack_cache *cache, stack_t *stack,
     cache->is_valid = 1;
 }
 
+/* Build the single precision copies of the Fresnel coefficients and
+   phase rates tables, if the latter are available. */
+static void
+build_stack_cache_f32(struct stack_cache *cache, struct spectrum *spectr)
+{
+    const int npt = spectra_points(spectr);
+    const int nrc = cache->rc_stride * npt;
+    const int nbeta = (cache->nb_med - 2) * npt;
+    int k;
+
+    if(! cache->rc_full_spectr) return;
+
+    cache->rc_f32_full_spectr = emalloc(2 * nrc * sizeof(float));
+    cache->beta_f32_full_spectr = emalloc(2 * (nbeta > 0 ? nbeta : 1) * sizeof(float));
+
+    for(k = 0; k < nrc; k++) {
+        cache->rc_f32_full_spectr[2*k]   = creal(cache->rc_full_spectr[k]);
+        cache->rc_f32_full_spectr[2*k+1] = cimag(cache->rc_full_spectr[k]);
+    }
+
+    for(k = 0; k < nbeta; k++) {
+        cache->beta_f32_full_spectr[2*k]   = creal(cache->beta_full_spectr[k]);
+        cache->beta_f32_full_spectr[2*k+1] = cimag(cache->beta_full_spectr[k]);
+    }
+}
+
 void
 dispose_stack_cache(struct stack_cache *cache)
 {
@@ -96,9 +162,150 @@ dispose_stack_cache(struct stack_cache *cache)
         free(cache->ns_full_spectr);
     }
 
+    if(cache->rc_full_spectr) {
+        free(cache->rc_full_spectr);
+        free(cache->beta_full_spectr);
+    }
+
+    if(cache->rc_f32_full_spectr) {
+        free(cache->rc_f32_full_spectr);
+        free(cache->beta_f32_full_spectr);
+    }
+
+    if(cache->ns_dirty) {
+        free(cache->dn_full_spectr);
+        free(cache->dn_offset);
+        free(cache->ns_dirty);
+        free(cache->dn_dirty);
+    }
+
     cache->is_valid = 0;
 }
 
+/* Allocate the tables of the refractive indexes and of their derivatives
+   used when the dispersion parameters are fitted. All the mediums are
+   initially dirty. */
+static void
+build_stack_cache_media(struct stack_cache *cache, stack_t *stack,
+                        struct spectrum *spectr,
+                        const struct fit_parameters *fps)
+{
+    const int nb_med = stack->nb, npt = spectra_points(spectr);
+    size_t k;
+    int j;
+
+    cache->dn_offset = emalloc(nb_med * sizeof(int));
+    cache->ns_dirty = emalloc(nb_med * sizeof(char));
+    cache->dn_dirty = emalloc(nb_med * sizeof(char));
+
+    for(j = 0; j < nb_med; j++) {
+        cache->dn_offset[j] = -1;
+        cache->ns_dirty[j] = 1;
+        cache->dn_dirty[j] = 1;
+    }
+
+    cache->dn_stride = 0;
+    for(k = 0; k < fps->number; k++) {
+        const fit_param_t *fp = fps->values + k;
+        if(fp->id == PID_LAYER_N && cache->dn_offset[fp->layer_nb] < 0) {
+            cache->dn_offset[fp->layer_nb] = cache->dn_stride;
+            cache->dn_stride += disp_get_number_of_params(stack->disp[fp->layer_nb]);
+        }
+    }
+
+    cache->ns_full_spectr = emalloc((npt > 0 ? nb_med * npt : 1) * sizeof(cmpl));
+    cache->dn_full_spectr = emalloc((cache->dn_stride * npt > 0 ? cache->dn_stride * npt : 1) * sizeof(cmpl));
+}
+
+static void
+build_fit_worker(struct fit_worker *w, const struct fit_engine *f)
+{
+    size_t dmultipl = (f->run->system_kind == SYSTEM_REFLECTOMETER ? 1 : 2);
+    size_t nb = f->stack->nb;
+    int nblyr = nb - 2;
+
+    w->stack = stack_copy(f->stack);
+
+    /* The refractive indexes over the full spectrum, when precomputed, are
+       shared with the main fit run. */
+    build_stack_cache(&w->cache, w->stack, f->run->spectr, 0);
+    w->cache.th_only = f->run->cache.th_only;
+
+    w->jac_th = gsl_vector_alloc(dmultipl * nblyr);
+    w->refl_ws = NULL;
+    w->elliss_ws = NULL;
+
+    switch(f->run->system_kind) {
+    case SYSTEM_REFLECTOMETER:
+        w->jac_n.refl = gsl_vector_alloc(2 * nb);
+        w->refl_ws = refl_workspace_alloc(nb);
+        break;
+    case SYSTEM_ELLISS_AB:
+    case SYSTEM_ELLISS_PSIDEL:
+        w->jac_n.ell = cmpl_vector_alloc(2 * nb);
+        w->elliss_ws = elliss_workspace_alloc(nb);
+    default:
+        /* */
+        ;
+    }
+}
+
+static void
+dispose_fit_worker(struct fit_worker *w, enum system_kind system_kind)
+{
+    gsl_vector_free(w->jac_th);
+
+    switch(system_kind) {
+    case SYSTEM_REFLECTOMETER:
+        gsl_vector_free(w->jac_n.refl);
+        refl_workspace_free(w->refl_ws);
+        break;
+    case SYSTEM_ELLISS_AB:
+    case SYSTEM_ELLISS_PSIDEL:
+        cmpl_vector_free(w->jac_n.ell);
+        elliss_workspace_free(w->elliss_ws);
+    default:
+        /* */
+        ;
+    }
+
+    dispose_stack_cache(&w->cache);
+    stack_free(w->stack);
+}
+
+static void
+build_fit_normal_acc(struct fit_engine *f)
+{
+    const size_t dmultipl = (f->run->system_kind == SYSTEM_REFLECTOMETER ? 1 : 2);
+    const size_t nr = dmultipl * FIT_WORKER_CHUNK, np = f->parameters->number;
+    int k, nb_threads = (f->run->pool ? worker_pool_threads(f->run->pool) : 1);
+
+    f->run->normal_acc = emalloc(nb_threads * sizeof(struct fit_normal_acc));
+    for(k = 0; k < nb_threads; k++) {
+        struct fit_normal_acc *acc = f->run->normal_acc + k;
+        acc->jtj = gsl_matrix_alloc(np, np);
+        acc->jtr = gsl_vector_alloc(np);
+        acc->f = emalloc(nr * sizeof(double));
+        acc->jacob = emalloc(nr * np * sizeof(double));
+    }
+}
+
+static void
+dispose_fit_normal_acc(struct fit_run *run)
+{
+    int k, nb_threads = (run->pool ? worker_pool_threads(run->pool) : 1);
+
+    for(k = 0; k < nb_threads; k++) {
+        struct fit_normal_acc *acc = run->normal_acc + k;
+        gsl_matrix_free(acc->jtj);
+        gsl_vector_free(acc->jtr);
+        free(acc->f);
+        free(acc->jacob);
+    }
+    free(run->normal_acc);
+    run->normal_acc = NULL;
+}
+
 void
 build_fit_engine_cache(struct fit_engine *f)
 {
@@ -109,33 +316,88 @@ build_fit_engine_cache(struct fit_engine *f)
 
     build_stack_cache(&f->run->cache, f->stack, f->run->spectr, RI_fixed);
 
+    if(! RI_fixed) {
+        build_stack_cache_media(&f->run->cache, f->stack, f->run->spectr, f->parameters);
+    }
+
+    if(f->config->grid_single) {
+        build_stack_cache_f32(&f->run->cache, f->run->spectr);
+    }
+
     f->run->jac_th = gsl_vector_alloc(dmultipl * nblyr);
+    f->run->refl_ws = NULL;
+    f->run->elliss_ws = NULL;
 
     switch(f->run->system_kind) {
     case SYSTEM_REFLECTOMETER:
         f->run->jac_n.refl = gsl_vector_alloc(2 * nb);
+        f->run->refl_ws = refl_workspace_alloc(nb);
         break;
     case SYSTEM_ELLISS_AB:
     case SYSTEM_ELLISS_PSIDEL:
         f->run->jac_n.ell = cmpl_vector_alloc(2 * nb);
+        f->run->elliss_ws = elliss_workspace_alloc(nb);
     default:
         /* */
         ;
     }
+
+    f->run->pool = NULL;
+    f->run->workers = NULL;
+    f->run->grid_engines = NULL;
+
+    if(f->config->nb_threads > 1) {
+        int k, nb_threads;
+
+        f->run->pool = worker_pool_new(f->config->nb_threads);
+        nb_threads = worker_pool_threads(f->run->pool);
+
+        f->run->workers = emalloc((nb_threads - 1) * sizeof(struct fit_worker));
+        for(k = 0; k < nb_threads - 1; k++) {
+            build_fit_worker(f->run->workers + k, f);
+        }
+    }
+
+    build_fit_normal_acc(f);
 }
 
 void
 dispose_fit_engine_cache(struct fit_run *run)
 {
+    dispose_fit_normal_acc(run);
+
+    if(run->pool) {
+        int k, nb_threads = worker_pool_threads(run->pool);
+        if(run->grid_engines) {
+            for(k = 0; k < nb_threads; k++) {
+                fit_engine_disable(run->grid_engines[k]);
+                fit_engine_free(run->grid_engines[k]);
+            }
+            free(run->grid_engines);
+            run->grid_engines = NULL;
+        }
+        for(k = 0; k < nb_threads - 1; k++) {
+            dispose_fit_worker(run->workers + k, run->system_kind);
+        }
+        free(run->workers);
+        worker_pool_free(run->pool);
+        run->workers = NULL;
+        run->pool = NULL;
+    }
+
     gsl_vector_free(run->jac_th);
 
     switch(run->system_kind) {
     case SYSTEM_REFLECTOMETER:
         gsl_vector_free(run->jac_n.refl);
+        refl_workspace_free(run->refl_ws);
+        run->refl_ws = NULL;
         break;
     case SYSTEM_ELLISS_AB:
     case SYSTEM_ELLISS_PSIDEL:
         cmpl_vector_free(run->jac_n.ell);
+        elliss_workspace_free(run->elliss_ws);
+        run->elliss_ws = NULL;
     default:
         /* */
         ;
@@ -183,30 +445,212 @@ void
 fit_engine_commit_parameters(struct fit_engine *fit, const gsl_vector *x)
 {
     struct fit_parameters const * fps = fit->parameters;
+    struct stack_cache *cache = &fit->run->cache;
+    size_t j;
+
+    /* The mediums whose dispersion parameters change are marked to be
+       computed again. */
+    if(cache->ns_dirty) {
+        for(j = 0; j < fps->number; j++) {
+            const fit_param_t *fp = fps->values + j;
+            if(fp->id == PID_LAYER_N) {
+                const disp_t *d = fit->stack->disp[fp->layer_nb];
+                if(disp_get_param_value(d, fp) != gsl_vector_get(x, j)) {
+                    cache->ns_dirty[fp->layer_nb] = 1;
+                    cache->dn_dirty[fp->layer_nb] = 1;
+                }
+            }
+        }
+    }
+
     fit_engine_apply_parameters(fit, fps, x);
 }
 
-int
-fit_engine_prepare(struct fit_engine *fit, struct spectrum *s)
+void
+fit_engine_sync_workers(struct fit_engine *fit, const gsl_vector *x)
 {
-    struct fit_config *cfg = fit->config;
-    enum system_kind syskind = s->config.system;
+    struct fit_parameters const * fps = fit->parameters;
+    int k, nb_threads;
+    size_t j;
 
-    fit->run->system_kind = syskind;
-    fit->run->spectr = spectra_copy(s);
+    if(! fit->run->pool) return;
+
+    nb_threads = worker_pool_threads(fit->run->pool);
+    for(k = 0; k < nb_threads - 1; k++) {
+        stack_t *stack = fit->run->workers[k].stack;
+        for(j = 0; j < fps->number; j++) {
+            const fit_param_t *fp = fps->values + j;
+            if(fp->id != PID_FIRSTMUL) {
+                stack_apply_param(stack, fp, gsl_vector_get(x, j));
+            }
+        }
+    }
+}
+
+void
+fit_engine_update_media(struct fit_engine *fit, stack_t *stack,
+                        size_t j0, size_t j1, int deriv)
+{
+    struct stack_cache *cache = &fit->run->cache;
+    const int nb_med = cache->nb_med;
+    size_t j;
+    int m;
+
+    if(! cache->ns_dirty) return;
+
+    for(m = 0; m < nb_med; m++) {
+        const int upd_n = cache->ns_dirty[m];
+        const int upd_dn = (deriv && cache->dn_dirty[m] && cache->dn_offset[m] >= 0);
+        const disp_t *d = stack->disp[m];
+
+        if(! upd_n && ! upd_dn) continue;
+
+        for(j = j0; j < j1; j++) {
+            const double lambda = spectra_get_values(fit->run->spectr, j)[0];
+
+            if(upd_n) {
+                cache->ns_full_spectr[j * nb_med + m] = n_value(d, lambda);
+            }
+
+            if(upd_dn) {
+                cmpl_vector dn[1];
+                dn->size = disp_get_number_of_params(d);
+                dn->data = cache->dn_full_spectr + j * cache->dn_stride + cache->dn_offset[m];
+                dn->owner = 0;
+                n_value_deriv(d, dn, lambda);
+            }
+        }
+    }
+}
 
-    if(fit->config->spectr_range.active)
-        spectr_cut_range(fit->run->spectr,
-                         cfg->spectr_range.min, cfg->spectr_range.max);
+void
+fit_engine_clean_media(struct fit_engine *fit, int deriv)
+{
+    struct stack_cache *cache = &fit->run->cache;
+    int m;
+
+    if(! cache->ns_dirty) return;
+
+    for(m = 0; m < cache->nb_med; m++) {
+        cache->ns_dirty[m] = 0;
+        if(deriv) {
+            cache->dn_dirty[m] = 0;
+        }
+    }
+}
+
+void
+fit_engine_update_projected(struct fit_engine *fit, gsl_vector *x)
+{
+    gsl_vector *f;
+
+    if(fit->run->vp_index < 0) return;
+
+    f = gsl_vector_alloc(fit->run->mffun.n);
+    fit->run->mffun.f(x, fit, f);
+    gsl_vector_set(x, fit->run->vp_index, fit->extra->rmult);
+    gsl_vector_free(f);
+}
+
+void
+fit_engine_normal_reset(struct fit_engine *fit)
+{
+    int k, nb_threads = (fit->run->pool ? worker_pool_threads(fit->run->pool) : 1);
+
+    for(k = 0; k < nb_threads; k++) {
+        struct fit_normal_acc *acc = fit->run->normal_acc + k;
+        gsl_matrix_set_zero(acc->jtj);
+        gsl_vector_set_zero(acc->jtr);
+        acc->sumsq = 0.0;
+    }
+}
+
+void
+fit_normal_acc_add(struct fit_normal_acc *acc, const gsl_vector *f,
+                   const gsl_matrix *jacob)
+{
+    double ssq;
+
+    gsl_blas_dsyrk(CblasLower, CblasTrans, 1.0, jacob, 1.0, acc->jtj);
+    gsl_blas_dgemv(CblasTrans, 1.0, jacob, f, 1.0, acc->jtr);
+    gsl_blas_ddot(f, f, &ssq);
+    acc->sumsq += ssq;
+}
+
+void
+fit_engine_normal_sum(struct fit_engine *fit, gsl_matrix *jtj,
+                      gsl_vector *jtr, double *sumsq)
+{
+    int k, nb_threads = (fit->run->pool ? worker_pool_threads(fit->run->pool) : 1);
+
+    gsl_matrix_memcpy(jtj, fit->run->normal_acc[0].jtj);
+    gsl_vector_memcpy(jtr, fit->run->normal_acc[0].jtr);
+    *sumsq = fit->run->normal_acc[0].sumsq;
+
+    for(k = 1; k < nb_threads; k++) {
+        gsl_matrix_add(jtj, fit->run->normal_acc[k].jtj);
+        gsl_vector_add(jtr, fit->run->normal_acc[k].jtr);
+        *sumsq += fit->run->normal_acc[k].sumsq;
+    }
+}
+
+void
+fit_engine_load_media_deriv(const struct fit_engine *fit, size_t j,
+                            struct deriv_info *ideriv)
+{
+    const struct stack_cache *cache = &fit->run->cache;
+    int m, k;
+
+    for(m = 0; m < cache->nb_med; m++) {
+        if(cache->dn_offset[m] >= 0) {
+            const cmpl *dn = cache->dn_full_spectr + j * cache->dn_stride + cache->dn_offset[m];
+            for(k = 0; k < ideriv[m].val->size; k++) {
+                ideriv[m].val->data[k] = dn[k];
+            }
+            ideriv[m].is_valid = 1;
+        } else {
+            ideriv[m].is_valid = 0;
+        }
+    }
+}
+
+/* Return a copy of the spectrum restricted to the spectral range and
+   subsampled as requested by the config. The data table is shared. */
+static struct spectrum *
+fit_engine_run_spectrum(const struct fit_engine *fit, struct spectrum *s)
+{
+    const struct fit_config *cfg = fit->config;
+    enum system_kind syskind = s->config.system;
+    struct spectrum *spectr = spectra_copy(s);
+
+    if(cfg->spectr_range.active)
+        spectr_cut_range(spectr, cfg->spectr_range.min, cfg->spectr_range.max);
 
     if(cfg->subsampling) {
         if(syskind == SYSTEM_ELLISS_AB || syskind == SYSTEM_ELLISS_PSIDEL) {
-            elliss_sample_minimize(fit->run->spectr, 0.05);
+            elliss_sample_minimize(spectr, 0.05);
         }
     }
 
+    return spectr;
+}
+
+/* Prepare the fit run for the given spectrum, already restricted and
+   subsampled, taking its ownership. */
+static int
+fit_engine_prepare_run(struct fit_engine *fit, struct spectrum *spectr)
+{
+    struct fit_config *cfg = fit->config;
+    enum system_kind syskind = spectr->config.system;
+
+    fit->run->system_kind = syskind;
+    fit->run->spectr = spectr;
+
     build_fit_engine_cache(fit);
 
+    mult_layer_refl_ni_select(fit->stack->nb, &fit->run->refl_kernels);
+    mult_layer_se_select(fit->stack->nb, &fit->run->elliss_kernels);
+
     switch(syskind) {
     case SYSTEM_REFLECTOMETER:
         fit->run->mffun.f      = & refl_fit_f;
@@ -215,6 +659,12 @@ fit_engine_prepare(struct fit_engine *fit, struct spectrum *s)
         fit->run->mffun.n      = spectra_points(fit->run->spectr);
         fit->run->mffun.p      = fit->parameters->number;
         fit->run->mffun.params = fit;
+        fit->run->mffun_grid = fit->run->mffun;
+        if(cfg->grid_single) {
+            fit->run->mffun_grid.f = & refl_fit_f32;
+        }
+        fit->run->f_bounded = & refl_fit_f_bounded;
+        fit->run->normal = & refl_fit_normal;
         break;
     case SYSTEM_ELLISS_AB:
     case SYSTEM_ELLISS_PSIDEL:
@@ -224,11 +674,28 @@ fit_engine_prepare(struct fit_engine *fit, struct spectrum *s)
         fit->run->mffun.n      = 2 * spectra_points(fit->run->spectr);
         fit->run->mffun.p      = fit->parameters->number;
         fit->run->mffun.params = fit;
+        fit->run->mffun_grid = fit->run->mffun;
+        if(cfg->grid_single) {
+            fit->run->mffun_grid.f = & elliss_fit_f32;
+        }
+        fit->run->f_bounded = & elliss_fit_f_bounded;
+        fit->run->normal = & elliss_fit_normal;
         break;
     default:
         return 1;
     }
 
+    fit->run->vp_index = -1;
+    if(syskind == SYSTEM_REFLECTOMETER && cfg->vp_rmult) {
+        size_t k;
+        for(k = 0; k < fit->parameters->number; k++) {
+            if(fit->parameters->values[k].id == PID_FIRSTMUL) {
+                fit->run->vp_index = k;
+                break;
+            }
+        }
+    }
+
     if(! cfg->threshold_given) {
         cfg->chisq_threshold = (syskind == SYSTEM_REFLECTOMETER ? 150 : 3000);
     }
@@ -244,12 +711,69 @@ fit_engine_prepare(struct fit_engine *fit, struct spectrum *s)
     return 0;
 }
 
+int
+fit_engine_prepare(struct fit_engine *fit, struct spectrum *s)
+{
+    return fit_engine_prepare_run(fit, fit_engine_run_spectrum(fit, s));
+}
+
+int
+fit_engine_rebind(struct fit_engine *fit, struct spectrum *s)
+{
+    struct spectrum *spectr;
+
+    if(! fit->run->spectr) {
+        return fit_engine_prepare(fit, s);
+    }
+
+    spectr = fit_engine_run_spectrum(fit, s);
+
+    /* The caches, the kernels and the buffers of the run depend only on
+       the stack, the wavelengths and the configuration of the spectrum
+       so they are kept. */
+    if(spectra_same_grid(spectr, fit->run->spectr)) {
+        spectra_free(fit->run->spectr);
+        fit->run->spectr = spectr;
+        if(fit->run->grid_engines) {
+            int k, nb_threads = worker_pool_threads(fit->run->pool);
+            for(k = 0; k < nb_threads; k++) {
+                fit_engine_rebind(fit->run->grid_engines[k], spectr);
+            }
+        }
+        return 0;
+    }
+
+    fit_engine_disable(fit);
+    return fit_engine_prepare_run(fit, spectr);
+}
+
 void
 fit_engine_disable(struct fit_engine *fit)
 {
     dispose_fit_engine_cache(fit->run);
     spectra_free(fit->run->spectr);
     gsl_vector_free(fit->run->results);
+    fit->run->spectr = NULL;
+}
+
+struct fit_engine *
+fit_engine_clone(const struct fit_engine *fit)
+{
+    struct fit_engine *clone = fit_engine_new();
+    struct fit_config cfg[1];
+
+    cfg[0] = fit->config[0];
+    cfg->nb_threads = 1;
+    /* The spectrum of the fit run is already restricted and subsampled. */
+    cfg->subsampling = 0;
+    cfg->spectr_range.active = 0;
+    cfg->threshold_given = 1;
+
+    fit_engine_bind(clone, fit->stack, cfg, fit->parameters);
+    clone->extra[0] = fit->extra[0];
+    fit_engine_prepare(clone, fit->run->spectr);
+
+    return clone;
 }
 
 int
@@ -355,21 +879,15 @@ compute_rsquare(const gsl_vector *ref, const gsl_vector *b)
     return rsq / ssq;
 }
 
-double
-fit_engine_estimate_param_grid_step(struct fit_engine *fit, const gsl_vector *x, const fit_param_t *fp, double delta)
+/* Halve delta until the finite difference of the residuals along the
+   parameter departs enough from the jacobian column "jcol". The residuals
+   "y0" at x are given by the caller. */
+static double
+estimate_param_step(struct fit_engine *fit, const gsl_vector *x, int fp_index,
+                    double delta, const gsl_vector *jcol, const gsl_vector *y0,
+                    gsl_vector *y1, gsl_vector *xtest)
 {
-    int fp_index = fit_parameters_find(fit->parameters, fp);
-
-    gsl_vector *y0 = gsl_vector_alloc(fit->run->mffun.n);
-    gsl_vector *y1 = gsl_vector_alloc(fit->run->mffun.n);
-    gsl_vector *xtest = gsl_vector_alloc(fit->run->mffun.p);
-    gsl_matrix *jacob = gsl_matrix_alloc(fit->run->mffun.n, fit->run->mffun.p);
-
-    gsl_vector_view jview = gsl_matrix_column(jacob, fp_index);
-    fit->run->mffun.df(x, fit, jacob);
-
     gsl_vector_memcpy(xtest, x);
-    fit->run->mffun.f(xtest, fit, y0);
 
     while (1) {
         gsl_vector_set(xtest, fp_index, gsl_vector_get(x, fp_index) + delta);
@@ -378,19 +896,158 @@ fit_engine_estimate_param_grid_step(struct fit_engine *fit, const gsl_vector *x,
         gsl_vector_sub(y1, y0);
         gsl_vector_scale(y1, 1.0 / delta);
 
-        double r2 = compute_rsquare(&jview.vector, y1);
+        double r2 = compute_rsquare(jcol, y1);
         if (r2 < 0.2) break;
 
         delta /= 2;
     }
 
-    gsl_vector_free(y0);
-    gsl_vector_free(y1);
-    gsl_vector_free(xtest);
-    gsl_matrix_free(jacob);
     return delta;
 }
 
+static void
+grid_step_cache_init(struct grid_step_cache *c)
+{
+    c->valid = 0;
+    c->lambda = NULL;
+    c->x = NULL;
+    c->delta = NULL;
+    c->steps = NULL;
+}
+
+static void
+grid_step_cache_free(struct grid_step_cache *c)
+{
+    free(c->lambda);
+    free(c->x);
+    free(c->delta);
+    free(c->steps);
+    grid_step_cache_init(c);
+}
+
+/* The delta of the parameters that are not SEED_RANGE is stored as -1. */
+static double
+seed_range_delta(const seed_t *s)
+{
+    return (s->type == SEED_RANGE ? s->delta : -1.0);
+}
+
+static int
+grid_step_cache_match(const struct grid_step_cache *c, struct fit_engine *fit,
+                      const gsl_vector *x, const struct seeds *seeds)
+{
+    struct spectrum *s = fit->run->spectr;
+    int npt = spectra_points(s), k;
+    size_t j;
+
+    if (!c->valid || c->nb_lambda != npt || c->nb_params != x->size) return 0;
+    if (c->config.system != s->config.system || c->config.aoi != s->config.aoi ||
+        c->config.analyzer != s->config.analyzer || c->config.numap != s->config.numap) {
+        return 0;
+    }
+    if (c->rmult != fit->extra->rmult) return 0;
+
+    for (j = 0; j < c->nb_params; j++) {
+        if (c->x[j] != gsl_vector_get(x, j)) return 0;
+        if (c->delta[j] != seed_range_delta(&seeds->values[j])) return 0;
+    }
+
+    for (k = 0; k < npt; k++) {
+        if (c->lambda[k] != get_lambda_by_index(s, k)) return 0;
+    }
+
+    return 1;
+}
+
+static void
+grid_step_cache_store(struct grid_step_cache *c, struct fit_engine *fit,
+                      const gsl_vector *x, const struct seeds *seeds,
+                      const gsl_vector *steps)
+{
+    struct spectrum *s = fit->run->spectr;
+    int npt = spectra_points(s), k;
+    size_t j, nb = x->size;
+
+    grid_step_cache_free(c);
+
+    c->config = s->config;
+    c->rmult = fit->extra->rmult;
+    c->nb_lambda = npt;
+    c->lambda = emalloc((npt > 0 ? npt : 1) * sizeof(float));
+    for (k = 0; k < npt; k++) {
+        c->lambda[k] = get_lambda_by_index(s, k);
+    }
+
+    c->nb_params = nb;
+    c->x = emalloc(nb * sizeof(double));
+    c->delta = emalloc(nb * sizeof(double));
+    c->steps = emalloc(nb * sizeof(double));
+    for (j = 0; j < nb; j++) {
+        c->x[j] = gsl_vector_get(x, j);
+        c->delta[j] = seed_range_delta(&seeds->values[j]);
+        c->steps[j] = gsl_vector_get(steps, j);
+    }
+
+    c->valid = 1;
+}
+
+void
+fit_engine_estimate_grid_steps(struct fit_engine *fit, const gsl_vector *x,
+                               const struct seeds *seeds, gsl_vector *steps)
+{
+    struct grid_step_cache *c = fit->grid_steps;
+    const size_t nb = fit->parameters->number;
+    /* With the variable projection the residuals are projected using the
+       measured values so the steps depend on them. */
+    const int use_cache = (fit->run->vp_index < 0);
+    gsl_vector *y0, *y1, *xtest;
+    gsl_matrix *jacob;
+    size_t j;
+
+    if (use_cache && grid_step_cache_match(c, fit, x, seeds)) {
+        for (j = 0; j < nb; j++) {
+            gsl_vector_set(steps, j, c->steps[j]);
+        }
+        return;
+    }
+
+    gsl_vector_set_zero(steps);
+
+    for (j = 0; j < nb; j++) {
+        if (seeds->values[j].type == SEED_RANGE) break;
+    }
+
+    if (j < nb) {
+        /* The jacobian and the residuals at x are computed only once for
+           all the parameters. */
+        y0 = gsl_vector_alloc(fit->run->mffun.n);
+        y1 = gsl_vector_alloc(fit->run->mffun.n);
+        xtest = gsl_vector_alloc(fit->run->mffun.p);
+        jacob = gsl_matrix_alloc(fit->run->mffun.n, fit->run->mffun.p);
+
+        fit->run->mffun.df(x, fit, jacob);
+        fit->run->mffun.f(x, fit, y0);
+
+        for (j = 0; j < nb; j++) {
+            const seed_t *s = &seeds->values[j];
+            if (s->type == SEED_RANGE) {
+                gsl_vector_view jview = gsl_matrix_column(jacob, j);
+                double es = estimate_param_step(fit, x, j, s->delta, &jview.vector, y0, y1, xtest);
+                gsl_vector_set(steps, j, es);
+            }
+        }
+
+        gsl_vector_free(y0);
+        gsl_vector_free(y1);
+        gsl_vector_free(xtest);
+        gsl_matrix_free(jacob);
+    }
+
+    if (use_cache) {
+        grid_step_cache_store(c, fit, x, seeds, steps);
+    }
+}
+
 void
 fit_engine_generate_spectrum(struct fit_engine *fit, struct spectrum *ref,
                              struct spectrum *synth)
@@ -400,6 +1057,9 @@ fit_engine_generate_spectrum(struct fit_engine *fit, struct spectrum *ref,
     struct data_table *table = synth->table[0].table;
     int j, npt = spectra_points(ref);
     cmpl *ns = emalloc(sizeof(cmpl) * nb_med);
+    const struct repeat_block *rep = &fit->stack->repeat;
+    struct refl_workspace *refl_ws = NULL;
+    struct elliss_workspace *ws = NULL;
     double const * ths;
 
     assert(spectra_points(ref) == spectra_points(synth));
@@ -408,6 +1068,14 @@ fit_engine_generate_spectrum(struct fit_engine *fit, struct spectrum *ref,
 
     ths = stack_get_ths_list(fit->stack);
 
+    if(REPEAT_BLOCK_IS_ACTIVE(rep)) {
+        if(syskind == SYSTEM_REFLECTOMETER) {
+            refl_ws = refl_workspace_alloc(nb_med);
+        } else {
+            ws = elliss_workspace_alloc(nb_med);
+        }
+    }
+
     for(j = 0; j < npt; j++) {
         double lambda = get_lambda_by_index(ref, j);
 
@@ -417,8 +1085,8 @@ fit_engine_generate_spectrum(struct fit_engine *fit, struct spectrum *ref,
 
         switch(syskind) {
         case SYSTEM_REFLECTOMETER: {
-            double r_raw = mult_layer_refl_ni(nb_med, ns, ths, lambda,
-                                              NULL, NULL);
+            double r_raw = mult_layer_refl_ni(nb_med, ns, ths, rep, lambda,
+                                              NULL, NULL, refl_ws);
             data_table_set(table, j, 1, fit->extra->rmult * r_raw);
             break;
         }
@@ -429,8 +1097,8 @@ fit_engine_generate_spectrum(struct fit_engine *fit, struct spectrum *ref,
             double anlz = ref->config.analyzer;
             ell_ab_t ell;
 
-            mult_layer_se_jacob(se_type, nb_med, ns, phi0,
-                                ths, lambda, anlz, ell, NULL, NULL);
+            mult_layer_se_jacob(se_type, nb_med, ns, phi0, ref->config.numap,
+                                ths, rep, lambda, anlz, ell, NULL, NULL, ws);
 
             data_table_set(table, j, 1, ell->alpha);
             data_table_set(table, j, 2, ell->beta);
@@ -442,6 +1110,12 @@ fit_engine_generate_spectrum(struct fit_engine *fit, struct spectrum *ref,
         }
     }
 
+    if(refl_ws) {
+        refl_workspace_free(refl_ws);
+    }
+    if(ws) {
+        elliss_workspace_free(ws);
+    }
     free(ns);
 }
 
@@ -452,6 +1126,8 @@ fit_engine_new()
     set_default_extra_param(fit->extra);
     fit->parameters = NULL;
     fit->stack = NULL;
+    fit->run->spectr = NULL;
+    grid_step_cache_init(fit->grid_steps);
     return fit;
 }
 
@@ -462,6 +1138,7 @@ fit_engine_bind(struct fit_engine *fit, const stack_t *stack, const struct fit_c
     /* fit is not the owner of the "parameters", we just keep a reference */
     fit->parameters = parameters;
     fit->stack = stack_copy(stack);
+    fit->grid_steps->valid = 0;
 }
 
 void
@@ -471,6 +1148,7 @@ fit_engine_bind_stack(struct fit_engine *fit, stack_t *stack)
         stack_free(fit->stack);
     }
     fit->stack = stack;
+    fit->grid_steps->valid = 0;
 }
 
 stack_t *
@@ -487,6 +1165,7 @@ fit_engine_free(struct fit_engine *fit)
     if (fit->stack) {
         stack_free(fit->stack);
     }
+    grid_step_cache_free(fit->grid_steps);
     free(fit);
 }
 
@@ -531,6 +1210,12 @@ fit_config_set_default(struct fit_config *cfg)
     cfg->spectr_range.active = 0;
     cfg->epsabs = 1.0E-7;
     cfg->epsrel = 1.0E-7;
+    cfg->nb_threads = 1;
+    cfg->grid_single = 0;
+    cfg->grid_nb_best = 0;
+    cfg->grid_nb_samples = 0;
+    cfg->lm_normal = 0;
+    cfg->vp_rmult = 0;
 }
 
 int
@@ -554,6 +1239,30 @@ fit_config_write(writer_t *w, const struct fit_config *config)
     }
 
     writer_printf(w, "epsilon %g %g", config->epsabs, config->epsrel);
+    if (config->nb_threads > 1) {
+        writer_newline(w);
+        writer_printf(w, "threads %d", config->nb_threads);
+    }
+    if (config->grid_single) {
+        writer_newline(w);
+        writer_printf(w, "grid-single-precision");
+    }
+    if (config->grid_nb_best > 0) {
+        writer_newline(w);
+        writer_printf(w, "grid-screening %d", config->grid_nb_best);
+    }
+    if (config->grid_nb_samples > 0) {
+        writer_newline(w);
+        writer_printf(w, "grid-sampling %d", config->grid_nb_samples);
+    }
+    if (config->lm_normal) {
+        writer_newline(w);
+        writer_printf(w, "normal-equations");
+    }
+    if (config->vp_rmult) {
+        writer_newline(w);
+        writer_printf(w, "separable-multiplier");
+    }
     writer_newline_exit(w);
     return 1;
 }
@@ -589,6 +1298,21 @@ fit_config_read(lexer_t *l, struct fit_config *config)
     if (strcmp(CSTR(l->store), "epsilon")) goto config_exit;
     if (lexer_number(l, &config->epsabs)) goto config_exit;
     if (lexer_number(l, &config->epsrel)) goto config_exit;
+    config->nb_threads = 1;
+    if (lexer_check_ident(l, "threads") == 0) {
+        if (lexer_integer(l, &config->nb_threads)) goto config_exit;
+    }
+    config->grid_single = (lexer_check_ident(l, "grid-single-precision") == 0);
+    config->grid_nb_best = 0;
+    if (lexer_check_ident(l, "grid-screening") == 0) {
+        if (lexer_integer(l, &config->grid_nb_best)) goto config_exit;
+    }
+    config->grid_nb_samples = 0;
+    if (lexer_check_ident(l, "grid-sampling") == 0) {
+        if (lexer_integer(l, &config->grid_nb_samples)) goto config_exit;
+    }
+    config->lm_normal = (lexer_check_ident(l, "normal-equations") == 0);
+    config->vp_rmult = (lexer_check_ident(l, "separable-multiplier") == 0);
     return 0;
 config_exit:
     return 1;
@@ -23,6 +23,7 @@
 
 #include "defs.h"
 #include "elliss.h"
+#include "refl-kernel.h"
 #include "spectra.h"
 #include "stack.h"
 #include "fit-params.h"
@@ -34,6 +35,60 @@
 
 __BEGIN_DECLS
 
+struct worker_pool;
+
+/* Private state of a thread when the spectrum is evaluated in parallel.
+   Each worker has its own copy of the stack since the dispersion models
+   are not required to be reentrant. */
+struct fit_worker {
+    stack_t *stack;
+    struct stack_cache cache;
+
+    gsl_vector *jac_th;
+    union {
+        gsl_vector *refl;
+        cmpl_vector *ell;
+    } jac_n;
+
+    struct refl_workspace *refl_ws;
+    struct elliss_workspace *elliss_ws;
+};
+
+/* Number of spectral points evaluated by a single task of the pool. */
+#define FIT_WORKER_CHUNK 32
+
+/* Number of spectral points evaluated between two checks of the bound by
+   the bounded residual functions. */
+#define FIT_BOUND_CHECK_POINTS 32
+
+/* Status returned by a bounded residual function when the evaluation was
+   stopped because the sum of squares exceeded the bound. */
+#define FIT_EVAL_PRUNED 1024
+
+/* Compute the residuals like the "f" function of the solver but stop as
+   soon as their sum of squares, stored in "sumsq", exceeds "bound". In
+   this case FIT_EVAL_PRUNED is returned and the residuals are only
+   partially computed. */
+typedef int (*fit_bounded_func_t)(const gsl_vector *x, void *params,
+                                  gsl_vector *f, double bound,
+                                  double *sumsq);
+
+/* Compute the normal equations J^T J and J^T f and the sum of squares of
+   the residuals without storing the full jacobian. Only the lower
+   triangle of "jtj" is meaningful. */
+typedef int (*fit_normal_func_t)(const gsl_vector *x, void *params,
+                                 gsl_matrix *jtj, gsl_vector *jtr,
+                                 double *sumsq);
+
+/* Normal equations accumulated by a thread, with the buffers for the
+   residuals and the jacobian of a single chunk of points. */
+struct fit_normal_acc {
+    gsl_matrix *jtj;
+    gsl_vector *jtr;
+    double sumsq;
+    double *f, *jacob;
+};
+
 struct extra_params {
     /* Reflectometry parameters */
     double rmult;
@@ -46,6 +101,24 @@ struct fit_run {
 
     gsl_multifit_function_fdf mffun;
 
+    /* Used to rank the nodes of the grid search. Same as mffun except
+       that the residuals may be computed in single precision. */
+    gsl_multifit_function_fdf mffun_grid;
+
+    /* Bounded variant of mffun_grid.f used to screen the grid nodes. */
+    fit_bounded_func_t f_bounded;
+
+    /* Used by the Levenberg-Marquardt solver based on the normal
+       equations, with an accumulator for each thread. */
+    fit_normal_func_t normal;
+    struct fit_normal_acc *normal_acc;
+
+    /* Index of the PID_FIRSTMUL parameter when it is eliminated by
+       variable projection, -1 otherwise. Its value is then computed in
+       closed form at each evaluation and its column of the jacobian is
+       zero. */
+    int vp_index;
+
     gsl_vector *results;
 
     struct stack_cache cache;
@@ -55,6 +128,41 @@ struct fit_run {
         gsl_vector *refl;
         cmpl_vector *ell;
     } jac_n;
+
+    /* Scratch for the kernels of the system, the other one is NULL. */
+    struct refl_workspace *refl_ws;
+    struct elliss_workspace *elliss_ws;
+
+    /* Kernels selected for the number of mediums of the stack. */
+    struct refl_ni_kernels refl_kernels;
+    struct elliss_kernels elliss_kernels;
+
+    /* Used only when the config requests more than one thread. The
+       thread of index 0 uses the buffers above while the thread of
+       index "k" uses workers[k - 1]. */
+    struct worker_pool *pool;
+    struct fit_worker *workers;
+
+    /* Clones of the fit engine used by each thread of the pool for the
+       grid search. They are created by the first grid search and bound
+       to the same spectrum as the run. */
+    struct fit_engine **grid_engines;
+};
+
+/* Grid steps estimated for the SEED_RANGE parameters. They depend on the
+   wavelengths and on the configuration of the spectrum but not on the
+   measured values, so they are reused by the following grid searches, as
+   in a batch, as long as these, the starting point and the ranges do not
+   change. The cache is not used with the variable projection, whose
+   residuals depend on the measured values. */
+struct grid_step_cache {
+    int valid;
+    struct system_config config;
+    double rmult;
+    int nb_lambda;
+    float *lambda;
+    size_t nb_params;
+    double *x, *delta, *steps;
 };
 
 struct fit_engine {
@@ -65,6 +173,8 @@ struct fit_engine {
     struct fit_parameters *parameters;
 
     struct fit_run run[1];
+
+    struct grid_step_cache grid_steps[1];
 };
 
 #define GET_SE_TYPE(sk) (sk == SYSTEM_ELLISS_AB ? SE_ALPHA_BETA : SE_PSI_DEL)
@@ -88,8 +198,23 @@ extern void fit_engine_free(struct fit_engine *fit);
 extern int  fit_engine_prepare(struct fit_engine *f,
                                struct spectrum *s);
 
+/* Same as fit_engine_prepare but, if the fit engine is already prepared
+   for a spectrum with the same wavelengths and system configuration, as
+   for the spectra of a batch measured with the same tool, only the
+   measured values are replaced and the run caches and buffers are kept.
+   The cached refractive indexes remain valid as long as the stack is
+   changed only with fit_engine_commit_parameters. */
+extern int  fit_engine_rebind(struct fit_engine *f, struct spectrum *s);
+
 extern void fit_engine_disable(struct fit_engine *f);
 
+/* Return a new fit engine, already prepared, for the same spectrum, stack
+   and fit parameters of "f". It has its own copy of the stack and of the
+   run buffers so that it can be used from another thread, and it is
+   always single-threaded. It should be released with fit_engine_disable
+   and fit_engine_free. */
+extern struct fit_engine *fit_engine_clone(const struct fit_engine *f);
+
 /* Return the stack owned by the fit_engine and gives it ownership to the
    caller function. */
 extern stack_t *fit_engine_yield_stack(struct fit_engine *f);
@@ -99,6 +224,44 @@ extern int  check_fit_parameters(struct stack *stack, struct fit_parameters *fps
 extern void fit_engine_commit_parameters(struct fit_engine *fit,
         const gsl_vector *x);
 
+/* Apply the fit parameters to the private stacks of the workers. */
+extern void fit_engine_sync_workers(struct fit_engine *fit,
+                                    const gsl_vector *x);
+
+/* Compute the refractive indexes of the dirty mediums, and their
+   derivatives if "deriv" is set, for the points j0 .. j1 - 1 using the
+   dispersions of "stack". Nothing is done if the refractive indexes are
+   not fitted. */
+extern void fit_engine_update_media(struct fit_engine *fit, stack_t *stack,
+                                    size_t j0, size_t j1, int deriv);
+
+/* Mark the mediums as up to date once all the points of the spectrum
+   have been updated. */
+extern void fit_engine_clean_media(struct fit_engine *fit, int deriv);
+
+/* If a parameter is eliminated by variable projection set its value in
+   x to the optimal one for the other parameters. */
+extern void fit_engine_update_projected(struct fit_engine *fit,
+                                        gsl_vector *x);
+
+/* Reset the accumulators of the normal equations of all the threads. */
+extern void fit_engine_normal_reset(struct fit_engine *fit);
+
+/* Add the contribution of a chunk of residuals and of the corresponding
+   rows of the jacobian. */
+extern void fit_normal_acc_add(struct fit_normal_acc *acc,
+                               const gsl_vector *f, const gsl_matrix *jacob);
+
+/* Sum the normal equations accumulated by the threads. */
+extern void fit_engine_normal_sum(struct fit_engine *fit, gsl_matrix *jtj,
+                                  gsl_vector *jtr, double *sumsq);
+
+/* Set the derivatives of the refractive indexes at the point "j" from
+   the cache of the fit run. */
+extern void fit_engine_load_media_deriv(const struct fit_engine *fit,
+                                        size_t j,
+                                        struct deriv_info *ideriv);
+
 extern int fit_engine_apply_param(struct fit_engine *fit,
                                   const fit_param_t *fp, double val);
 
@@ -129,8 +292,12 @@ extern double
 fit_engine_get_parameter_value(const struct fit_engine *fit,
                                const fit_param_t *fp);
 
-extern double
-fit_engine_estimate_param_grid_step(struct fit_engine *fit, const gsl_vector *x, const fit_param_t *fp, double delta);
+/* Estimate the grid step of each SEED_RANGE parameter with a single
+   evaluation of the jacobian. The steps of the other parameters are set
+   to zero. */
+extern void
+fit_engine_estimate_grid_steps(struct fit_engine *fit, const gsl_vector *x,
+                               const struct seeds *seeds, gsl_vector *steps);
 
 extern double
 fit_engine_get_seed_value(const struct fit_engine *fit, const fit_param_t *fp, const seed_t *s);
@@ -1,12 +1,441 @@
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 #include <gsl/gsl_vector.h>
 #include <gsl/gsl_multifit_nlin.h>
 #include <gsl/gsl_blas.h>
+#include <gsl/gsl_qrng.h>
 
 #include "lmfit.h"
+#include "lmfit-normal.h"
 #include "grid-search.h"
 #include "stack.h"
 #include "fit_result.h"
+#include "worker-pool.h"
+
+/* Candidate node of the screening phase. */
+struct grid_cand {
+    double chisq;
+    int node;
+};
+
+/* Bounded max-heap keeping the candidates with the lowest chisq. */
+struct grid_heap {
+    int size, capacity;
+    struct grid_cand *values;
+};
+
+/* State shared by the threads of a grid search. */
+struct grid_parallel {
+    struct fit_engine **engines;
+    gsl_multifit_fdfsolver **solvers;
+    gsl_vector **x;
+    gsl_vector **f;
+    struct grid_heap *heaps;
+    int nb_threads;
+
+    const seed_t *vseed;
+    const gsl_vector *x0;
+    const gsl_vector *pstep;
+    const int *nb_steps;
+    int nb_grid_pts;
+
+    /* Quasi-random points used instead of the grid nodes, if not NULL.
+       Each point has a coordinate in [0, 1) for each SEED_RANGE
+       parameter. */
+    const double *samples;
+    int nb_dims;
+    double chisq_threshold;
+
+    gui_hook_func_t hfun;
+    void *hdata;
+
+    /* Grid nodes to evaluate with the short LM search. If NULL the task
+       "i" corresponds to the node "i". */
+    const int *nodes;
+    int nb_tasks;
+
+    /* Chisq of each task, negative if the task was not evaluated. */
+    double *chisq;
+
+    /* Lowest index of a task below the chisq threshold or nb_tasks. It
+       is updated and read by the threads with atomic operations as the
+       stop request. */
+    int task_threshold;
+    int stop_request;
+};
+
+/* Ordering of the candidates with the ties broken by node index so that
+   the result does not depend on the order of evaluation. */
+static int
+grid_cand_less(const struct grid_cand *a, const struct grid_cand *b)
+{
+    return (a->chisq < b->chisq || (a->chisq == b->chisq && a->node < b->node));
+}
+
+static void
+grid_heap_push(struct grid_heap *h, double chisq, int node)
+{
+    struct grid_cand c = {chisq, node};
+    struct grid_cand *v = h->values;
+    int i;
+
+    if(h->size < h->capacity) {
+        for(i = h->size++; i > 0 && grid_cand_less(&v[(i-1)/2], &c); i = (i-1)/2) {
+            v[i] = v[(i-1)/2];
+        }
+        v[i] = c;
+    } else if(grid_cand_less(&c, &v[0])) {
+        for(i = 0; 2*i + 1 < h->size; ) {
+            int k = 2*i + 1;
+            if(k + 1 < h->size && grid_cand_less(&v[k], &v[k+1])) {
+                k++;
+            }
+            if(! grid_cand_less(&c, &v[k])) break;
+            v[i] = v[k];
+            i = k;
+        }
+        v[i] = c;
+    }
+}
+
+static int
+grid_cand_compare(const void *_a, const void *_b)
+{
+    const struct grid_cand *a = _a, *b = _b;
+    return grid_cand_less(a, b) ? -1 : (grid_cand_less(b, a) ? 1 : 0);
+}
+
+/* Set x to the parameters of the grid node of the given index. The last
+   parameter varies the fastest, as in the original grid search. */
+static void
+grid_node_params(const struct grid_parallel *gp, int node, int nb,
+                 gsl_vector *x)
+{
+    int j;
+
+    if(gp->samples) {
+        const double *u = gp->samples + node * gp->nb_dims;
+        for(j = 0; j < nb; j++) {
+            const seed_t *cs = &gp->vseed[j];
+            if(cs->type == SEED_RANGE) {
+                gsl_vector_set(x, j, cs->seed + cs->delta * (2 * (*u++) - 1));
+            }
+        }
+        return;
+    }
+
+    for(j = nb-1; j >= 0; j--) {
+        const seed_t *cs = &gp->vseed[j];
+        if(cs->type == SEED_RANGE) {
+            int i = node % gp->nb_steps[j];
+            node /= gp->nb_steps[j];
+            gsl_vector_set(x, j, cs->seed - cs->delta + i * gsl_vector_get(gp->pstep, j));
+        }
+    }
+}
+
+static double
+grid_node_chisq(gsl_multifit_fdfsolver *s, gsl_multifit_function_fdf *f,
+                gsl_vector *x)
+{
+    const int search_max_iters = 3;
+    double chi;
+    int j;
+
+    gsl_multifit_fdfsolver_set(s, f, x);
+
+    for(j = 0; j < search_max_iters; j++) {
+        if(gsl_multifit_fdfsolver_iterate(s) != 0) {
+            break;
+        }
+    }
+
+    chi = gsl_blas_dnrm2(s->f);
+    return 1.0E6 * pow(chi, 2.0) / f->n;
+}
+
+/* The hook function is called only by the thread that started the
+   search. */
+static void
+grid_progress(struct grid_parallel *gp, int thread, float xf)
+{
+    if(thread == 0 && gp->hfun) {
+        if((*gp->hfun)(gp->hdata, xf, NULL)) {
+            __atomic_store_n(&gp->stop_request, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Screening phase: only the residuals are computed at each node and the
+   best nodes are kept in the heap of the thread. Once the heap is full the
+   evaluation of a node is stopped as soon as it cannot enter the heap. A
+   node pruned this way could not be among the best nodes of all the
+   threads either, so the result does not depend on the threads. */
+static void
+grid_screen_task(void *data, int node, int thread)
+{
+    struct grid_parallel *gp = data;
+    struct fit_engine *fit = gp->engines[thread];
+    const struct grid_heap *h = &gp->heaps[thread];
+    const size_t n = fit->run->mffun_grid.n;
+    gsl_vector *x = gp->x[thread], *f = gp->f[thread];
+    double bound = HUGE_VAL, sumsq;
+    int status;
+
+    if(__atomic_load_n(&gp->stop_request, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    if(h->size == h->capacity) {
+        bound = h->values[0].chisq * n / 1.0E6;
+    }
+
+    grid_node_params(gp, node, fit->parameters->number, x);
+    status = fit->run->f_bounded(x, fit, f, bound, &sumsq);
+    if(status != FIT_EVAL_PRUNED) {
+        grid_heap_push(&gp->heaps[thread], 1.0E6 * sumsq / n, node);
+    }
+
+    grid_progress(gp, thread, node / (float) gp->nb_grid_pts);
+}
+
+static void
+grid_search_task(void *data, int task, int thread)
+{
+    struct grid_parallel *gp = data;
+    struct fit_engine *fit = gp->engines[thread];
+    gsl_vector *x = gp->x[thread];
+    const int node = (gp->nodes ? gp->nodes[task] : task);
+    double chisq;
+
+    /* The tasks are given in increasing order so all the tasks before
+       the one that met the threshold are evaluated anyway. */
+    if(__atomic_load_n(&gp->stop_request, __ATOMIC_RELAXED) ||
+            task > __atomic_load_n(&gp->task_threshold, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    grid_node_params(gp, node, fit->parameters->number, x);
+    chisq = grid_node_chisq(gp->solvers[thread], &fit->run->mffun_grid, x);
+    gp->chisq[task] = chisq;
+
+    if(chisq < gp->chisq_threshold) {
+        int prev = __atomic_load_n(&gp->task_threshold, __ATOMIC_RELAXED);
+        while(task < prev) {
+            prev = __sync_val_compare_and_swap(&gp->task_threshold, prev, task);
+        }
+    }
+
+    grid_progress(gp, thread, task / (float) gp->nb_tasks);
+}
+
+/* Run the tasks using the worker pool of the fit run, if any. */
+static void
+grid_run_tasks(struct fit_engine *fit, worker_pool_func_t func,
+               struct grid_parallel *gp, int nb_tasks)
+{
+    int k;
+
+    if(fit->run->pool) {
+        worker_pool_run(fit->run->pool, func, gp, nb_tasks);
+    } else {
+        for(k = 0; k < nb_tasks; k++) {
+            func(gp, k, 0);
+        }
+    }
+}
+
+/* Allocate the buffers of the threads. If a worker pool is available each
+   thread uses its own clone of the fit engine, kept by the fit run for the
+   following grid searches. */
+static void
+grid_threads_init(struct fit_engine *fit, struct grid_parallel *gp,
+                  int heap_capacity)
+{
+    gsl_multifit_function_fdf *f = &fit->run->mffun;
+    int k;
+
+    gp->nb_threads = (fit->run->pool ? worker_pool_threads(fit->run->pool) : 1);
+
+    if(fit->run->pool && !fit->run->grid_engines) {
+        fit->run->grid_engines = emalloc(gp->nb_threads * sizeof(struct fit_engine *));
+        for(k = 0; k < gp->nb_threads; k++) {
+            fit->run->grid_engines[k] = fit_engine_clone(fit);
+        }
+    }
+
+    gp->engines = emalloc(gp->nb_threads * sizeof(struct fit_engine *));
+    gp->solvers = emalloc(gp->nb_threads * sizeof(gsl_multifit_fdfsolver *));
+    gp->x = emalloc(gp->nb_threads * sizeof(gsl_vector *));
+    gp->f = emalloc(gp->nb_threads * sizeof(gsl_vector *));
+    gp->heaps = emalloc(gp->nb_threads * sizeof(struct grid_heap));
+
+    for(k = 0; k < gp->nb_threads; k++) {
+        if(fit->run->pool) {
+            gp->engines[k] = fit->run->grid_engines[k];
+            gp->engines[k]->extra[0] = fit->extra[0];
+        } else {
+            gp->engines[k] = fit;
+        }
+        gp->solvers[k] = gsl_multifit_fdfsolver_alloc(gsl_multifit_fdfsolver_lmsder, f->n, f->p);
+        gp->x[k] = gsl_vector_alloc(f->p);
+        gp->f[k] = gsl_vector_alloc(f->n);
+        gsl_vector_memcpy(gp->x[k], gp->x0);
+        gp->heaps[k].size = 0;
+        gp->heaps[k].capacity = heap_capacity;
+        gp->heaps[k].values = emalloc((heap_capacity > 0 ? heap_capacity : 1) * sizeof(struct grid_cand));
+    }
+
+    gp->stop_request = 0;
+}
+
+static void
+grid_threads_free(struct grid_parallel *gp)
+{
+    int k;
+
+    for(k = 0; k < gp->nb_threads; k++) {
+        gsl_multifit_fdfsolver_free(gp->solvers[k]);
+        gsl_vector_free(gp->x[k]);
+        gsl_vector_free(gp->f[k]);
+        free(gp->heaps[k].values);
+    }
+
+    free(gp->engines);
+    free(gp->solvers);
+    free(gp->x);
+    free(gp->f);
+    free(gp->heaps);
+}
+
+/* Run the short LM search for the given tasks and return the one
+   selected: the first task below the chisq threshold if any or otherwise
+   the best one, the lowest index being taken in case of ties. */
+static int
+grid_search_tasks(struct fit_engine *fit, struct grid_parallel *gp,
+                  double *chisq)
+{
+    int task, j;
+
+    gp->chisq = emalloc(gp->nb_tasks * sizeof(double));
+    for(j = 0; j < gp->nb_tasks; j++) {
+        gp->chisq[j] = -1.0;
+    }
+    gp->task_threshold = gp->nb_tasks;
+
+    grid_run_tasks(fit, grid_search_task, gp, gp->nb_tasks);
+
+    if(gp->task_threshold < gp->nb_tasks) {
+        task = gp->task_threshold;
+    } else {
+        for(task = -1, j = 0; j < gp->nb_tasks; j++) {
+            if(gp->chisq[j] >= 0 && (task < 0 || gp->chisq[j] < gp->chisq[task])) {
+                task = j;
+            }
+        }
+    }
+
+    if(task >= 0) {
+        *chisq = gp->chisq[task];
+    }
+
+    free(gp->chisq);
+    return task;
+}
+
+/* Evaluate the grid nodes, in parallel if a worker pool is available.
+   The result does not depend on the number of threads. Return the index
+   of the node selected. */
+static int
+grid_search_parallel(struct fit_engine *fit, struct grid_parallel *gp,
+                     double *chisq)
+{
+    int node;
+
+    grid_threads_init(fit, gp, 0);
+
+    gp->nodes = NULL;
+    gp->nb_tasks = gp->nb_grid_pts;
+    node = grid_search_tasks(fit, gp, chisq);
+
+    grid_threads_free(gp);
+    return node;
+}
+
+/* Two phase search: the residuals only are computed at each grid node to
+   select the "nb_best" best nodes and the short LM search is done only
+   for the latter, in order of increasing chisq. Return the index of the
+   node selected. */
+static int
+grid_search_screening(struct fit_engine *fit, struct grid_parallel *gp,
+                      int nb_best, double *chisq)
+{
+    struct grid_cand *cands;
+    int *nodes;
+    int k, j, nc, task, node = -1;
+
+    grid_threads_init(fit, gp, nb_best);
+
+    grid_run_tasks(fit, grid_screen_task, gp, gp->nb_grid_pts);
+
+    /* Merge the heaps of the threads keeping the best nb_best nodes. */
+    for(nc = 0, k = 0; k < gp->nb_threads; k++) {
+        nc += gp->heaps[k].size;
+    }
+    cands = emalloc((nc > 0 ? nc : 1) * sizeof(struct grid_cand));
+    for(nc = 0, k = 0; k < gp->nb_threads; k++) {
+        for(j = 0; j < gp->heaps[k].size; j++) {
+            cands[nc++] = gp->heaps[k].values[j];
+        }
+    }
+    qsort(cands, nc, sizeof(struct grid_cand), grid_cand_compare);
+    if(nc > nb_best) {
+        nc = nb_best;
+    }
+
+    nodes = emalloc((nc > 0 ? nc : 1) * sizeof(int));
+    for(j = 0; j < nc; j++) {
+        nodes[j] = cands[j].node;
+    }
+
+    if(nc > 0 && !gp->stop_request) {
+        gp->nodes = nodes;
+        gp->nb_tasks = nc;
+        task = grid_search_tasks(fit, gp, chisq);
+        node = (task >= 0 ? nodes[task] : -1);
+    }
+
+    /* In case of stop request the best node of the screening is taken. */
+    if(node < 0 && nc > 0) {
+        node = nodes[0];
+        *chisq = cands[0].chisq;
+    }
+
+    free(cands);
+    free(nodes);
+    grid_threads_free(gp);
+    return node;
+}
+
+/* Return the first "nb_samples" points of a low-discrepancy sequence in
+   dimension "nb_dims". The points are generated in advance so that the
+   threads can evaluate them in any order. */
+static double *
+grid_sample_points(int nb_dims, int nb_samples)
+{
+    const gsl_qrng_type *T = (nb_dims <= 40 ? gsl_qrng_sobol : gsl_qrng_halton);
+    gsl_qrng *q = gsl_qrng_alloc(T, nb_dims);
+    double *samples = emalloc(nb_samples * nb_dims * sizeof(double));
+    int k;
+
+    for(k = 0; k < nb_samples; k++) {
+        gsl_qrng_get(q, samples + k * nb_dims);
+    }
+
+    gsl_qrng_free(q);
+    return samples;
+}
 
 int
 lmfit_grid_run(struct fit_engine *fit, struct seeds *seeds,
@@ -17,13 +446,17 @@ lmfit_grid_run(struct fit_engine *fit, struct seeds *seeds,
     gsl_multifit_fdfsolver *s;
     gsl_multifit_function_fdf *f;
     struct fit_config *cfg = fit->config;
-    int nb, j, iter, nb_grid_pts, j_grid_pts;
+    int nb, j, iter, nb_grid_pts, nb_dims;
     gsl_vector *x, *xbest;
     double *xarr;
-    double chisq, chi, chisq_best = -1.0;
-    int status, stop_request = 0;
+    double chisq, chi;
+    int status, stop_request = 0, node;
+    struct grid_parallel gp[1];
     stack_t *initial_stack;
+    struct seeds grid_seeds[1];
     seed_t *vseed;
+    int *nb_steps;
+    double *samples = NULL;
 
     assert(fit->run);
 
@@ -34,6 +467,19 @@ lmfit_grid_run(struct fit_engine *fit, struct seeds *seeds,
 
     assert(fit->parameters->number == seeds->number);
 
+    if(fit->run->vp_index >= 0) {
+        /* The multiplier is computed for each node so it is not
+           searched. */
+        vseed = emalloc(nb * sizeof(seed_t));
+        memcpy(vseed, seeds->values, nb * sizeof(seed_t));
+        if(vseed[fit->run->vp_index].type == SEED_RANGE) {
+            vseed[fit->run->vp_index].type = SEED_SIMPLE;
+        }
+    }
+    grid_seeds->number = nb;
+    grid_seeds->alloc  = nb;
+    grid_seeds->values = vseed;
+
     x     = gsl_vector_alloc(nb);
     xbest = gsl_vector_alloc(nb);
 
@@ -52,19 +498,30 @@ lmfit_grid_run(struct fit_engine *fit, struct seeds *seeds,
         }
     }
 
+    nb_steps = emalloc(nb * sizeof(int));
+    nb_dims = 0;
     for(j = 0; j < nb; j++) {
-        if(vseed[j].type != SEED_RANGE) continue;
-        fit_param_t fp = fit->parameters->values[j];
-        double delta = vseed[j].delta;
-        double es = fit_engine_estimate_param_grid_step(fit, xbest, &fp, delta);
-        gsl_vector_set(pstep, j, es);
+        nb_steps[j] = 1;
+        if(vseed[j].type == SEED_RANGE) {
+            nb_dims++;
+        }
     }
 
-    nb_grid_pts = 1;
-    for(j = nb-1; j >= 0; j--) {
-        if(vseed[j].type == SEED_RANGE) {
-            seed_t *cs = &vseed[j];
-            nb_grid_pts *= 2 * cs->delta / gsl_vector_get(pstep, j) + 1;
+    if(cfg->grid_nb_samples > 0 && nb_dims > 0) {
+        /* The cost of the search is given by the number of samples and
+           does not depend on the number of parameters. */
+        nb_grid_pts = cfg->grid_nb_samples;
+        samples = grid_sample_points(nb_dims, nb_grid_pts);
+    } else {
+        fit_engine_estimate_grid_steps(fit, xbest, grid_seeds, pstep);
+
+        nb_grid_pts = 1;
+        for(j = nb-1; j >= 0; j--) {
+            if(vseed[j].type == SEED_RANGE) {
+                seed_t *cs = &vseed[j];
+                nb_steps[j] = (int) (2 * cs->delta / gsl_vector_get(pstep, j) + 1.0E-6) + 1;
+                nb_grid_pts *= nb_steps[j];
+            }
         }
     }
 
@@ -78,59 +535,27 @@ lmfit_grid_run(struct fit_engine *fit, struct seeds *seeds,
 
     result->interrupted = 0;
     result->chisq_threshold = cfg->chisq_threshold;
-    for(j_grid_pts = 0; ; j_grid_pts++) {
-        const int search_max_iters = 3;
-
-        gsl_multifit_fdfsolver_set(s, f, x);
-
-        for(j = 0; j < search_max_iters; j++) {
-            status = gsl_multifit_fdfsolver_iterate(s);
-            if(status != 0) {
-                break;
-            }
-        }
-
-        chi = gsl_blas_dnrm2(s->f);
-        chisq = 1.0E6 * pow(chi, 2.0) / f->n;
-
-        if(chisq_best < 0 || chisq < chisq_best) {
-            chisq_best = chisq;
-            gsl_vector_memcpy(xbest, x);
-        }
-
-        if(chisq < cfg->chisq_threshold) {
-            break;
-        }
-
-        if(hfun) {
-            float xf = j_grid_pts / (float)nb_grid_pts;
-            stop_request = (*hfun)(hdata, xf, NULL);
-            if(stop_request) {
-                break;
-            }
-        }
-
-        for(j = nb-1; j >= 0; j--) {
-            if(vseed[j].type == SEED_RANGE) {
-                xarr[j] += gsl_vector_get(pstep, j);
-                if(xarr[j] > vseed[j].seed + vseed[j].delta) {
-                    xarr[j] = vseed[j].seed - vseed[j].delta;
-                    continue;
-                }
-                break;
-            }
-        }
-
-        if(j < 0) {
-            break;
-        }
-    }
 
-    /* Case of grid search exhausted or stop request. */
-    if(j < 0 || stop_request) {
-        gsl_vector_memcpy(x, xbest);
-        chisq = chisq_best;
+    gp->vseed = vseed;
+    gp->x0 = x;
+    gp->pstep = pstep;
+    gp->nb_steps = nb_steps;
+    gp->nb_grid_pts = nb_grid_pts;
+    gp->samples = samples;
+    gp->nb_dims = nb_dims;
+    gp->chisq_threshold = cfg->chisq_threshold;
+    gp->hfun = hfun;
+    gp->hdata = hdata;
+
+    if(cfg->grid_nb_best > 0) {
+        node = grid_search_screening(fit, gp, cfg->grid_nb_best, &chisq);
+    } else {
+        node = grid_search_parallel(fit, gp, &chisq);
     }
+    assert(node >= 0);
+    grid_node_params(gp, node, nb, x);
+    stop_request = gp->stop_request;
+    status = GSL_SUCCESS;
 
     result->gsearch_chisq = chisq;
     result->chisq = chisq;
@@ -138,16 +563,27 @@ lmfit_grid_run(struct fit_engine *fit, struct seeds *seeds,
     result->interrupted = stop_request;
 
     if(stop_request == 0) {
-        status = lmfit_iter(x, f, s, cfg->nb_max_iters,
-                            cfg->epsabs, cfg->epsrel,
-                            & iter, hfun, hdata, & stop_request);
+        if(cfg->lm_normal) {
+            struct lmfit_normal *sn = lmfit_normal_alloc(f->p);
+            status = lmfit_normal_iter(x, fit, sn, cfg->nb_max_iters,
+                                       cfg->epsabs, cfg->epsrel,
+                                       & iter, hfun, hdata, & stop_request);
+            chi = sqrt(sn->sumsq);
+            lmfit_normal_free(sn);
+        } else {
+            status = lmfit_iter(x, f, s, cfg->nb_max_iters,
+                                cfg->epsabs, cfg->epsrel,
+                                & iter, hfun, hdata, & stop_request);
+            chi = gsl_blas_dnrm2(s->f);
+        }
 
-        chi = gsl_blas_dnrm2(s->f);
         result->chisq = 1.0E6 * pow(chi, 2.0) / f->n;
         result->status = status;
         result->iter = iter;
     }
 
+    fit_engine_update_projected(fit, x);
+
     if(preserve_init_stack) {
         /* we restore the initial stack */
         stack_free(fit->stack);
@@ -162,6 +598,11 @@ lmfit_grid_run(struct fit_engine *fit, struct seeds *seeds,
     gsl_vector_free(x);
     gsl_vector_free(xbest);
     gsl_vector_free(pstep);
+    free(nb_steps);
+    free(samples);
+    if(vseed != seeds->values) {
+        free(vseed);
+    }
 
     gsl_multifit_fdfsolver_free(s);
 
@@ -0,0 +1,185 @@
+#include <assert.h>
+
+#include "kernel-f32.h"
+
+static inline cmplf
+csqrf(cmplf x)
+{
+    return x*x;
+}
+
+static inline cmplf
+snell_cosf(cmplf nsin0, cmplf nlyr)
+{
+    cmplf s = nsin0 / nlyr;
+    return csqrtf(1.0f - csqrf(s));
+}
+
+float
+mult_layer_refl_ni_f32(int nb, const cmplf ns[], const float ds[],
+                       float lambda)
+{
+    const float omega = 2 * (float) M_PI / lambda;
+    cmplf R;
+    int j;
+
+    R = (ns[nb-1] - ns[nb-2]) / (ns[nb-1] + ns[nb-2]);
+
+    for(j = nb - 3; j >= 0; j--) {
+        const cmplf r = (ns[j+1] - ns[j]) / (ns[j+1] + ns[j]);
+        const float th = THICKNESS_TO_NM(ds[j]);
+        const cmplf beta = - 2.0f * I * omega * ns[j+1];
+        const cmplf Rrho = R * cexpf(beta * th);
+        R = (r + Rrho) / (1 + r * Rrho);
+    }
+
+    return crealf(R)*crealf(R) + cimagf(R)*cimagf(R);
+}
+
+/* Evaluate up to REFL_BATCH_SIZE_F32 wavelengths with a structure of
+   arrays layout so that the compiler can vectorize over the wavelengths.
+   The lanes beyond "nlambda" repeat the last wavelength. */
+static void
+mult_layer_refl_ni_block_f32(int nb, int nlambda, const cmplf rc[],
+                             const cmplf beta[], const float ds[],
+                             float refl[])
+{
+    const int nrc = nb - 1, nbeta = nb - 2;
+    float Rr[REFL_BATCH_SIZE_F32], Ri[REFL_BATCH_SIZE_F32];
+    float rr[REFL_BATCH_SIZE_F32], ri[REFL_BATCH_SIZE_F32];
+    float br[REFL_BATCH_SIZE_F32], bi[REFL_BATCH_SIZE_F32];
+    int j, k;
+
+    for(k = 0; k < REFL_BATCH_SIZE_F32; k++) {
+        const int kk = (k < nlambda ? k : nlambda - 1);
+        Rr[k] = crealf(rc[kk * nrc + nb - 2]);
+        Ri[k] = cimagf(rc[kk * nrc + nb - 2]);
+    }
+
+    for(j = nb - 3; j >= 0; j--) {
+        const float th = ds[j];
+
+        for(k = 0; k < REFL_BATCH_SIZE_F32; k++) {
+            const int kk = (k < nlambda ? k : nlambda - 1);
+            rr[k] = crealf(rc[kk * nrc + j]);
+            ri[k] = cimagf(rc[kk * nrc + j]);
+            br[k] = crealf(beta[kk * nbeta + j]);
+            bi[k] = cimagf(beta[kk * nbeta + j]);
+        }
+
+        for(k = 0; k < REFL_BATCH_SIZE_F32; k++) {
+            /* See mult_layer_refl_ni_block for the shifted cosine. */
+            const float ea = expf(br[k] * th);
+            const float rhor = ea * cosf(bi[k] * th);
+            const float rhoi = ea * cosf((float) M_PI_2 - bi[k] * th);
+            const float sr = Rr[k]*rhor - Ri[k]*rhoi;
+            const float si = Rr[k]*rhoi + Ri[k]*rhor;
+            const float numr = rr[k] + sr, numi = ri[k] + si;
+            const float denr = 1 + rr[k]*sr - ri[k]*si, deni = rr[k]*si + ri[k]*sr;
+            const float iden = 1 / (denr*denr + deni*deni);
+            Rr[k] = (numr*denr + numi*deni) * iden;
+            Ri[k] = (numi*denr - numr*deni) * iden;
+        }
+    }
+
+    for(k = 0; k < nlambda; k++) {
+        refl[k] = Rr[k]*Rr[k] + Ri[k]*Ri[k];
+    }
+}
+
+void
+mult_layer_refl_ni_batch_f32(int nb, int nlambda, const cmplf rc[],
+                             const cmplf beta[], const float ds[],
+                             float refl[])
+{
+    int k;
+
+    assert(nb >= 2);
+
+    for(k = 0; k < nlambda; k += REFL_BATCH_SIZE_F32) {
+        int nblock = (nlambda - k < REFL_BATCH_SIZE_F32 ? nlambda - k : REFL_BATCH_SIZE_F32);
+        mult_layer_refl_ni_block_f32(nb, nblock, rc + k * (nb - 1),
+                                     beta + k * (nb - 2), ds, refl + k);
+    }
+}
+
+static void
+se_result_f32(enum se_type type, const cmplf R[], float anlz, float e[2])
+{
+    const cmplf rho = R[POL_P] / R[POL_S];
+    const float sqtpsi = crealf(rho)*crealf(rho) + cimagf(rho)*cimagf(rho);
+
+    if(type == SE_ALPHA_BETA) {
+        const float tanlz = tanf(anlz);
+        const float tasq = tanlz * tanlz;
+        const float iden = 1 / (sqtpsi + tasq);
+        e[0] = (sqtpsi - tasq) * iden;
+        e[1] = 2 * crealf(rho) * tanlz * iden;
+    } else {
+        e[0] = sqrtf(sqtpsi);
+        e[1] = crealf(rho) / e[0];
+    }
+}
+
+void
+mult_layer_se_f32(enum se_type type, int nb, const cmplf ns[], float phi0,
+                  const float ds[], float lambda, float anlz, float e[2])
+{
+    const float omega = 2 * (float) M_PI / lambda;
+    const cmplf nsin0 = ns[0] * sinf(phi0);
+    cmplf cost, cosc, R[2];
+    int j;
+
+    cost = snell_cosf(nsin0, ns[nb-2]);
+    cosc = snell_cosf(nsin0, ns[nb-1]);
+
+    R[POL_S] = (ns[nb-2]*cost - ns[nb-1]*cosc) / (ns[nb-2]*cost + ns[nb-1]*cosc);
+    R[POL_P] = (ns[nb-1]*cost - ns[nb-2]*cosc) / (ns[nb-1]*cost + ns[nb-2]*cosc);
+
+    for(j = nb - 3; j >= 0; j--) {
+        const cmplf nt = ns[j], nc = ns[j+1];
+        const float th = THICKNESS_TO_NM(ds[j]);
+        cmplf r[2], rho;
+        polar_t p;
+
+        cosc = cost;
+        cost = snell_cosf(nsin0, nt);
+
+        r[POL_S] = (nt*cost - nc*cosc) / (nt*cost + nc*cosc);
+        r[POL_P] = (nc*cost - nt*cosc) / (nc*cost + nt*cosc);
+
+        rho = cexpf(- 2.0f * I * omega * nc * cosc * th);
+
+        for(p = 0; p <= 1; p++) {
+            const cmplf Rrho = R[p] * rho;
+            R[p] = (r[p] + Rrho) / (1 + r[p] * Rrho);
+        }
+    }
+
+    se_result_f32(type, R, anlz, e);
+}
+
+void
+mult_layer_se_precomp_f32(enum se_type type, int nb, const cmplf rc[],
+                          const cmplf beta[], const float ds[], float anlz,
+                          float e[2])
+{
+    cmplf R[2];
+    polar_t p;
+    int j;
+
+    R[POL_S] = rc[nb-2];
+    R[POL_P] = rc[2*nb-3];
+
+    for(j = nb - 3; j >= 0; j--) {
+        const cmplf rho = cexpf(beta[j] * ds[j]);
+
+        for(p = 0; p <= 1; p++) {
+            const cmplf r = rc[p * (nb - 1) + j];
+            const cmplf Rrho = R[p] * rho;
+            R[p] = (r + Rrho) / (1 + r * Rrho);
+        }
+    }
+
+    se_result_f32(type, R, anlz, e);
+}
@@ -0,0 +1,43 @@
+#ifndef KERNEL_F32_H
+#define KERNEL_F32_H
+
+#include "common.h"
+#include "cmpl.h"
+#include "elliss.h"
+
+__BEGIN_DECLS
+
+/* Single precision variants of the reflectometry and ellipsometry kernels.
+   They compute only the theoretical values, without derivatives, and are
+   meant to rank the nodes of a grid search where the residuals do not
+   need to be accurate. Repeated blocks of layers and the numerical
+   aperture are not supported. */
+
+typedef float complex cmplf;
+
+/* Number of wavelengths evaluated together by mult_layer_refl_ni_batch_f32. */
+#define REFL_BATCH_SIZE_F32 16
+
+extern float mult_layer_refl_ni_f32(int nb, const cmplf ns[],
+                                    const float ds[], float lambda);
+
+/* Same as mult_layer_refl_ni_batch using single precision tables with the
+   same layout. */
+extern void mult_layer_refl_ni_batch_f32(int nb, int nlambda,
+                                         const cmplf rc[], const cmplf beta[],
+                                         const float ds[], float refl[]);
+
+extern void mult_layer_se_f32(enum se_type type, int nb, const cmplf ns[],
+                              float phi0, const float ds[], float lambda,
+                              float anlz, float e[2]);
+
+/* Same as mult_layer_se_precomp using single precision tables with the
+   same layout. */
+extern void mult_layer_se_precomp_f32(enum se_type type, int nb,
+                                      const cmplf rc[], const cmplf beta[],
+                                      const float ds[], float anlz,
+                                      float e[2]);
+
+__END_DECLS
+
+#endif
@@ -0,0 +1,486 @@
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+#include "common.h"
+#include "lmfit-multi-normal.h"
+#include "worker-pool.h"
+
+#include <gsl/gsl_blas.h>
+#include <gsl/gsl_multifit_nlin.h>
+
+/* Number of consecutive rejected steps after which the search stops. */
+#define LMFIT_MULTI_MAX_REJECT 15
+
+static void
+block_alloc(struct lmfit_multi_block *b, size_t nc, size_t np)
+{
+    b->u = gsl_matrix_alloc(nc, nc);
+    b->v = gsl_matrix_alloc(np, np);
+    b->w = gsl_matrix_alloc(nc, np);
+    b->gc = gsl_vector_alloc(nc);
+    b->gp = gsl_vector_alloc(np);
+}
+
+static void
+block_free(struct lmfit_multi_block *b)
+{
+    gsl_matrix_free(b->u);
+    gsl_matrix_free(b->v);
+    gsl_matrix_free(b->w);
+    gsl_vector_free(b->gc);
+    gsl_vector_free(b->gp);
+}
+
+struct lmfit_multi_normal *
+lmfit_multi_normal_alloc(struct multi_fit_engine *fit)
+{
+    struct lmfit_multi_normal *s = emalloc(sizeof(struct lmfit_multi_normal));
+    const size_t nc = fit->common_parameters->number;
+    const size_t np = fit->private_parameters->number;
+    const size_t p = nc + np * fit->samples_number;
+    size_t nr_max = 0;
+    int k;
+
+    s->nc = nc;
+    s->np = np;
+    s->nb_samples = fit->samples_number;
+
+    s->x = gsl_vector_alloc(p);
+    s->dx = gsl_vector_alloc(p);
+    s->x_trial = gsl_vector_alloc(p);
+    s->diag = gsl_vector_alloc(p);
+
+    s->blocks = emalloc(s->nb_samples * sizeof(struct lmfit_multi_block));
+    s->blocks_trial = emalloc(s->nb_samples * sizeof(struct lmfit_multi_block));
+    s->elim = emalloc(s->nb_samples * sizeof(struct lmfit_multi_elim));
+    for(k = 0; k < s->nb_samples; k++) {
+        const size_t nr = multi_fit_engine_sample_rows(fit, k);
+        block_alloc(s->blocks + k, nc, np);
+        block_alloc(s->blocks_trial + k, nc, np);
+        s->elim[k].chol = gsl_matrix_alloc(np, np);
+        s->elim[k].y = gsl_matrix_alloc(np, nc);
+        s->elim[k].z = gsl_vector_alloc(np);
+        if(nr > nr_max) {
+            nr_max = nr;
+        }
+    }
+
+    s->schur = gsl_matrix_alloc(nc, nc);
+    s->rhs = gsl_vector_alloc(nc);
+
+    s->nb_threads = (fit->pool ? worker_pool_threads(fit->pool) : 1);
+    s->f_buf = emalloc(s->nb_threads * sizeof(double *));
+    s->jacob_buf = emalloc(s->nb_threads * sizeof(double *));
+    for(k = 0; k < s->nb_threads; k++) {
+        s->f_buf[k] = emalloc(nr_max * sizeof(double));
+        s->jacob_buf[k] = emalloc(nr_max * (nc + np) * sizeof(double));
+    }
+
+    return s;
+}
+
+void
+lmfit_multi_normal_free(struct lmfit_multi_normal *s)
+{
+    int k;
+
+    gsl_vector_free(s->x);
+    gsl_vector_free(s->dx);
+    gsl_vector_free(s->x_trial);
+    gsl_vector_free(s->diag);
+
+    for(k = 0; k < s->nb_samples; k++) {
+        block_free(s->blocks + k);
+        block_free(s->blocks_trial + k);
+        gsl_matrix_free(s->elim[k].chol);
+        gsl_matrix_free(s->elim[k].y);
+        gsl_vector_free(s->elim[k].z);
+    }
+    free(s->blocks);
+    free(s->blocks_trial);
+    free(s->elim);
+
+    gsl_matrix_free(s->schur);
+    gsl_vector_free(s->rhs);
+
+    for(k = 0; k < s->nb_threads; k++) {
+        free(s->f_buf[k]);
+        free(s->jacob_buf[k]);
+    }
+    free(s->f_buf);
+    free(s->jacob_buf);
+
+    free(s);
+}
+
+/* In place Cholesky factorization of the lower triangle of a. Return non
+   zero if the matrix is not positive definite. */
+static int
+cholesky_decomp(gsl_matrix *a)
+{
+    const size_t n = a->size1;
+    size_t i, j, k;
+
+    for(j = 0; j < n; j++) {
+        double d = gsl_matrix_get(a, j, j);
+
+        for(k = 0; k < j; k++) {
+            const double l = gsl_matrix_get(a, j, k);
+            d -= l * l;
+        }
+        if(!(d > 0.0)) {
+            return 1;
+        }
+        d = sqrt(d);
+        gsl_matrix_set(a, j, j, d);
+
+        for(i = j + 1; i < n; i++) {
+            double b = gsl_matrix_get(a, i, j);
+            for(k = 0; k < j; k++) {
+                b -= gsl_matrix_get(a, i, k) * gsl_matrix_get(a, j, k);
+            }
+            gsl_matrix_set(a, i, j, b / d);
+        }
+    }
+
+    return 0;
+}
+
+/* Solve L L^T x = b in place. */
+static void
+cholesky_solve(const gsl_matrix *l, gsl_vector *b)
+{
+    const size_t n = l->size1;
+    size_t i, k;
+
+    for(i = 0; i < n; i++) {
+        double v = gsl_vector_get(b, i);
+        for(k = 0; k < i; k++) {
+            v -= gsl_matrix_get(l, i, k) * gsl_vector_get(b, k);
+        }
+        gsl_vector_set(b, i, v / gsl_matrix_get(l, i, i));
+    }
+
+    for(i = n; i-- > 0; ) {
+        double v = gsl_vector_get(b, i);
+        for(k = i + 1; k < n; k++) {
+            v -= gsl_matrix_get(l, k, i) * gsl_vector_get(b, k);
+        }
+        gsl_vector_set(b, i, v / gsl_matrix_get(l, i, i));
+    }
+}
+
+/* Run a task for each sample, in parallel if the engine has a pool of
+   threads. */
+static void
+run_samples(struct multi_fit_engine *fit, worker_pool_func_t func, void *data)
+{
+    if(fit->pool) {
+        worker_pool_run(fit->pool, func, data, fit->samples_number);
+    } else {
+        int k;
+        for(k = 0; k < fit->samples_number; k++) {
+            func(data, k, 0);
+        }
+    }
+}
+
+struct multi_normal_job {
+    struct multi_fit_engine *fit;
+    struct lmfit_multi_normal *s;
+    struct lmfit_multi_block *blocks;
+};
+
+/* Evaluate a sample and compute its blocks of the normal equations. */
+static void
+eval_sample_task(void *data, int sample, int thread)
+{
+    struct multi_normal_job *job = data;
+    struct lmfit_multi_normal *s = job->s;
+    struct lmfit_multi_block *b = job->blocks + sample;
+    const size_t nr = multi_fit_engine_sample_rows(job->fit, sample);
+    gsl_vector_view fv = gsl_vector_view_array(s->f_buf[thread], nr);
+    gsl_matrix_view jv = gsl_matrix_view_array(s->jacob_buf[thread], nr, s->nc + s->np);
+    gsl_matrix_view jc = gsl_matrix_submatrix(&jv.matrix, 0, 0, nr, s->nc);
+    gsl_matrix_view jp = gsl_matrix_submatrix(&jv.matrix, 0, s->nc, nr, s->np);
+
+    job->fit->sample_fdf(job->fit, sample, &fv.vector, &jv.matrix, s->nc);
+
+    gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, &jc.matrix, &jc.matrix, 0.0, b->u);
+    gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, &jp.matrix, &jp.matrix, 0.0, b->v);
+    gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, &jc.matrix, &jp.matrix, 0.0, b->w);
+    gsl_blas_dgemv(CblasTrans, 1.0, &jc.matrix, &fv.vector, 0.0, b->gc);
+    gsl_blas_dgemv(CblasTrans, 1.0, &jp.matrix, &fv.vector, 0.0, b->gp);
+    gsl_blas_ddot(&fv.vector, &fv.vector, &b->sumsq);
+}
+
+static double
+multi_normal_eval(struct multi_fit_engine *fit, struct lmfit_multi_normal *s,
+                  const gsl_vector *x, struct lmfit_multi_block *blocks)
+{
+    struct multi_normal_job job[1] = {{fit, s, blocks}};
+    double sumsq = 0.0;
+    int k;
+
+    multi_fit_engine_commit_parameters(fit, x);
+    run_samples(fit, eval_sample_task, job);
+
+    for(k = 0; k < fit->samples_number; k++) {
+        sumsq += blocks[k].sumsq;
+    }
+
+    return sumsq;
+}
+
+/* Same scaling of the parameters used by lmfit_normal. */
+static void
+update_diag(struct lmfit_multi_normal *s)
+{
+    size_t i;
+    int k;
+
+    for(i = 0; i < s->nc; i++) {
+        double d = 0.0;
+        for(k = 0; k < s->nb_samples; k++) {
+            d += gsl_matrix_get(s->blocks[k].u, i, i);
+        }
+        d = sqrt(d);
+        if(d > gsl_vector_get(s->diag, i)) {
+            gsl_vector_set(s->diag, i, d);
+        } else if(gsl_vector_get(s->diag, i) == 0.0) {
+            gsl_vector_set(s->diag, i, 1.0);
+        }
+    }
+
+    for(k = 0; k < s->nb_samples; k++) {
+        for(i = 0; i < s->np; i++) {
+            const size_t ip = s->nc + k * s->np + i;
+            const double d = sqrt(gsl_matrix_get(s->blocks[k].v, i, i));
+            if(d > gsl_vector_get(s->diag, ip)) {
+                gsl_vector_set(s->diag, ip, d);
+            } else if(gsl_vector_get(s->diag, ip) == 0.0) {
+                gsl_vector_set(s->diag, ip, 1.0);
+            }
+        }
+    }
+}
+
+/* Factorize the damped private block of a sample and compute the terms
+   used to eliminate its private parameters. */
+static void
+elim_sample_task(void *data, int sample, int thread)
+{
+    struct lmfit_multi_normal *s = data;
+    struct lmfit_multi_block *b = s->blocks + sample;
+    struct lmfit_multi_elim *e = s->elim + sample;
+    size_t i, j;
+
+    gsl_matrix_memcpy(e->chol, b->v);
+    for(i = 0; i < s->np; i++) {
+        const double d = gsl_vector_get(s->diag, s->nc + sample * s->np + i);
+        *gsl_matrix_ptr(e->chol, i, i) += s->mu * d * d;
+    }
+
+    e->failed = cholesky_decomp(e->chol);
+    if(e->failed) {
+        return;
+    }
+
+    for(j = 0; j < s->nc; j++) {
+        gsl_vector_view yj = gsl_matrix_column(e->y, j);
+        gsl_vector_const_view wj = gsl_matrix_const_row(b->w, j);
+        gsl_vector_memcpy(&yj.vector, &wj.vector);
+        cholesky_solve(e->chol, &yj.vector);
+    }
+
+    gsl_vector_memcpy(e->z, b->gp);
+    cholesky_solve(e->chol, e->z);
+}
+
+/* Compute the step of the private parameters of a sample once the step
+   of the common parameters is known. */
+static void
+back_sample_task(void *data, int sample, int thread)
+{
+    struct lmfit_multi_normal *s = data;
+    struct lmfit_multi_elim *e = s->elim + sample;
+    gsl_vector_view dc = gsl_vector_subvector(s->dx, 0, s->nc);
+    gsl_vector_view dp = gsl_vector_subvector(s->dx, s->nc + sample * s->np, s->np);
+
+    gsl_vector_memcpy(&dp.vector, e->z);
+    gsl_blas_dgemv(CblasNoTrans, -1.0, e->y, &dc.vector, -1.0, &dp.vector);
+}
+
+/* Solve (J^T J + mu D^2) dx = - J^T f. The private parameters of each
+   sample are eliminated to obtain the Schur complement onto the common
+   parameters. Return non zero if the damped system is not positive
+   definite. */
+static int
+damped_solve(struct lmfit_multi_normal *s, struct multi_fit_engine *fit)
+{
+    size_t i;
+    int k;
+
+    run_samples(fit, elim_sample_task, s);
+
+    for(k = 0; k < s->nb_samples; k++) {
+        if(s->elim[k].failed) {
+            return 1;
+        }
+    }
+
+    gsl_matrix_set_zero(s->schur);
+    gsl_vector_set_zero(s->rhs);
+    for(k = 0; k < s->nb_samples; k++) {
+        struct lmfit_multi_block *b = s->blocks + k;
+        struct lmfit_multi_elim *e = s->elim + k;
+
+        gsl_matrix_add(s->schur, b->u);
+        gsl_blas_dgemm(CblasNoTrans, CblasNoTrans, -1.0, b->w, e->y, 1.0, s->schur);
+        gsl_vector_sub(s->rhs, b->gc);
+        gsl_blas_dgemv(CblasNoTrans, 1.0, b->w, e->z, 1.0, s->rhs);
+    }
+
+    for(i = 0; i < s->nc; i++) {
+        const double d = gsl_vector_get(s->diag, i);
+        *gsl_matrix_ptr(s->schur, i, i) += s->mu * d * d;
+    }
+
+    if(cholesky_decomp(s->schur)) {
+        return 1;
+    }
+    cholesky_solve(s->schur, s->rhs);
+
+    for(i = 0; i < s->nc; i++) {
+        gsl_vector_set(s->dx, i, gsl_vector_get(s->rhs, i));
+    }
+
+    run_samples(fit, back_sample_task, s);
+
+    return 0;
+}
+
+/* Scalar product of dx with the gradient J^T f. */
+static double
+gradient_dot(const struct lmfit_multi_normal *s)
+{
+    gsl_vector_const_view dc = gsl_vector_const_subvector(s->dx, 0, s->nc);
+    double r = 0.0, t;
+    int k;
+
+    for(k = 0; k < s->nb_samples; k++) {
+        gsl_vector_const_view dp = gsl_vector_const_subvector(s->dx, s->nc + k * s->np, s->np);
+        gsl_blas_ddot(&dc.vector, s->blocks[k].gc, &t);
+        r += t;
+        gsl_blas_ddot(&dp.vector, s->blocks[k].gp, &t);
+        r += t;
+    }
+
+    return r;
+}
+
+/* Take a step that reduces the sum of squares, with the same strategy
+   used by lmfit_normal. */
+static int
+lmfit_multi_normal_iterate(struct lmfit_multi_normal *s, struct multi_fit_engine *fit)
+{
+    int nb_reject = 0;
+    size_t i;
+
+    while(nb_reject < LMFIT_MULTI_MAX_REJECT) {
+        double dx_g, dx_d2, pred, rho;
+
+        if(damped_solve(s, fit)) {
+            s->mu *= s->nu;
+            s->nu *= 2;
+            nb_reject++;
+            continue;
+        }
+
+        gsl_vector_memcpy(s->x_trial, s->x);
+        gsl_vector_add(s->x_trial, s->dx);
+
+        s->sumsq_trial = multi_normal_eval(fit, s, s->x_trial, s->blocks_trial);
+
+        /* Reduction of the sum of squares predicted by the linear model. */
+        dx_g = gradient_dot(s);
+        for(dx_d2 = 0.0, i = 0; i < s->dx->size; i++) {
+            const double d = gsl_vector_get(s->diag, i) * gsl_vector_get(s->dx, i);
+            dx_d2 += d * d;
+        }
+        pred = - dx_g + s->mu * dx_d2;
+        rho = (s->sumsq - s->sumsq_trial) / pred;
+
+        if(pred > 0.0 && rho > 0.0) {
+            const double t = 2 * rho - 1;
+            struct lmfit_multi_block *blocks = s->blocks;
+            gsl_vector *x = s->x;
+
+            s->blocks = s->blocks_trial;
+            s->blocks_trial = blocks;
+            s->x = s->x_trial;
+            s->x_trial = x;
+            s->sumsq = s->sumsq_trial;
+
+            update_diag(s);
+
+            s->mu *= (1 - t * t * t > 1.0 / 3.0 ? 1 - t * t * t : 1.0 / 3.0);
+            s->nu = 2.0;
+            return GSL_SUCCESS;
+        }
+
+        s->mu *= s->nu;
+        s->nu *= 2;
+        nb_reject++;
+    }
+
+    return GSL_ENOPROG;
+}
+
+int
+lmfit_multi_normal_iter(gsl_vector *x, struct multi_fit_engine *fit,
+                        struct lmfit_multi_normal *s, const int max_iter,
+                        double epsabs, double epsrel, int *nb_iter,
+                        gui_hook_func_t hfun, void *hdata, int *user_stop)
+{
+    int iter = 0, status;
+    int stop_request = 0;
+
+    gsl_vector_memcpy(s->x, x);
+    s->sumsq = multi_normal_eval(fit, s, s->x, s->blocks);
+
+    gsl_vector_set_zero(s->diag);
+    update_diag(s);
+
+    s->mu = 1.0E-3;
+    s->nu = 2.0;
+
+    if(hfun) {
+        stop_request = (*hfun)(hdata, 0.0, "Running Levenberg-Marquardt search...");
+    }
+
+    do {
+        if(hfun) {
+            stop_request = (*hfun)(hdata, iter / (float)max_iter, NULL);
+        }
+
+        iter++;
+        status = lmfit_multi_normal_iterate(s, fit);
+
+        if(status) {
+            break;
+        }
+
+        status = gsl_multifit_test_delta(s->dx, s->x, epsabs, epsrel);
+    } while(status == GSL_CONTINUE && iter < max_iter && !stop_request);
+
+    gsl_vector_memcpy(x, s->x);
+
+    *nb_iter = iter;
+    if(user_stop) {
+        *user_stop = stop_request;
+    }
+
+    return status;
+}
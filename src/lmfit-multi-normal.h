@@ -0,0 +1,70 @@
+#ifndef LMFIT_MULTI_NORMAL_H
+#define LMFIT_MULTI_NORMAL_H
+
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+
+#include "lmfit.h"
+#include "multi-fit-engine.h"
+
+__BEGIN_DECLS
+
+/* Normal equations of a single sample. Only the blocks involving the
+   common parameters c and the private parameters p of the sample are
+   non zero. */
+struct lmfit_multi_block {
+    gsl_matrix *u; /* Jc^T Jc */
+    gsl_matrix *v; /* Jp^T Jp */
+    gsl_matrix *w; /* Jc^T Jp */
+    gsl_vector *gc, *gp;
+    double sumsq;
+};
+
+/* Terms of the damped system of a sample used to eliminate its private
+   parameters: (V + mu Dp^2)^-1 W^T and (V + mu Dp^2)^-1 gp. */
+struct lmfit_multi_elim {
+    gsl_matrix *chol;
+    gsl_matrix *y;
+    gsl_vector *z;
+    int failed;
+};
+
+/* Levenberg-Marquardt solver for the multi-sample fit. The jacobian
+   is block-arrow sparse so the normal equations are stored by sample
+   and the damped system is solved with the Schur complement onto the
+   common parameters. The cost grows linearly with the number of
+   samples. */
+struct lmfit_multi_normal {
+    size_t nc, np;
+    int nb_samples;
+
+    gsl_vector *x, *dx, *x_trial;
+    struct lmfit_multi_block *blocks, *blocks_trial;
+    double sumsq, sumsq_trial;
+
+    gsl_vector *diag;
+    double mu, nu;
+
+    struct lmfit_multi_elim *elim;
+    gsl_matrix *schur;
+    gsl_vector *rhs;
+
+    /* Residuals and jacobian of a sample, for each thread. */
+    int nb_threads;
+    double **f_buf, **jacob_buf;
+};
+
+extern struct lmfit_multi_normal *lmfit_multi_normal_alloc(struct multi_fit_engine *fit);
+extern void lmfit_multi_normal_free(struct lmfit_multi_normal *s);
+
+/* Same as lmfit_normal_iter for the multi-sample fit. On return the
+   sum of squares of each sample is in s->blocks. */
+extern int  lmfit_multi_normal_iter(gsl_vector *x, struct multi_fit_engine *fit,
+                                    struct lmfit_multi_normal *s, const int max_iter,
+                                    double epsabs, double epsrel, int *nb_iter,
+                                    gui_hook_func_t hfun, void *hdata,
+                                    int *user_stop);
+
+__END_DECLS
+
+#endif
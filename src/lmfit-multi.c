@@ -6,6 +6,7 @@
 #include "str.h"
 #include "lmfit.h"
 #include "lmfit-multi.h"
+#include "lmfit-multi-normal.h"
 #include "fit-params.h"
 #include "multi-fit-engine.h"
 #include "vector_print.h"
@@ -18,7 +19,8 @@ lmfit_multi(struct multi_fit_engine *fit,
             gui_hook_func_t hfun, void *hdata)
 {
     const gsl_multifit_fdfsolver_type *T;
-    gsl_multifit_fdfsolver *s;
+    gsl_multifit_fdfsolver *s = NULL;
+    struct lmfit_multi_normal *sn = NULL;
     gsl_multifit_function_fdf *f = & fit->mffun;
     struct fit_config *cfg = &fit->config;
     int status, stop_request = 0;
@@ -31,9 +33,6 @@ lmfit_multi(struct multi_fit_engine *fit,
 
     x = gsl_vector_alloc(nb_common + nb_priv * nb_samples);
 
-    T = gsl_multifit_fdfsolver_lmsder;
-    s = gsl_multifit_fdfsolver_alloc(T, f->n, f->p);
-
     for(k = 0; k < seeds_common->number; k++) {
         gsl_vector_set(x, k, multi_fit_engine_get_seed_value(fit, &fit->common_parameters->values[k], &seeds_common->values[k]));
     }
@@ -47,22 +46,39 @@ lmfit_multi(struct multi_fit_engine *fit,
         print_vector(analysis, "%.5f", x);
     }
 
-    status = lmfit_iter(x, f, s, cfg->nb_max_iters,
-                        cfg->epsabs, cfg->epsrel,
-                        & iter, hfun, hdata, & stop_request);
-
-    j_sample = 0;
-    for(k = 0; k < fit->samples_number; k++) {
-        struct spectrum *spectrum = fit->spectra_list[k];
-        double chisq = 0;
-        int j, np = spectra_points(spectrum);
-
-        for(j = 0; j < np; j++, j_sample++) {
-            double fres = gsl_vector_get(s->f, j_sample);
-            chisq += fres * fres;
+    if(cfg->lm_normal && nb_common > 0 && nb_priv > 0) {
+        /* The jacobian is never stored, the normal equations are
+           solved sample by sample. */
+        sn = lmfit_multi_normal_alloc(fit);
+        status = lmfit_multi_normal_iter(x, fit, sn, cfg->nb_max_iters,
+                                         cfg->epsabs, cfg->epsrel,
+                                         & iter, hfun, hdata, & stop_request);
+
+        for(k = 0; k < fit->samples_number; k++) {
+            int np = spectra_points(fit->spectra_list[k]);
+            gsl_vector_set(fit->chisq, k, 1.0e6 * sn->blocks[k].sumsq / np);
+        }
+    } else {
+        T = gsl_multifit_fdfsolver_lmsder;
+        s = gsl_multifit_fdfsolver_alloc(T, f->n, f->p);
+
+        status = lmfit_iter(x, f, s, cfg->nb_max_iters,
+                            cfg->epsabs, cfg->epsrel,
+                            & iter, hfun, hdata, & stop_request);
+
+        j_sample = 0;
+        for(k = 0; k < fit->samples_number; k++) {
+            struct spectrum *spectrum = fit->spectra_list[k];
+            double chisq = 0;
+            int j, np = spectra_points(spectrum);
+
+            for(j = 0; j < np; j++, j_sample++) {
+                double fres = gsl_vector_get(s->f, j_sample);
+                chisq += fres * fres;
+            }
+
+            gsl_vector_set(fit->chisq, k, 1.0e6 * chisq / np);
         }
-
-        gsl_vector_set(fit->chisq, k, 1.0e6 * chisq / np);
     }
 
     if(error_msg) {
@@ -82,7 +98,11 @@ lmfit_multi(struct multi_fit_engine *fit,
         str_printf_add(analysis, "Nb of iterations to converge: %i\n", iter);
     }
 
-    gsl_multifit_fdfsolver_free(s);
+    if(sn) {
+        lmfit_multi_normal_free(sn);
+    } else {
+        gsl_multifit_fdfsolver_free(s);
+    }
 
     if(stop_request) {
         status = 1;
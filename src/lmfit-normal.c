@@ -0,0 +1,239 @@
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+#include "common.h"
+#include "lmfit-normal.h"
+
+#include <gsl/gsl_blas.h>
+#include <gsl/gsl_multifit_nlin.h>
+
+/* Number of consecutive rejected steps after which the search stops. */
+#define LMFIT_NORMAL_MAX_REJECT 15
+
+struct lmfit_normal *
+lmfit_normal_alloc(size_t p)
+{
+    struct lmfit_normal *s = emalloc(sizeof(struct lmfit_normal));
+
+    s->p = p;
+    s->x = gsl_vector_alloc(p);
+    s->dx = gsl_vector_alloc(p);
+    s->x_trial = gsl_vector_alloc(p);
+    s->jtj = gsl_matrix_alloc(p, p);
+    s->jtj_trial = gsl_matrix_alloc(p, p);
+    s->jtr = gsl_vector_alloc(p);
+    s->jtr_trial = gsl_vector_alloc(p);
+    s->diag = gsl_vector_alloc(p);
+    s->chol = gsl_matrix_alloc(p, p);
+
+    return s;
+}
+
+void
+lmfit_normal_free(struct lmfit_normal *s)
+{
+    gsl_vector_free(s->x);
+    gsl_vector_free(s->dx);
+    gsl_vector_free(s->x_trial);
+    gsl_matrix_free(s->jtj);
+    gsl_matrix_free(s->jtj_trial);
+    gsl_vector_free(s->jtr);
+    gsl_vector_free(s->jtr_trial);
+    gsl_vector_free(s->diag);
+    gsl_matrix_free(s->chol);
+    free(s);
+}
+
+/* The scaling of each parameter is the largest norm of the corresponding
+   column of the jacobian seen so far, like in the MINPACK algorithm. A
+   zero column, like the one of a parameter eliminated by variable
+   projection, gets a unit scaling. */
+static void
+update_diag(struct lmfit_normal *s)
+{
+    size_t i;
+
+    for(i = 0; i < s->p; i++) {
+        double d = sqrt(gsl_matrix_get(s->jtj, i, i));
+        if(d > gsl_vector_get(s->diag, i)) {
+            gsl_vector_set(s->diag, i, d);
+        } else if(gsl_vector_get(s->diag, i) == 0.0) {
+            gsl_vector_set(s->diag, i, 1.0);
+        }
+    }
+}
+
+/* Cholesky factorization of the lower triangle of the damped normal
+   matrix. Return non zero if the matrix is not positive definite. */
+static int
+damped_cholesky(struct lmfit_normal *s)
+{
+    const size_t p = s->p;
+    size_t i, j, k;
+
+    for(j = 0; j < p; j++) {
+        const double d = gsl_vector_get(s->diag, j);
+        double a = gsl_matrix_get(s->jtj, j, j) + s->mu * d * d;
+
+        for(k = 0; k < j; k++) {
+            const double l = gsl_matrix_get(s->chol, j, k);
+            a -= l * l;
+        }
+        if(!(a > 0.0)) {
+            return 1;
+        }
+        a = sqrt(a);
+        gsl_matrix_set(s->chol, j, j, a);
+
+        for(i = j + 1; i < p; i++) {
+            double b = gsl_matrix_get(s->jtj, i, j);
+            for(k = 0; k < j; k++) {
+                b -= gsl_matrix_get(s->chol, i, k) * gsl_matrix_get(s->chol, j, k);
+            }
+            gsl_matrix_set(s->chol, i, j, b / a);
+        }
+    }
+
+    return 0;
+}
+
+/* Solve (J^T J + mu D^2) dx = - J^T f using the Cholesky factor. */
+static void
+damped_solve(struct lmfit_normal *s)
+{
+    const size_t p = s->p;
+    size_t i, k;
+
+    for(i = 0; i < p; i++) {
+        double b = - gsl_vector_get(s->jtr, i);
+        for(k = 0; k < i; k++) {
+            b -= gsl_matrix_get(s->chol, i, k) * gsl_vector_get(s->dx, k);
+        }
+        gsl_vector_set(s->dx, i, b / gsl_matrix_get(s->chol, i, i));
+    }
+
+    for(i = p; i-- > 0; ) {
+        double b = gsl_vector_get(s->dx, i);
+        for(k = i + 1; k < p; k++) {
+            b -= gsl_matrix_get(s->chol, k, i) * gsl_vector_get(s->dx, k);
+        }
+        gsl_vector_set(s->dx, i, b / gsl_matrix_get(s->chol, i, i));
+    }
+}
+
+static void
+lmfit_normal_set(struct lmfit_normal *s, struct fit_engine *fit,
+                 const gsl_vector *x)
+{
+    gsl_vector_memcpy(s->x, x);
+    fit->run->normal(s->x, fit, s->jtj, s->jtr, &s->sumsq);
+
+    gsl_vector_set_zero(s->diag);
+    update_diag(s);
+
+    s->mu = 1.0E-3;
+    s->nu = 2.0;
+}
+
+/* Take a step that reduces the sum of squares. The damping factor is
+   adapted following the gain ratio as proposed by Nielsen. */
+static int
+lmfit_normal_iterate(struct lmfit_normal *s, struct fit_engine *fit)
+{
+    int nb_reject = 0;
+    size_t i;
+
+    while(nb_reject < LMFIT_NORMAL_MAX_REJECT) {
+        double dx_g, dx_d2, pred, rho;
+
+        if(damped_cholesky(s)) {
+            s->mu *= s->nu;
+            s->nu *= 2;
+            nb_reject++;
+            continue;
+        }
+
+        damped_solve(s);
+
+        gsl_vector_memcpy(s->x_trial, s->x);
+        gsl_vector_add(s->x_trial, s->dx);
+
+        fit->run->normal(s->x_trial, fit, s->jtj_trial, s->jtr_trial, &s->sumsq_trial);
+
+        /* Reduction of the sum of squares predicted by the linear model. */
+        gsl_blas_ddot(s->dx, s->jtr, &dx_g);
+        for(dx_d2 = 0.0, i = 0; i < s->p; i++) {
+            const double d = gsl_vector_get(s->diag, i) * gsl_vector_get(s->dx, i);
+            dx_d2 += d * d;
+        }
+        pred = - dx_g + s->mu * dx_d2;
+        rho = (s->sumsq - s->sumsq_trial) / pred;
+
+        if(pred > 0.0 && rho > 0.0) {
+            const double t = 2 * rho - 1;
+            gsl_matrix *jtj = s->jtj;
+            gsl_vector *jtr = s->jtr, *x = s->x;
+
+            s->jtj = s->jtj_trial;
+            s->jtj_trial = jtj;
+            s->jtr = s->jtr_trial;
+            s->jtr_trial = jtr;
+            s->x = s->x_trial;
+            s->x_trial = x;
+            s->sumsq = s->sumsq_trial;
+
+            update_diag(s);
+
+            s->mu *= (1 - t * t * t > 1.0 / 3.0 ? 1 - t * t * t : 1.0 / 3.0);
+            s->nu = 2.0;
+            return GSL_SUCCESS;
+        }
+
+        s->mu *= s->nu;
+        s->nu *= 2;
+        nb_reject++;
+    }
+
+    return GSL_ENOPROG;
+}
+
+int
+lmfit_normal_iter(gsl_vector *x, struct fit_engine *fit,
+                  struct lmfit_normal *s, const int max_iter,
+                  double epsabs, double epsrel, int *nb_iter,
+                  gui_hook_func_t hfun, void *hdata, int *user_stop)
+{
+    int iter = 0, status;
+    int stop_request = 0;
+
+    lmfit_normal_set(s, fit, x);
+
+    if(hfun) {
+        stop_request = (*hfun)(hdata, 0.0, "Running Levenberg-Marquardt search...");
+    }
+
+    do {
+        if(hfun) {
+            stop_request = (*hfun)(hdata, iter / (float)max_iter, NULL);
+        }
+
+        iter++;
+        status = lmfit_normal_iterate(s, fit);
+
+        if(status) {
+            break;
+        }
+
+        status = gsl_multifit_test_delta(s->dx, s->x, epsabs, epsrel);
+    } while(status == GSL_CONTINUE && iter < max_iter && !stop_request);
+
+    gsl_vector_memcpy(x, s->x);
+
+    *nb_iter = iter;
+    if(user_stop) {
+        *user_stop = stop_request;
+    }
+
+    return status;
+}
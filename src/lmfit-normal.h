@@ -0,0 +1,45 @@
+#ifndef LMFIT_NORMAL_H
+#define LMFIT_NORMAL_H
+
+#include <gsl/gsl_vector.h>
+#include <gsl/gsl_matrix.h>
+
+#include "lmfit.h"
+#include "fit-engine.h"
+
+__BEGIN_DECLS
+
+/* Levenberg-Marquardt solver working on the normal equations of the
+   fit engine. The jacobian is never stored so the memory used depends
+   only on the number of parameters. */
+struct lmfit_normal {
+    size_t p;
+
+    gsl_vector *x, *dx, *x_trial;
+    /* Normal equations and sum of squares at x and at the trial point. */
+    gsl_matrix *jtj, *jtj_trial;
+    gsl_vector *jtr, *jtr_trial;
+    double sumsq, sumsq_trial;
+
+    /* Scaling of the parameters and damping factor. */
+    gsl_vector *diag;
+    double mu, nu;
+
+    /* Cholesky factor of the damped system. */
+    gsl_matrix *chol;
+};
+
+extern struct lmfit_normal *lmfit_normal_alloc(size_t p);
+extern void lmfit_normal_free(struct lmfit_normal *s);
+
+/* Same as lmfit_iter but using the normal equations. On return
+   s->sumsq is the sum of squares of the residuals at x. */
+extern int  lmfit_normal_iter(gsl_vector *x, struct fit_engine *fit,
+                              struct lmfit_normal *s, const int max_iter,
+                              double epsabs, double epsrel, int *nb_iter,
+                              gui_hook_func_t hfun, void *hdata,
+                              int *user_stop);
+
+__END_DECLS
+
+#endif
@@ -4,6 +4,7 @@
 #include <gsl/gsl_blas.h>
 
 #include "lmfit.h"
+#include "lmfit-normal.h"
 #include "lmfit-simple.h"
 #include "stack.h"
 #include "vector_print.h"
@@ -14,7 +15,8 @@ lmfit_simple(struct fit_engine *fit, gsl_vector *x,
              gui_hook_func_t hfun, void *hdata)
 {
     const gsl_multifit_fdfsolver_type *T;
-    gsl_multifit_fdfsolver *s;
+    gsl_multifit_fdfsolver *s = NULL;
+    struct lmfit_normal *sn = NULL;
     gsl_multifit_function_fdf *f;
     struct fit_config *cfg = fit->config;
     int iter;
@@ -26,19 +28,27 @@ lmfit_simple(struct fit_engine *fit, gsl_vector *x,
 
     f = &fit->run->mffun;
 
-    /* We choose Levenberg-Marquardt algorithm, scaled version*/
-    T = gsl_multifit_fdfsolver_lmsder;
-    s = gsl_multifit_fdfsolver_alloc(T, f->n, f->p);
-
     if(analysis) {
         str_copy_c(analysis, "Seed used: ");
         print_vector(analysis, "%.5g", x);
     }
 
-    status = lmfit_iter(x, f, s, cfg->nb_max_iters, cfg->epsabs, cfg->epsrel,
-                        & iter, hfun, hdata, & stop_request);
+    if(cfg->lm_normal) {
+        sn = lmfit_normal_alloc(f->p);
+        status = lmfit_normal_iter(x, fit, sn, cfg->nb_max_iters,
+                                   cfg->epsabs, cfg->epsrel,
+                                   & iter, hfun, hdata, & stop_request);
+        chi = sqrt(sn->sumsq);
+    } else {
+        /* We choose Levenberg-Marquardt algorithm, scaled version*/
+        T = gsl_multifit_fdfsolver_lmsder;
+        s = gsl_multifit_fdfsolver_alloc(T, f->n, f->p);
+
+        status = lmfit_iter(x, f, s, cfg->nb_max_iters, cfg->epsabs, cfg->epsrel,
+                            & iter, hfun, hdata, & stop_request);
+        chi = gsl_blas_dnrm2(s->f);
+    }
 
-    chi = gsl_blas_dnrm2(s->f);
     result->chisq = 1.0E6 * pow(chi, 2.0) / f->n;
     result->nb_iterations = iter;
     result->gsl_status = status;
@@ -70,12 +80,18 @@ lmfit_simple(struct fit_engine *fit, gsl_vector *x,
         }
     }
 
+    fit_engine_update_projected(fit, x);
+
     /* we take care to commit the results obtained from the fit */
     fit_engine_commit_parameters(fit, x);
 
     gsl_vector_memcpy(fit->run->results, x);
 
-    gsl_multifit_fdfsolver_free(s);
+    if(sn) {
+        lmfit_normal_free(sn);
+    } else {
+        gsl_multifit_fdfsolver_free(s);
+    }
 
     return status;
 }
@@ -8,6 +8,7 @@
 #include "elliss-multifit.h"
 #include "refl-multifit.h"
 #include "multi-fit-engine.h"
+#include "worker-pool.h"
 
 static int  mengine_apply_param_common(struct multi_fit_engine *fit,
                                        const fit_param_t *fp,
@@ -28,25 +29,40 @@ build_multi_fit_engine_cache(struct multi_fit_engine *f)
     int nbmed = f->stack_list[0]->nb;
     int nblyr = nbmed - 2;
     size_t dmultipl = (f->system_kind == SYSTEM_REFLECTOMETER ? 1 : 2);
+    int k;
 
-    /* We have just one cache for the fit engine.
-       A cache for each sample is not needed because we assume that
-       the RI are not fixed and so we don't do presampling of n values */
-    build_stack_cache(& f->cache, f->stack_list[0],
-                      f->spectra_list[0], RI_IS_VARIABLE);
-
-    f->jac_th = gsl_vector_alloc(dmultipl * nblyr);
+    /* The RI are assumed not fixed so no presampling of n values is
+       done and the caches only provide the buffers of each sample. */
+    f->samples = emalloc(f->samples_number * sizeof(struct multi_fit_sample));
+
+    for(k = 0; k < f->samples_number; k++) {
+        struct multi_fit_sample *fs = f->samples + k;
+
+        build_stack_cache(& fs->cache, f->stack_list[k],
+                          f->spectra_list[k], RI_IS_VARIABLE);
+
+        fs->jac_th = gsl_vector_alloc(dmultipl * nblyr);
+        fs->refl_ws = NULL;
+        fs->elliss_ws = NULL;
+
+        switch(f->system_kind) {
+        case SYSTEM_REFLECTOMETER:
+            fs->jac_n.refl = gsl_vector_alloc(2 * nbmed);
+            fs->refl_ws = refl_workspace_alloc(nbmed);
+            break;
+        case SYSTEM_ELLISS_AB:
+        case SYSTEM_ELLISS_PSIDEL:
+            fs->jac_n.ell = cmpl_vector_alloc(2 * nbmed);
+            fs->elliss_ws = elliss_workspace_alloc(nbmed);
+        default:
+            /* */
+            ;
+        }
+    }
 
-    switch(f->system_kind) {
-    case SYSTEM_REFLECTOMETER:
-        f->jac_n.refl = gsl_vector_alloc(2 * nbmed);
-        break;
-    case SYSTEM_ELLISS_AB:
-    case SYSTEM_ELLISS_PSIDEL:
-        f->jac_n.ell = cmpl_vector_alloc(2 * nbmed);
-    default:
-        /* */
-        ;
+    f->pool = NULL;
+    if(f->config.nb_threads > 1) {
+        f->pool = worker_pool_new(f->config.nb_threads);
     }
 }
 
@@ -84,6 +100,7 @@ multi_fit_engine_prepare(struct multi_fit_engine *fit)
             npt += spectra_points(fit->spectra_list[k]);
         }
 
+        fit->sample_fdf   = & refl_multifit_sample_fdf;
         fit->mffun.f      = & refl_multifit_f;
         fit->mffun.df     = & refl_multifit_df;
         fit->mffun.fdf    = & refl_multifit_fdf;
@@ -97,6 +114,7 @@ multi_fit_engine_prepare(struct multi_fit_engine *fit)
             npt += 2 * spectra_points(fit->spectra_list[k]);
         }
 
+        fit->sample_fdf   = & elliss_multifit_sample_fdf;
         fit->mffun.f      = & elliss_multifit_f;
         fit->mffun.df     = & elliss_multifit_df;
         fit->mffun.fdf    = & elliss_multifit_fdf;
@@ -125,25 +143,37 @@ multi_fit_engine_prepare(struct multi_fit_engine *fit)
 void
 dispose_multi_fit_engine_cache(struct multi_fit_engine *f)
 {
-    gsl_vector_free(f->jac_th);
+    int k;
 
-    switch(f->system_kind) {
-    case SYSTEM_REFLECTOMETER:
-        gsl_vector_free(f->jac_n.refl);
-        f->jac_n.refl = NULL;
-        break;
-    case SYSTEM_ELLISS_AB:
-    case SYSTEM_ELLISS_PSIDEL:
-        cmpl_vector_free(f->jac_n.ell);
-        f->jac_n.ell = NULL;
-    default:
-        /* */
-        ;
+    for(k = 0; k < f->samples_number; k++) {
+        struct multi_fit_sample *fs = f->samples + k;
+
+        gsl_vector_free(fs->jac_th);
+
+        switch(f->system_kind) {
+        case SYSTEM_REFLECTOMETER:
+            gsl_vector_free(fs->jac_n.refl);
+            refl_workspace_free(fs->refl_ws);
+            break;
+        case SYSTEM_ELLISS_AB:
+        case SYSTEM_ELLISS_PSIDEL:
+            cmpl_vector_free(fs->jac_n.ell);
+            elliss_workspace_free(fs->elliss_ws);
+        default:
+            /* */
+            ;
+        }
+
+        dispose_stack_cache(& fs->cache);
     }
 
-    f->jac_th = NULL;
+    free(f->samples);
+    f->samples = NULL;
 
-    dispose_stack_cache(& f->cache);
+    if(f->pool) {
+        worker_pool_free(f->pool);
+        f->pool = NULL;
+    }
 }
 
 void
@@ -265,6 +295,8 @@ multi_fit_engine_new(struct fit_config const *cfg, int samples_number) {
     f->private_parameters = NULL;
 
     f->results = NULL;
+    f->samples = NULL;
+    f->pool = NULL;
 
     f->initialized = 0;
 
@@ -358,6 +390,80 @@ multi_fit_engine_print_fit_results(struct multi_fit_engine *fit,
     str_free(pname);
 }
 
+struct multi_fit_job {
+    struct multi_fit_engine *fit;
+    gsl_vector *f;
+    gsl_matrix *jacob;
+};
+
+static void
+multi_fit_sample_task(void *data, int sample, int thread)
+{
+    struct multi_fit_job *job = data;
+    struct multi_fit_engine *fit = job->fit;
+    const size_t nb_comm_params = fit->common_parameters->number;
+    const size_t nb_priv_params = fit->private_parameters->number;
+    const size_t nr = multi_fit_engine_sample_rows(fit, sample);
+    size_t j_sample = 0;
+    gsl_vector_view fv;
+    gsl_matrix_view jv;
+    int k;
+
+    for(k = 0; k < sample; k++) {
+        j_sample += multi_fit_engine_sample_rows(fit, k);
+    }
+
+    if(job->f) {
+        fv = gsl_vector_subvector(job->f, j_sample, nr);
+    }
+    if(job->jacob) {
+        jv = gsl_matrix_submatrix(job->jacob, j_sample, 0, nr, job->jacob->size2);
+    }
+
+    fit->sample_fdf(fit, sample,
+                    job->f ? &fv.vector : NULL,
+                    job->jacob ? &jv.matrix : NULL,
+                    nb_comm_params + nb_priv_params * sample);
+}
+
+int
+multi_fit_engine_fdf(struct multi_fit_engine *fit, const gsl_vector *x,
+                     gsl_vector *f, gsl_matrix *jacob)
+{
+    struct multi_fit_job job[1] = {{fit, f, jacob}};
+    int k;
+
+    /* STEP 1 : We apply the actual values of the fit parameters
+                to the stack. */
+
+    multi_fit_engine_commit_parameters(fit, x);
+
+    /* The columns of the private parameters of the other samples are
+       not written by the sample functions. */
+    if(jacob) {
+        gsl_matrix_set_zero(jacob);
+    }
+
+    /* STEP 2 : The samples are evaluated, each one in its own rows. */
+
+    if(fit->pool) {
+        worker_pool_run(fit->pool, multi_fit_sample_task, job, fit->samples_number);
+    } else {
+        for(k = 0; k < fit->samples_number; k++) {
+            multi_fit_sample_task(job, k, 0);
+        }
+    }
+
+    return GSL_SUCCESS;
+}
+
+size_t
+multi_fit_engine_sample_rows(const struct multi_fit_engine *fit, int sample)
+{
+    const size_t npt = spectra_points(fit->spectra_list[sample]);
+    return (fit->system_kind == SYSTEM_REFLECTOMETER ? npt : 2 * npt);
+}
+
 double
 multi_fit_engine_get_parameter_value(const struct multi_fit_engine *fit, const fit_param_t *fp)
 {
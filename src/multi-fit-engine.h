@@ -13,6 +13,30 @@
 
 __BEGIN_DECLS
 
+struct multi_fit_engine;
+struct worker_pool;
+
+/* Evaluate the residuals and the jacobian of a single sample, see
+   refl_multifit_sample_fdf. */
+typedef int (*multi_fit_sample_func_t)(struct multi_fit_engine *fit, int sample,
+                                       gsl_vector *f, gsl_matrix *jacob,
+                                       size_t priv_col);
+
+/* Cache and jacobian scratch of a sample. Each sample has its own so
+   that the samples can be evaluated concurrently. */
+struct multi_fit_sample {
+    struct stack_cache cache;
+
+    gsl_vector *jac_th;
+    union {
+        gsl_vector *refl;
+        cmpl_vector *ell;
+    } jac_n;
+
+    struct refl_workspace *refl_ws;
+    struct elliss_workspace *elliss_ws;
+};
+
 struct multi_fit_engine {
     enum system_kind system_kind;
 
@@ -29,17 +53,15 @@ struct multi_fit_engine {
     int initialized;
 
     gsl_multifit_function_fdf mffun;
+    multi_fit_sample_func_t sample_fdf;
+
+    /* Pool of threads, NULL if the fit runs in a single thread. */
+    struct worker_pool *pool;
 
     gsl_vector *results;
     gsl_vector *chisq;
 
-    struct stack_cache cache;
-
-    gsl_vector *jac_th;
-    union {
-        gsl_vector *refl;
-        cmpl_vector *ell;
-    } jac_n;
+    struct multi_fit_sample *samples;
 };
 
 extern struct multi_fit_engine * \
@@ -61,6 +83,16 @@ extern int  multi_fit_engine_commit_parameters(struct multi_fit_engine *fit,
 extern void multi_fit_engine_print_fit_results(struct multi_fit_engine *fit,
         str_t text);
 
+/* Evaluate the residuals and the jacobian of all the samples, in
+   parallel if the engine has a pool of threads. Each sample writes its
+   own rows. */
+extern int multi_fit_engine_fdf(struct multi_fit_engine *fit, const gsl_vector *x,
+                                gsl_vector *f, gsl_matrix *jacob);
+
+/* Number of residuals of the given sample. */
+extern size_t multi_fit_engine_sample_rows(const struct multi_fit_engine *fit,
+        int sample);
+
 extern double multi_fit_engine_get_parameter_value(const struct multi_fit_engine *fit, const fit_param_t *fp);
 extern double multi_fit_engine_get_seed_value(const struct multi_fit_engine *fit, const fit_param_t *fp, const seed_t *s);
 
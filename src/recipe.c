@@ -0,0 +1,156 @@
+#include <stdlib.h>
+
+#include "recipe.h"
+#include "fit-engine.h"
+#include "grid-search.h"
+#include "str-util.h"
+#include "error-messages.h"
+
+struct recipe *
+recipe_read(lexer_t *l)
+{
+    struct recipe *r;
+    stack_t *stack = stack_read(l);
+
+    if(!stack) {
+        return NULL;
+    }
+
+    r = emalloc(sizeof(struct recipe));
+    r->stack = stack;
+    r->parameters = NULL;
+    r->seeds = NULL;
+
+    if(fit_config_read(l, r->config)) goto read_fail;
+    r->parameters = fit_parameters_read(l);
+    if(!r->parameters) goto read_fail;
+    r->seeds = seed_list_read(l);
+    if(!r->seeds) goto read_fail;
+
+    return r;
+read_fail:
+    recipe_free(r);
+    return NULL;
+}
+
+struct recipe *
+recipe_load(const char *filename, str_ptr *error_msg)
+{
+    struct recipe *r;
+    lexer_t *l;
+    str_t content;
+
+    str_init(content, 1024);
+    if(str_loadfile(filename, content) != 0) {
+        *error_msg = new_error_message(LOADING_FILE_ERROR, "Cannot open recipe file \"%s\"", filename);
+        str_free(content);
+        return NULL;
+    }
+
+    l = lexer_new(CSTR(content));
+    r = recipe_read(l);
+    lexer_free(l);
+    str_free(content);
+
+    if(!r) {
+        *error_msg = new_error_message(LOADING_FILE_ERROR, "Invalid recipe file \"%s\"", filename);
+    }
+
+    return r;
+}
+
+void
+recipe_free(struct recipe *r)
+{
+    if(r->seeds) {
+        seed_list_free(r->seeds);
+    }
+    if(r->parameters) {
+        fit_parameters_free(r->parameters);
+    }
+    stack_free(r->stack);
+    free(r);
+}
+
+int
+recipe_write(writer_t *w, const struct recipe *r)
+{
+    stack_write(w, r->stack);
+    fit_config_write(w, r->config);
+    fit_parameters_write(w, r->parameters);
+    seed_list_write(w, r->seeds);
+    return 0;
+}
+
+void
+recipe_digest(const struct recipe *r, str_t digest)
+{
+    writer_t *w = writer_new();
+    unsigned long long h = 14695981039346656037ULL;
+    const char *p;
+
+    /* The FNV-1a hash of the recipe in text form, independent of the
+       formatting of the file it was read from. */
+    recipe_write(w, r);
+    for(p = CSTR(w->text); *p; p++) {
+        h = (h ^ (unsigned char) *p) * 1099511628211ULL;
+    }
+    writer_free(w);
+
+    str_printf(digest, "%016llx", h);
+}
+
+struct compiled_recipe *
+recipe_compile(const stack_t *stack, const struct fit_config *config,
+               struct fit_parameters *parameters, struct seeds *seeds)
+{
+    struct compiled_recipe *cr = emalloc(sizeof(struct compiled_recipe));
+    size_t j;
+
+    cr->fit = fit_engine_new();
+    fit_engine_bind(cr->fit, stack, config, parameters);
+    cr->seeds = seeds;
+
+    cr->x0 = gsl_vector_alloc(parameters->number);
+    for(j = 0; j < parameters->number; j++) {
+        const fit_param_t *fp = parameters->values + j;
+        gsl_vector_set(cr->x0, j, fit_engine_get_parameter_value(cr->fit, fp));
+    }
+
+    return cr;
+}
+
+int
+compiled_recipe_fit(struct compiled_recipe *cr, struct spectrum *s,
+                    int *status, double *chisq, gui_hook_func_t hfun,
+                    void *hdata, str_ptr *error_msg)
+{
+    struct fit_engine *fit = cr->fit;
+
+    if(fit_engine_rebind(fit, s) != 0) {
+        fit_engine_disable(fit);
+        *error_msg = new_error_message(FIT_ERROR, "Unsupported kind of spectrum");
+        return 1;
+    }
+
+    *status = lmfit_grid(fit, cr->seeds, chisq, NULL, NULL, 0, hfun, hdata);
+
+    /* The stack is not copied to be restored, instead the fitted
+       parameters are set back to their initial values. In this way
+       only the mediums whose dispersion was fitted are computed again
+       for the next spectrum. */
+    fit_engine_commit_parameters(fit, cr->x0);
+
+    return 0;
+}
+
+void
+compiled_recipe_free(struct compiled_recipe *cr)
+{
+    if(cr->fit->run->spectr) {
+        fit_engine_disable(cr->fit);
+    }
+    fit_engine_free(cr->fit);
+    gsl_vector_free(cr->x0);
+    free(cr);
+}
@@ -0,0 +1,71 @@
+#ifndef RECIPE_H
+#define RECIPE_H
+
+#include "defs.h"
+#include "stack.h"
+#include "fit-params.h"
+#include "fit-engine-common.h"
+#include "lexer.h"
+#include "lmfit.h"
+#include "spectra.h"
+#include "str.h"
+#include "writer.h"
+
+#include <gsl/gsl_vector.h>
+
+__BEGIN_DECLS
+
+/* Fit recipe as stored in the .rcp files: the film stack, the fit
+   configuration, the fit parameters and their seeds. The multi-sample
+   section that may follow is not read. */
+struct recipe {
+    stack_t *stack;
+    struct fit_config config[1];
+    struct fit_parameters *parameters;
+    struct seeds *seeds;
+};
+
+extern struct recipe * recipe_read(lexer_t *l);
+extern struct recipe * recipe_load(const char *filename, str_ptr *error_msg);
+extern void            recipe_free(struct recipe *r);
+extern int             recipe_write(writer_t *w, const struct recipe *r);
+
+/* Compute in "digest" a hexadecimal hash of the recipe. Two recipes
+   with the same stack, config, fit parameters and seeds have the same
+   digest. */
+extern void            recipe_digest(const struct recipe *r, str_t digest);
+
+struct fit_engine;
+
+/* A recipe ready to fit a sequence of spectra. It owns a fit engine,
+   with its copy of the stack, that is kept prepared from a spectrum to
+   the next so that the caches and the buffers of the run are built
+   again only when the wavelengths change. */
+struct compiled_recipe {
+    struct fit_engine *fit;
+    struct seeds *seeds;
+
+    /* Values of the fit parameters in the recipe, restored after each
+       spectrum. */
+    gsl_vector *x0;
+};
+
+/* The fit parameters and the seeds are not copied and should remain
+   valid until the compiled recipe is freed. */
+extern struct compiled_recipe * recipe_compile(const stack_t *stack,
+        const struct fit_config *config, struct fit_parameters *parameters,
+        struct seeds *seeds);
+
+/* Fit the spectrum. Return 0 with the status of the fit in "status",
+   the chi square in "chisq" and the fitted parameters in the "results"
+   of the fit run, or 1 if the spectrum cannot be fitted. */
+extern int  compiled_recipe_fit(struct compiled_recipe *cr,
+                                struct spectrum *s, int *status,
+                                double *chisq, gui_hook_func_t hfun,
+                                void *hdata, str_ptr *error_msg);
+
+extern void compiled_recipe_free(struct compiled_recipe *cr);
+
+__END_DECLS
+
+#endif
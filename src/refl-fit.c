@@ -10,8 +10,10 @@
 
 #include "refl-fit.h"
 #include "refl-kernel.h"
+#include "kernel-f32.h"
 #include "fit-engine.h"
 #include "refl-get-jacobian.h"
+#include "worker-pool.h"
 
 double
 get_parameter_jacob_r(fit_param_t const *fp, stack_t const *stack,
@@ -53,82 +55,476 @@ get_parameter_jacob_r(fit_param_t const *fp, stack_t const *stack,
     return result;
 }
 
-int
-refl_fit_fdf(const gsl_vector *x, void *params,
-             gsl_vector *f, gsl_matrix * jacob)
+/* Compute only the residuals using the batched kernel for the points
+   j0 .. j1 - 1. It requires the Fresnel coefficients and phase rates to be
+   precomputed for the whole spectrum. */
+static void
+refl_fit_f_batch(struct fit_engine *fit, double const *ths, size_t j0, size_t j1,
+                 gsl_vector *f, size_t row0)
 {
-    struct fit_engine *fit = params;
     struct spectrum *s = fit->run->spectr;
-    size_t nb_med = fit->stack->nb;
-    gsl_vector *r_th_jacob, *r_n_jacob;
-    double const * ths;
-    cmpl * ns;
-    size_t j;
+    const struct stack_cache *cache = &fit->run->cache;
+    const size_t nb_med = fit->stack->nb;
+    const double rmult = fit->extra->rmult;
+    double r_raw[REFL_BATCH_SIZE];
+    size_t j, k;
 
-    /* STEP 1 : We apply the actual values of the fit parameters
-                to the stack. */
+    for(j = j0; j < j1; j += REFL_BATCH_SIZE) {
+        const size_t nblock = (j1 - j < REFL_BATCH_SIZE ? j1 - j : REFL_BATCH_SIZE);
+        const cmpl *rc = cache->rc_full_spectr + j * cache->rc_stride;
+        const cmpl *beta = cache->beta_full_spectr + j * (nb_med - 2);
 
-    fit_engine_commit_parameters(fit, x);
+        mult_layer_refl_ni_batch(nb_med, nblock, rc, beta, ths, r_raw);
+
+        for(k = 0; k < nblock; k++) {
+            float const * spectr_data = spectra_get_values(s, j + k);
+            gsl_vector_set(f, j + k - row0, rmult * r_raw[k] - spectr_data[1]);
+        }
+    }
+}
 
-    /* STEP 2 : From the stack we retrive the thicknesses and RIs
-                informations. */
+/* Buffers used to evaluate a range of points. They belong either to the
+   fit run or to one of its workers. */
+struct refl_eval_state {
+    stack_t *stack;
+    struct stack_cache *cache;
+    gsl_vector *jac_th;
+    gsl_vector *jac_n;
+    struct refl_workspace *ws;
+    /* Index of the point stored in the first row of f and jacob. */
+    size_t row0;
+};
+
+static void
+refl_eval_state_init(struct fit_engine *fit, int thread,
+                     struct refl_eval_state *st)
+{
+    if(thread == 0) {
+        st->stack  = fit->stack;
+        st->cache  = &fit->run->cache;
+        st->jac_th = fit->run->jac_th;
+        st->jac_n  = fit->run->jac_n.refl;
+        st->ws     = fit->run->refl_ws;
+    } else {
+        struct fit_worker *w = fit->run->workers + (thread - 1);
+        st->stack  = w->stack;
+        st->cache  = &w->cache;
+        st->jac_th = w->jac_th;
+        st->jac_n  = w->jac_n.refl;
+        st->ws     = w->refl_ws;
+    }
+    st->row0 = 0;
+}
+
+static void
+refl_fit_fdf_range(struct fit_engine *fit, struct refl_eval_state *st,
+                   size_t j0, size_t j1, gsl_vector *f, gsl_matrix *jacob)
+{
+    struct spectrum *s = fit->run->spectr;
+    size_t nb_med = fit->stack->nb;
+    double const * ths = stack_get_ths_list(st->stack);
+    gsl_vector *r_th_jacob = (jacob ? st->jac_th : NULL);
+    gsl_vector *r_n_jacob  = (jacob ? st->jac_n : NULL);
+    const struct stack_cache *tables = &fit->run->cache;
+    const struct refl_ni_kernels *kernels = &fit->run->refl_kernels;
+    const int use_tables = (st->cache->th_only && tables->rc_full_spectr &&
+                            !REPEAT_BLOCK_IS_ACTIVE(&st->stack->repeat));
+    cmpl * ns;
+    size_t j;
 
-    ths = stack_get_ths_list(fit->stack);
+    if(jacob == NULL && use_tables) {
+        refl_fit_f_batch(fit, ths, j0, j1, f, st->row0);
+        return;
+    }
 
-    r_th_jacob = (jacob ? fit->run->jac_th : NULL);
-    r_n_jacob  = (jacob ? fit->run->jac_n.refl : NULL);
+    fit_engine_update_media(fit, st->stack, j0, j1, jacob != NULL);
 
-    for(j = 0; j < spectra_points(s); j++) {
+    for(j = j0; j < j1; j++) {
         float const * spectr_data = spectra_get_values(s, j);
         const double lambda = spectr_data[0];
         const double r_meas = spectr_data[1];
         double r_raw, r_theory;
         double rmult = fit->extra->rmult;
 
-        if(fit->run->cache.th_only) {
-            ns = fit->run->cache.ns_full_spectr + j * nb_med;
-        } else {
-            ns = fit->run->cache.ns;
-            stack_get_ns_list(fit->stack, ns, lambda);
-        }
-
         /* STEP 3 : We call the procedure mult_layer_refl_ni */
 
-        r_raw = mult_layer_refl_ni(nb_med, ns, ths, lambda,
-                                   r_th_jacob, r_n_jacob);
+        if(use_tables) {
+            /* The RIs are fixed so the derivatives respect to them are
+               not needed. */
+            r_raw = kernels->precomp(nb_med,
+                                     tables->rc_full_spectr + j * tables->rc_stride,
+                                     tables->beta_full_spectr + j * (nb_med - 2),
+                                     ths, r_th_jacob, st->ws);
+        } else {
+            ns = fit->run->cache.ns_full_spectr + j * nb_med;
+            r_raw = kernels->refl(nb_med, ns, ths, &st->stack->repeat,
+                                  lambda, r_th_jacob, r_n_jacob, st->ws);
+        }
 
         r_theory = rmult * r_raw;
 
         if(f != NULL) {
-            gsl_vector_set(f, j, r_theory - r_meas);
+            gsl_vector_set(f, j - st->row0, r_theory - r_meas);
         }
 
         if(jacob) {
-            size_t kp, ic;
-            struct deriv_info * ideriv = fit->run->cache.deriv_info;
+            size_t kp;
+            struct deriv_info * ideriv = st->cache->deriv_info;
 
-            if(! fit->run->cache.th_only) {
-                for(ic = 0; ic < nb_med; ic++) {
-                    ideriv[ic].is_valid = 0;
-                }
+            if(! st->cache->th_only) {
+                fit_engine_load_media_deriv(fit, j, ideriv);
             }
 
             for(kp = 0; kp < fit->parameters->number; kp++) {
                 const fit_param_t *fp = fit->parameters->values + kp;
                 double pjac;
 
-                pjac = get_parameter_jacob_r(fp, fit->stack, ideriv, lambda,
+                pjac = get_parameter_jacob_r(fp, st->stack, ideriv, lambda,
                                              r_th_jacob, r_n_jacob,
                                              rmult, r_raw);
 
-                gsl_matrix_set(jacob, j, kp, pjac);
+                gsl_matrix_set(jacob, j - st->row0, kp, pjac);
+            }
+        }
+    }
+}
+
+/* Compute only the residuals using the single precision kernels. */
+static void
+refl_fit_f32_range(struct fit_engine *fit, struct refl_eval_state *st,
+                   size_t j0, size_t j1, gsl_vector *f)
+{
+#define NB_F32_STATIC 16
+    struct spectrum *s = fit->run->spectr;
+    const struct stack_cache *tables = &fit->run->cache;
+    const int nb_med = fit->stack->nb;
+    double const * ths = stack_get_ths_list(st->stack);
+    const double rmult = fit->extra->rmult;
+    float ds_static[NB_F32_STATIC], *ds = ds_static;
+    cmplf ns_static[NB_F32_STATIC], *ns = ns_static;
+    size_t j;
+    int k;
+
+    if(REPEAT_BLOCK_IS_ACTIVE(&st->stack->repeat)) {
+        refl_fit_fdf_range(fit, st, j0, j1, f, NULL);
+        return;
+    }
+
+    if(nb_med > NB_F32_STATIC) {
+        ds = emalloc(nb_med * sizeof(float));
+        ns = emalloc(nb_med * sizeof(cmplf));
+    }
+
+    for(k = 0; k < nb_med - 2; k++) {
+        ds[k] = ths[k];
+    }
+
+    if(st->cache->th_only && tables->rc_f32_full_spectr) {
+        const cmplf *rc = (const cmplf *) tables->rc_f32_full_spectr;
+        const cmplf *beta = (const cmplf *) tables->beta_f32_full_spectr;
+        float r_raw[REFL_BATCH_SIZE_F32];
+
+        for(j = j0; j < j1; j += REFL_BATCH_SIZE_F32) {
+            const int nblock = (j1 - j < REFL_BATCH_SIZE_F32 ? j1 - j : REFL_BATCH_SIZE_F32);
+
+            mult_layer_refl_ni_batch_f32(nb_med, nblock,
+                                         rc + j * tables->rc_stride,
+                                         beta + j * (nb_med - 2), ds, r_raw);
+
+            for(k = 0; k < nblock; k++) {
+                float const * spectr_data = spectra_get_values(s, j + k);
+                gsl_vector_set(f, j + k - st->row0, rmult * r_raw[k] - spectr_data[1]);
+            }
+        }
+    } else {
+        fit_engine_update_media(fit, st->stack, j0, j1, 0);
+
+        for(j = j0; j < j1; j++) {
+            float const * spectr_data = spectra_get_values(s, j);
+            const double lambda = spectr_data[0];
+            const cmpl *nsd = tables->ns_full_spectr + j * nb_med;
+            float r_raw;
+
+            for(k = 0; k < nb_med; k++) {
+                ns[k] = nsd[k];
+            }
+
+            r_raw = mult_layer_refl_ni_f32(nb_med, ns, ds, lambda);
+            gsl_vector_set(f, j - st->row0, rmult * r_raw - spectr_data[1]);
+        }
+    }
+
+    if(nb_med > NB_F32_STATIC) {
+        free(ds);
+        free(ns);
+    }
+#undef NB_F32_STATIC
+}
+
+/* Eliminate the multiplier by variable projection. On entry f and jacob
+   are evaluated with a unit multiplier so that the multiplier column of
+   the jacobian contains the raw reflectivity R. The optimal multiplier
+   c = <R,y> / <R,R> is stored in the fit engine, the residuals become
+   c R - y and the jacobian the total derivative of the projected
+   residuals, whose multiplier column is zero. */
+static void
+refl_fit_project(struct fit_engine *fit, gsl_vector *f, gsl_matrix *jacob)
+{
+    struct spectrum *s = fit->run->spectr;
+    const size_t npt = spectra_points(s);
+    const size_t nb_params = fit->parameters->number;
+    const size_t fm = fit->run->vp_index;
+    double srr = 0.0, sry = 0.0, c;
+    size_t j, k;
+
+    for(j = 0; j < npt; j++) {
+        const double y = spectra_get_values(s, j)[1];
+        const double r = (f ? gsl_vector_get(f, j) + y : gsl_matrix_get(jacob, j, fm));
+        srr += r * r;
+        sry += r * y;
+    }
+
+    c = (srr > 0.0 ? sry / srr : 0.0);
+
+    if(jacob) {
+        double *g = emalloc(nb_params * sizeof(double));
+
+        for(k = 0; k < nb_params; k++) {
+            double a = 0.0, b = 0.0;
+            if(k == fm) {
+                g[k] = 0.0;
+                continue;
             }
+            for(j = 0; j < npt; j++) {
+                const double y = spectra_get_values(s, j)[1];
+                const double dr = gsl_matrix_get(jacob, j, k);
+                a += dr * y;
+                b += gsl_matrix_get(jacob, j, fm) * dr;
+            }
+            /* Derivative of the optimal multiplier. */
+            g[k] = (srr > 0.0 ? (a - 2 * c * b) / srr : 0.0);
+        }
+
+        for(j = 0; j < npt; j++) {
+            const double r = gsl_matrix_get(jacob, j, fm);
+            for(k = 0; k < nb_params; k++) {
+                const double dr = gsl_matrix_get(jacob, j, k);
+                gsl_matrix_set(jacob, j, k, k == fm ? 0.0 : c * dr + r * g[k]);
+            }
+        }
+
+        free(g);
+    }
+
+    if(f) {
+        for(j = 0; j < npt; j++) {
+            const double y = spectra_get_values(s, j)[1];
+            gsl_vector_set(f, j, c * (gsl_vector_get(f, j) + y) - y);
         }
     }
 
+    fit->extra->rmult = c;
+}
+
+/* Same as refl_fit_project but acting on the normal equations. The sums
+   needed are all contained in the normal equations of the unprojected
+   residuals f = R - y: <R,R> and <dR_k,R> are the multiplier row and
+   column of J^T J and <R,f>, <dR_k,f> are in J^T f. The results are
+   expressed in terms of the latter to limit the cancellation near the
+   minimum. Only the lower triangle of jtj is used and updated. */
+static void
+refl_fit_project_normal(struct fit_engine *fit, gsl_matrix *jtj,
+                        gsl_vector *jtr, double *sumsq)
+{
+    const size_t nb_params = fit->parameters->number;
+    const size_t fm = fit->run->vp_index;
+    const double srr = gsl_matrix_get(jtj, fm, fm);
+    const double srf = gsl_vector_get(jtr, fm);
+    double *b = emalloc(2 * nb_params * sizeof(double)), *g = b + nb_params;
+    double c;
+    size_t k, l;
+
+    if(srr <= 0.0) {
+        gsl_matrix_set_zero(jtj);
+        gsl_vector_set_zero(jtr);
+        fit->extra->rmult = 0.0;
+        free(b);
+        return;
+    }
+
+    /* c = <R,y> / <R,R> */
+    c = 1.0 - srf / srr;
+
+    for(k = 0; k < nb_params; k++) {
+        double a;
+        if(k == fm) {
+            b[k] = g[k] = 0.0;
+            continue;
+        }
+        b[k] = (k > fm ? gsl_matrix_get(jtj, k, fm) : gsl_matrix_get(jtj, fm, k));
+        a = b[k] - gsl_vector_get(jtr, k);
+        g[k] = (a - 2 * c * b[k]) / srr;
+        gsl_vector_set(jtr, k, c * ((c - 1.0) * b[k] + gsl_vector_get(jtr, k)));
+    }
+    gsl_vector_set(jtr, fm, 0.0);
+
+    for(k = 0; k < nb_params; k++) {
+        for(l = 0; l <= k; l++) {
+            double m = 0.0;
+            if(k != fm && l != fm) {
+                m = c * c * gsl_matrix_get(jtj, k, l) + c * (g[l] * b[k] + g[k] * b[l]) + g[k] * g[l] * srr;
+            }
+            gsl_matrix_set(jtj, k, l, m);
+        }
+    }
+
+    *sumsq -= srf * srf / srr;
+    fit->extra->rmult = c;
+
+    free(b);
+}
+
+struct refl_parallel_job {
+    struct fit_engine *fit;
+    gsl_vector *f;
+    gsl_matrix *jacob;
+    /* Use the single precision kernels, residuals only. */
+    int single;
+};
+
+static void
+refl_fit_fdf_task(void *data, int task, int thread)
+{
+    struct refl_parallel_job *job = data;
+    struct fit_engine *fit = job->fit;
+    const size_t npt = spectra_points(fit->run->spectr);
+    const size_t j0 = task * FIT_WORKER_CHUNK;
+    const size_t j1 = (j0 + FIT_WORKER_CHUNK < npt ? j0 + FIT_WORKER_CHUNK : npt);
+    struct refl_eval_state st[1];
+
+    refl_eval_state_init(fit, thread, st);
+
+    if(job->single) {
+        refl_fit_f32_range(fit, st, j0, j1, job->f);
+    } else {
+        refl_fit_fdf_range(fit, st, j0, j1, job->f, job->jacob);
+    }
+}
+
+static int
+refl_fit_eval(const gsl_vector *x, void *params,
+              gsl_vector *f, gsl_matrix * jacob, int single)
+{
+    struct fit_engine *fit = params;
+    const size_t npt = spectra_points(fit->run->spectr);
+
+    /* STEP 1 : We apply the actual values of the fit parameters
+                to the stack. */
+
+    fit_engine_commit_parameters(fit, x);
+
+    if(fit->run->vp_index >= 0) {
+        fit->extra->rmult = 1.0;
+    }
+
+    /* STEP 2 : The spectrum is evaluated, in parallel by chunks if
+                a worker pool is available. */
+
+    if(fit->run->pool) {
+        struct refl_parallel_job job[1] = {{fit, f, jacob, single}};
+        const int nb_tasks = (npt + FIT_WORKER_CHUNK - 1) / FIT_WORKER_CHUNK;
+        fit_engine_sync_workers(fit, x);
+        worker_pool_run(fit->run->pool, refl_fit_fdf_task, job, nb_tasks);
+    } else {
+        struct refl_eval_state st[1];
+        refl_eval_state_init(fit, 0, st);
+        if(single) {
+            refl_fit_f32_range(fit, st, 0, npt, f);
+        } else {
+            refl_fit_fdf_range(fit, st, 0, npt, f, jacob);
+        }
+    }
+
+    fit_engine_clean_media(fit, jacob != NULL);
+
+    /* STEP 3 : The multiplier is eliminated if required. */
+
+    if(fit->run->vp_index >= 0) {
+        refl_fit_project(fit, f, jacob);
+    }
+
     return GSL_SUCCESS;
 }
 
+/* Evaluate a chunk of points in the buffers of the thread and add it to
+   its normal equations. */
+static void
+refl_fit_normal_task(void *data, int task, int thread)
+{
+    struct fit_engine *fit = data;
+    struct fit_normal_acc *acc = fit->run->normal_acc + thread;
+    const size_t npt = spectra_points(fit->run->spectr);
+    const size_t j0 = task * FIT_WORKER_CHUNK;
+    const size_t j1 = (j0 + FIT_WORKER_CHUNK < npt ? j0 + FIT_WORKER_CHUNK : npt);
+    gsl_vector_view fv = gsl_vector_view_array(acc->f, j1 - j0);
+    gsl_matrix_view jv = gsl_matrix_view_array(acc->jacob, j1 - j0, fit->parameters->number);
+    struct refl_eval_state st[1];
+
+    refl_eval_state_init(fit, thread, st);
+    st->row0 = j0;
+
+    refl_fit_fdf_range(fit, st, j0, j1, &fv.vector, &jv.matrix);
+    fit_normal_acc_add(acc, &fv.vector, &jv.matrix);
+}
+
+int
+refl_fit_normal(const gsl_vector *x, void *params, gsl_matrix *jtj,
+                gsl_vector *jtr, double *sumsq)
+{
+    struct fit_engine *fit = params;
+    const size_t npt = spectra_points(fit->run->spectr);
+    const int nb_tasks = (npt + FIT_WORKER_CHUNK - 1) / FIT_WORKER_CHUNK;
+    int k;
+
+    fit_engine_commit_parameters(fit, x);
+    fit_engine_normal_reset(fit);
+
+    if(fit->run->vp_index >= 0) {
+        fit->extra->rmult = 1.0;
+    }
+
+    if(fit->run->pool) {
+        fit_engine_sync_workers(fit, x);
+        worker_pool_run(fit->run->pool, refl_fit_normal_task, fit, nb_tasks);
+    } else {
+        for(k = 0; k < nb_tasks; k++) {
+            refl_fit_normal_task(fit, k, 0);
+        }
+    }
+
+    fit_engine_clean_media(fit, 1);
+    fit_engine_normal_sum(fit, jtj, jtr, sumsq);
+
+    if(fit->run->vp_index >= 0) {
+        refl_fit_project_normal(fit, jtj, jtr, sumsq);
+    }
+
+    return GSL_SUCCESS;
+}
+
+int
+refl_fit_fdf(const gsl_vector *x, void *params,
+             gsl_vector *f, gsl_matrix * jacob)
+{
+    return refl_fit_eval(x, params, f, jacob, 0);
+}
+
+int
+refl_fit_f32(const gsl_vector *x, void *params, gsl_vector * f)
+{
+    return refl_fit_eval(x, params, f, NULL, 1);
+}
+
 int
 refl_fit_f(const gsl_vector *x, void *params, gsl_vector * f)
 {
@@ -140,3 +536,57 @@ refl_fit_df(const gsl_vector *x, void *params, gsl_matrix *jacob)
 {
     return refl_fit_fdf(x, params, NULL, jacob);
 }
+
+int
+refl_fit_f_bounded(const gsl_vector *x, void *params, gsl_vector *f,
+                   double bound, double *sumsq)
+{
+    struct fit_engine *fit = params;
+    const size_t npt = spectra_points(fit->run->spectr);
+    struct refl_eval_state st[1];
+    double ssq = 0.0;
+    size_t j0, j;
+
+    /* The projected residuals depend on the whole spectrum so the
+       evaluation cannot be stopped early. */
+    if(fit->run->vp_index >= 0) {
+        refl_fit_eval(x, params, f, NULL, fit->config->grid_single);
+        for(j = 0; j < npt; j++) {
+            const double r = gsl_vector_get(f, j);
+            ssq += r * r;
+        }
+        *sumsq = ssq;
+        return (ssq > bound ? FIT_EVAL_PRUNED : GSL_SUCCESS);
+    }
+
+    refl_eval_state_init(fit, 0, st);
+    fit_engine_commit_parameters(fit, x);
+
+    for(j0 = 0; j0 < npt; j0 += FIT_BOUND_CHECK_POINTS) {
+        size_t j1 = j0 + FIT_BOUND_CHECK_POINTS;
+
+        if(j1 > npt) {
+            j1 = npt;
+        }
+        if(fit->config->grid_single) {
+            refl_fit_f32_range(fit, st, j0, j1, f);
+        } else {
+            refl_fit_fdf_range(fit, st, j0, j1, f, NULL);
+        }
+
+        for(j = j0; j < j1; j++) {
+            const double r = gsl_vector_get(f, j);
+            ssq += r * r;
+        }
+
+        if(ssq > bound) {
+            *sumsq = ssq;
+            return FIT_EVAL_PRUNED;
+        }
+    }
+
+    fit_engine_clean_media(fit, 0);
+
+    *sumsq = ssq;
+    return GSL_SUCCESS;
+}
@@ -25,9 +25,101 @@ refl_coeff_ext_ni(cmpl nt, cmpl nb, cmpl * drdnt, cmpl * drdnb)
     return r;
 }
 
+/* Scratch used to evaluate the repeated copies of a block of layers. */
+struct refl_ni_repeat {
+    /* NULL if there is no repeated block. */
+    const struct repeat_block *block;
+    struct repeat_step *steps;
+    cmpl *work;
+    /* Derivatives of the reflection coefficient after the repeated
+       copies respect to the thicknesses and refractive indexes of the
+       block and respect to the coefficient below the copies. */
+    cmpl *jac;
+    cmpl dfdR;
+};
+
+/* The repeated copies of the block are applied just before the step
+   "first + length - 2", the step that enters the last medium of the
+   topmost copy. */
+#define REPEAT_STEP(rep) ((rep)->first + (rep)->length - 2)
+
+/* Apply the lower copies of the repeated block to R. The derivatives are
+   computed for the thicknesses only if jacob == 1 and also for the
+   refractive indexes if jacob == 2. */
 static cmpl
+refl_ni_apply_repeat(struct refl_ni_repeat *rp, const cmpl ns[],
+                     const double ds[], double omega, cmpl R, int jacob)
+{
+    const int first = rp->block->first, length = rp->block->length;
+    int i;
+
+    for(i = 0; i < length; i++) {
+        struct repeat_step *st = rp->steps + i;
+        cmpl nt = ns[i == 0 ? first + length - 1 : first + i - 1];
+        cmpl nc = ns[first + i];
+        double th = ds[first + i - 1];
+        cmpl beta = - 2.0 * I * omega * nc;
+
+        st->rho = cexp(beta * THICKNESS_TO_NM(th));
+
+        if(jacob == 2) {
+            st->r = refl_coeff_ext_ni(nt, nc, &st->drdnt, &st->drdnb);
+            st->drhodn = - 2.0 * I * st->rho * omega * THICKNESS_TO_NM(th);
+        } else {
+            st->r = refl_coeff_ni(nt, nc);
+        }
+        st->drhodth = st->rho * beta * THICKNESS_TO_NM(1.0);
+    }
+
+    return repeat_block_apply(length, rp->block->times, rp->steps, R,
+                              (jacob ? &rp->dfdR : NULL),
+                              (jacob ? rp->jac : NULL),
+                              (jacob == 2 ? rp->jac + length : NULL),
+                              rp->work);
+}
+
+/* Backward sweep of the adjoint method. On entry jacth[j] and jacn[j+1]
+   contain the derivatives of the reflection coefficient obtained at the
+   step "j" of the recursion and dfdR[j] the derivative of the step "j"
+   respect to the reflection coefficient of the step before. On exit they
+   are the derivatives of the final reflection coefficient. */
+KERNEL_INLINE void
+refl_ni_adjoint_sweep(int nb, const cmpl dfdR[], cmpl *jacth, cmpl *jacn,
+                      const struct refl_ni_repeat *rp)
+{
+    const struct repeat_block *rep = rp->block;
+    cmpl pf = 1.0, pf_repeat = 0.0;
+    int j;
+
+    for(j = 0; j < nb - 2; j++) {
+        jacth[j] *= pf;
+        if(jacn) {
+            jacn[j+1] *= pf;
+        }
+        pf *= dfdR[j];
+        if(rep && j == REPEAT_STEP(rep)) {
+            pf_repeat = pf;
+            pf *= rp->dfdR;
+        }
+    }
+
+    if(jacn) {
+        jacn[nb-1] *= pf;
+    }
+
+    if(rep) {
+        for(j = 0; j < rep->length; j++) {
+            jacth[rep->first + j - 1] += pf_repeat * rp->jac[j];
+            if(jacn) {
+                jacn[rep->first + j] += pf_repeat * rp->jac[rep->length + j];
+            }
+        }
+    }
+}
+
+KERNEL_INLINE cmpl
 mult_layer_refl_ni_nojacob(int nb, const cmpl ns[], const double ds[],
-                           double lambda)
+                           double lambda, struct refl_ni_repeat *rp)
 {
     const double omega = 2 * M_PI / lambda;
     cmpl nt, nc, R;
@@ -43,6 +135,10 @@ mult_layer_refl_ni_nojacob(int nb, const cmpl ns[], const double ds[],
         cmpl den;
         double th = ds[j];
 
+        if(rp->block && j == REPEAT_STEP(rp->block)) {
+            R = refl_ni_apply_repeat(rp, ns, ds, omega, R, 0);
+        }
+
         nc = nt;
         nt = ns[j];
 
@@ -58,12 +154,12 @@ mult_layer_refl_ni_nojacob(int nb, const cmpl ns[], const double ds[],
     return R;
 }
 
-static cmpl
+KERNEL_INLINE cmpl
 mult_layer_refl_ni_jacob_th(int nb, const cmpl ns[], const double ds[],
-                            double lambda, cmpl *jacth)
+                            double lambda, cmpl *jacth, cmpl *dfdR,
+                            struct refl_ni_repeat *rp)
 {
     const double omega = 2 * M_PI / lambda;
-    const int nblyr = nb - 2;
     cmpl R;
     cmpl nt, nc;
     int j;
@@ -75,10 +171,13 @@ mult_layer_refl_ni_jacob_th(int nb, const cmpl ns[], const double ds[],
 
     for(j = nb - 3; j >= 0; j--) {
         cmpl r, rho, beta, drhodth;
-        cmpl dfdR, dfdrho;
+        cmpl dfdrho;
         cmpl den, isqden;
         double th = ds[j];
-        int k;
+
+        if(rp->block && j == REPEAT_STEP(rp->block)) {
+            R = refl_ni_apply_repeat(rp, ns, ds, omega, R, 1);
+        }
 
         nc = nt;
         nt = ns[j];
@@ -91,11 +190,7 @@ mult_layer_refl_ni_jacob_th(int nb, const cmpl ns[], const double ds[],
 
         den = 1 + r * R * rho;
         isqden = 1 / csqr(den);
-        dfdR = rho * (1 - r*r) * isqden;
-
-        for(k = nblyr; k > j+1; k--) {
-            jacth[k-1] *= dfdR;
-        }
+        dfdR[j] = rho * (1 - r*r) * isqden;
 
         dfdrho = R * (1 - r*r) * isqden;
 
@@ -104,15 +199,17 @@ mult_layer_refl_ni_jacob_th(int nb, const cmpl ns[], const double ds[],
         R = (r + R * rho) / den;
     }
 
+    refl_ni_adjoint_sweep(nb, dfdR, jacth, NULL, rp);
+
     return R;
 }
 
-static cmpl
+KERNEL_INLINE cmpl
 mult_layer_refl_ni_jacob(int nb, const cmpl ns[], const double ds[],
-                         double lambda, cmpl *jacth, cmpl *jacn)
+                         double lambda, cmpl *jacth, cmpl *jacn, cmpl *dfdR,
+                         struct refl_ni_repeat *rp)
 {
     const double omega = 2 * M_PI / lambda;
-    const int nblyr = nb - 2;
     cmpl R;
     cmpl nt, nc;
     cmpl drdnt, drdnb;
@@ -128,10 +225,14 @@ mult_layer_refl_ni_jacob(int nb, const cmpl ns[], const double ds[],
 
     for(j = nb - 3; j >= 0; j--) {
         cmpl r, rho, beta, drhodn, drhodth;
-        cmpl dfdR, dfdr, dfdrho;
+        cmpl dfdr, dfdrho;
         cmpl den, isqden;
         double th = ds[j];
-        int k;
+
+        if(rp->block && j == REPEAT_STEP(rp->block)) {
+            R = refl_ni_apply_repeat(rp, ns, ds, omega, R, 2);
+            jacn[j+1] *= rp->dfdR;
+        }
 
         nc = nt;
         nt = ns[j];
@@ -145,20 +246,15 @@ mult_layer_refl_ni_jacob(int nb, const cmpl ns[], const double ds[],
 
         den = 1 + r * R * rho;
         isqden = 1 / csqr(den);
-        dfdR = rho * (1 - r*r) * isqden;
-
-        for(k = nb - 1; k > j+1; k--) {
-            jacn[k] *= dfdR;
-        }
-
-        for(k = nblyr; k > j+1; k--) {
-            jacth[k-1] *= dfdR;
-        }
+        dfdR[j] = rho * (1 - r*r) * isqden;
 
         dfdr = (1 - csqr(R*rho)) * isqden;
         dfdrho = R * (1 - r*r) * isqden;
 
-        jacn[j+1] = dfdR * jacn[j+1] + dfdr * drdnb + dfdrho * drhodn;
+        /* The derivatives are given here respect to the reflection
+           coefficient of this step only. They are propagated up to the
+           final one by the backward sweep. */
+        jacn[j+1] = dfdR[j] * jacn[j+1] + dfdr * drdnb + dfdrho * drhodn;
         jacn[j] = dfdr * drdnt;
 
         jacth[j] = dfdrho * drhodth;
@@ -166,42 +262,70 @@ mult_layer_refl_ni_jacob(int nb, const cmpl ns[], const double ds[],
         R = (r + R * rho) / den;
     }
 
+    refl_ni_adjoint_sweep(nb, dfdR, jacth, jacn, rp);
+
     return R;
 }
 
-double
-mult_layer_refl_ni(size_t _nb, const cmpl ns[], const double ds[],
-                   double lambda,
-                   gsl_vector *r_jacob_th, gsl_vector *r_jacob_n)
+struct refl_workspace *
+refl_workspace_alloc(size_t nb)
+{
+    struct refl_workspace *ws = emalloc(sizeof(struct refl_workspace));
+    ws->nb = nb;
+    ws->jac_th = emalloc(nb * sizeof(cmpl));
+    ws->jac_n  = emalloc(nb * sizeof(cmpl));
+    ws->dfdR   = emalloc(nb * sizeof(cmpl));
+    ws->repeat_steps = emalloc(nb * sizeof(struct repeat_step));
+    ws->repeat_work  = emalloc(REPEAT_BLOCK_WORKSPACE(nb) * sizeof(cmpl));
+    ws->repeat_jac   = emalloc(2 * nb * sizeof(cmpl));
+    return ws;
+}
+
+void
+refl_workspace_free(struct refl_workspace *ws)
+{
+    free(ws->jac_th);
+    free(ws->jac_n);
+    free(ws->dfdR);
+    free(ws->repeat_steps);
+    free(ws->repeat_work);
+    free(ws->repeat_jac);
+    free(ws);
+}
+
+KERNEL_INLINE double
+refl_ni_kernel(const int nb, const cmpl ns[], const double ds[],
+               const struct repeat_block *rep, double lambda,
+               gsl_vector *r_jacob_th, gsl_vector *r_jacob_n,
+               struct refl_workspace *ws)
 {
-#define NB_JAC_STATIC 10
-    struct {
-        cmpl th[NB_JAC_STATIC], n[NB_JAC_STATIC];
-    } jacs;
     struct {
-        cmpl *th, *n;
-    } jacd;
-    int nb = _nb;
-    int use_static = (nb <= NB_JAC_STATIC);
+        cmpl *th, *n, *g;
+    } jacd = {NULL, NULL, NULL};
+    struct refl_ni_repeat rp[1];
     size_t k;
     cmpl r;
 
     assert(nb >= 2);
 
-    if(use_static) {
-        jacd.th = jacs.th;
-        jacd.n  = jacs.n;
-    } else {
-        jacd.th = emalloc(nb * sizeof(cmpl));
-        jacd.n  = emalloc(nb * sizeof(cmpl));
+    rp->block = (REPEAT_BLOCK_IS_ACTIVE(rep) ? rep : NULL);
+
+    if(r_jacob_th || r_jacob_n || rp->block) {
+        assert(ws != NULL && ws->nb >= (size_t) nb);
+        jacd.th = ws->jac_th;
+        jacd.n  = ws->jac_n;
+        jacd.g  = ws->dfdR;
+        rp->steps = ws->repeat_steps;
+        rp->work  = ws->repeat_work;
+        rp->jac   = ws->repeat_jac;
     }
 
     if(r_jacob_th && r_jacob_n) {
-        r = mult_layer_refl_ni_jacob(nb, ns, ds, lambda, jacd.th, jacd.n);
+        r = mult_layer_refl_ni_jacob(nb, ns, ds, lambda, jacd.th, jacd.n, jacd.g, rp);
     } else if(r_jacob_th) {
-        r = mult_layer_refl_ni_jacob_th(nb, ns, ds, lambda, jacd.th);
+        r = mult_layer_refl_ni_jacob_th(nb, ns, ds, lambda, jacd.th, jacd.g, rp);
     } else {
-        r = mult_layer_refl_ni_nojacob(nb, ns, ds, lambda);
+        r = mult_layer_refl_ni_nojacob(nb, ns, ds, lambda, rp);
     }
 
     if(r_jacob_th)
@@ -220,11 +344,206 @@ mult_layer_refl_ni(size_t _nb, const cmpl ns[], const double ds[],
             gsl_vector_set(r_jacob_n, nb + k, drsqi);
         }
 
-    if(! use_static) {
-        free(jacd.th);
-        free(jacd.n);
+    return CSQABS(r);
+}
+
+double
+mult_layer_refl_ni(size_t nb, const cmpl ns[], const double ds[],
+                   const struct repeat_block *rep, double lambda,
+                   gsl_vector *r_jacob_th, gsl_vector *r_jacob_n,
+                   struct refl_workspace *ws)
+{
+    return refl_ni_kernel(nb, ns, ds, rep, lambda, r_jacob_th, r_jacob_n, ws);
+}
+
+void
+mult_layer_refl_ni_table(size_t _nb, const cmpl ns[], double lambda,
+                         cmpl rc[], cmpl beta[])
+{
+    const double omega = 2 * M_PI / lambda;
+    const int nb = _nb;
+    int j;
+
+    for(j = 0; j < nb - 1; j++) {
+        rc[j] = refl_coeff_ni(ns[j], ns[j+1]);
+        if(j < nb - 2) {
+            beta[j] = - 2.0 * I * omega * ns[j+1] * THICKNESS_TO_NM(1.0);
+        }
+    }
+}
+
+KERNEL_INLINE double
+refl_ni_precomp_kernel(const int nb, const cmpl rc[], const cmpl beta[],
+                       const double ds[], gsl_vector *r_jacob_th,
+                       struct refl_workspace *ws)
+{
+    const struct refl_ni_repeat norep[1] = {{NULL}};
+    cmpl *jacth, *dfdR;
+    cmpl R = rc[nb-2];
+    int j;
+
+    if(r_jacob_th == NULL) {
+        for(j = nb - 3; j >= 0; j--) {
+            const cmpl r = rc[j];
+            const cmpl rho = cexp(beta[j] * ds[j]);
+            R = (r + R * rho) / (1 + r * R * rho);
+        }
+        return CSQABS(R);
     }
 
-    return CSQABS(r);
-#undef NB_JAC_STATIC
+    assert(ws != NULL && ws->nb >= (size_t) nb);
+    jacth = ws->jac_th;
+    dfdR  = ws->dfdR;
+
+    for(j = nb - 3; j >= 0; j--) {
+        const cmpl r = rc[j];
+        const cmpl rho = cexp(beta[j] * ds[j]);
+        const cmpl den = 1 + r * R * rho;
+        const cmpl isqden = 1 / csqr(den);
+
+        dfdR[j] = rho * (1 - r*r) * isqden;
+        jacth[j] = R * (1 - r*r) * isqden * rho * beta[j];
+
+        R = (r + R * rho) / den;
+    }
+
+    refl_ni_adjoint_sweep(nb, dfdR, jacth, NULL, norep);
+
+    for(j = 0; j < nb - 2; j++) {
+        cmpl dr = jacth[j];
+        double drsq = 2 * (creal(R)*creal(dr) + cimag(R)*cimag(dr));
+        gsl_vector_set(r_jacob_th, j, drsq);
+    }
+
+    return CSQABS(R);
+}
+
+double
+mult_layer_refl_ni_precomp(size_t nb, const cmpl rc[], const cmpl beta[],
+                           const double ds[], gsl_vector *r_jacob_th,
+                           struct refl_workspace *ws)
+{
+    return refl_ni_precomp_kernel(nb, rc, beta, ds, r_jacob_th, ws);
+}
+
+/* Variants of the kernels for a fixed number of mediums. Since the kernels
+   are inlined the compiler can fully unroll the loops over the layers. */
+#define REFL_NI_SPECIALIZE(N) \
+static double \
+mult_layer_refl_ni_ ## N(size_t nb, const cmpl ns[], const double ds[], \
+                         const struct repeat_block *rep, double lambda, \
+                         gsl_vector *r_jacob_th, gsl_vector *r_jacob_n, \
+                         struct refl_workspace *ws) \
+{ \
+    return refl_ni_kernel(N, ns, ds, rep, lambda, r_jacob_th, r_jacob_n, ws); \
+} \
+static double \
+mult_layer_refl_ni_precomp_ ## N(size_t nb, const cmpl rc[], \
+                                 const cmpl beta[], const double ds[], \
+                                 gsl_vector *r_jacob_th, \
+                                 struct refl_workspace *ws) \
+{ \
+    return refl_ni_precomp_kernel(N, rc, beta, ds, r_jacob_th, ws); \
+}
+
+REFL_NI_SPECIALIZE(3)
+REFL_NI_SPECIALIZE(4)
+REFL_NI_SPECIALIZE(5)
+REFL_NI_SPECIALIZE(6)
+
+void
+mult_layer_refl_ni_select(size_t nb, struct refl_ni_kernels *k)
+{
+    switch(nb) {
+    case 3:
+        k->refl = mult_layer_refl_ni_3;
+        k->precomp = mult_layer_refl_ni_precomp_3;
+        break;
+    case 4:
+        k->refl = mult_layer_refl_ni_4;
+        k->precomp = mult_layer_refl_ni_precomp_4;
+        break;
+    case 5:
+        k->refl = mult_layer_refl_ni_5;
+        k->precomp = mult_layer_refl_ni_precomp_5;
+        break;
+    case 6:
+        k->refl = mult_layer_refl_ni_6;
+        k->precomp = mult_layer_refl_ni_precomp_6;
+        break;
+    default:
+        k->refl = mult_layer_refl_ni;
+        k->precomp = mult_layer_refl_ni_precomp;
+    }
+}
+
+/* Evaluate the recursion for a block of up to REFL_BATCH_SIZE wavelengths.
+   The complex quantities are kept as separate arrays of real and imaginary
+   parts, one element for each wavelength, and all the inner loops run over
+   the full block with a fixed trip count so that the compiler can map them
+   to SIMD registers. Unused lanes just repeat the last wavelength. */
+static void
+mult_layer_refl_ni_block(int nb, int nlambda, const cmpl rc[],
+                         const cmpl beta[], const double ds[], double refl[])
+{
+    const int nrc = nb - 1, nbeta = nb - 2;
+    double Rr[REFL_BATCH_SIZE], Ri[REFL_BATCH_SIZE];
+    double rr[REFL_BATCH_SIZE], ri[REFL_BATCH_SIZE];
+    double br[REFL_BATCH_SIZE], bi[REFL_BATCH_SIZE];
+    int j, k;
+
+    for(k = 0; k < REFL_BATCH_SIZE; k++) {
+        const int kk = (k < nlambda ? k : nlambda - 1);
+        Rr[k] = creal(rc[kk * nrc + nb - 2]);
+        Ri[k] = cimag(rc[kk * nrc + nb - 2]);
+    }
+
+    for(j = nb - 3; j >= 0; j--) {
+        const double th = ds[j];
+
+        for(k = 0; k < REFL_BATCH_SIZE; k++) {
+            const int kk = (k < nlambda ? k : nlambda - 1);
+            rr[k] = creal(rc[kk * nrc + j]);
+            ri[k] = cimag(rc[kk * nrc + j]);
+            br[k] = creal(beta[kk * nbeta + j]);
+            bi[k] = cimag(beta[kk * nbeta + j]);
+        }
+
+        for(k = 0; k < REFL_BATCH_SIZE; k++) {
+            /* rho = exp(beta th). The sine is written as a shifted cosine
+               otherwise the compiler would merge the two calls in a sincos
+               that cannot be vectorized. */
+            const double ea = exp(br[k] * th);
+            const double rhor = ea * cos(bi[k] * th);
+            const double rhoi = ea * cos(M_PI_2 - bi[k] * th);
+            /* R = (r + R rho) / (1 + r R rho) */
+            const double sr = Rr[k]*rhor - Ri[k]*rhoi;
+            const double si = Rr[k]*rhoi + Ri[k]*rhor;
+            const double numr = rr[k] + sr, numi = ri[k] + si;
+            const double denr = 1 + rr[k]*sr - ri[k]*si, deni = rr[k]*si + ri[k]*sr;
+            const double iden = 1 / (denr*denr + deni*deni);
+            Rr[k] = (numr*denr + numi*deni) * iden;
+            Ri[k] = (numi*denr - numr*deni) * iden;
+        }
+    }
+
+    for(k = 0; k < nlambda; k++) {
+        refl[k] = Rr[k]*Rr[k] + Ri[k]*Ri[k];
+    }
+}
+
+void
+mult_layer_refl_ni_batch(size_t _nb, size_t nlambda, const cmpl rc[],
+                         const cmpl beta[], const double ds[], double refl[])
+{
+    int nb = _nb;
+    size_t k;
+
+    assert(nb >= 2);
+
+    for(k = 0; k < nlambda; k += REFL_BATCH_SIZE) {
+        int nblock = (nlambda - k < REFL_BATCH_SIZE ? nlambda - k : REFL_BATCH_SIZE);
+        mult_layer_refl_ni_block(nb, nblock, rc + k * (nb - 1),
+                                 beta + k * (nb - 2), ds, refl + k);
+    }
 }
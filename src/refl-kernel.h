@@ -5,14 +5,87 @@
 #include "cmpl.h"
 #include "spectra.h"
 #include "ellipsometry-decls.h"
+#include "repeat-block.h"
 
 #include <gsl/gsl_vector.h>
 
+/* Number of wavelengths evaluated together by mult_layer_refl_ni_batch. */
+#define REFL_BATCH_SIZE 8
 
-/* reflectivity for normal incidence with multi-layer film */
+/* Scratch memory used by the reflectometry kernels to compute the
+   derivatives for a stack of up to "nb" mediums. It is owned by the
+   caller so that the kernels do not need any heap allocated storage. */
+struct refl_workspace {
+    size_t nb;
+    cmpl *jac_th;
+    cmpl *jac_n;
+    /* Per-step factors recorded for the adjoint sweep. */
+    cmpl *dfdR;
+    /* Used to evaluate a repeated block of layers. */
+    struct repeat_step *repeat_steps;
+    cmpl *repeat_work;
+    cmpl *repeat_jac;
+};
+
+extern struct refl_workspace *refl_workspace_alloc(size_t nb);
+extern void refl_workspace_free(struct refl_workspace *ws);
+
+/* reflectivity for normal incidence with multi-layer film. The block of
+   layers "rep", if not NULL, is repeated as described by the stack. The
+   workspace "ws" is required only if rjacob_th or rjacob_n are not NULL
+   or if "rep" is a repeated block of layers. */
 double mult_layer_refl_ni(size_t nb /*nb of mediums */,
                           const cmpl ns[], const double ds[],
+                          const struct repeat_block *rep,
                           double lambda,
-                          gsl_vector *rjacob_th, gsl_vector *rjacob_n);
+                          gsl_vector *rjacob_th, gsl_vector *rjacob_n,
+                          struct refl_workspace *ws);
+
+/* Compute for the given wavelength the Fresnel coefficients of the nb - 1
+   interfaces and the phase rates of the nb - 2 layers such that
+   rho = exp(beta * thickness). */
+extern void mult_layer_refl_ni_table(size_t nb, const cmpl ns[],
+                                     double lambda, cmpl rc[], cmpl beta[]);
+
+/* reflectivity for normal incidence using the tables computed by
+   mult_layer_refl_ni_table. Only the derivatives respect to the
+   thicknesses can be computed and "ws" is required only for them. */
+extern double mult_layer_refl_ni_precomp(size_t nb, const cmpl rc[],
+                                         const cmpl beta[], const double ds[],
+                                         gsl_vector *rjacob_th,
+                                         struct refl_workspace *ws);
+
+typedef double (*refl_ni_kernel_t)(size_t nb, const cmpl ns[],
+                                   const double ds[],
+                                   const struct repeat_block *rep,
+                                   double lambda, gsl_vector *rjacob_th,
+                                   gsl_vector *rjacob_n,
+                                   struct refl_workspace *ws);
+
+typedef double (*refl_ni_precomp_kernel_t)(size_t nb, const cmpl rc[],
+                                           const cmpl beta[],
+                                           const double ds[],
+                                           gsl_vector *rjacob_th,
+                                           struct refl_workspace *ws);
+
+/* Kernels, equivalent to mult_layer_refl_ni and
+   mult_layer_refl_ni_precomp, to be used for a given number of mediums. */
+struct refl_ni_kernels {
+    refl_ni_kernel_t refl;
+    refl_ni_precomp_kernel_t precomp;
+};
+
+/* Select the kernels specialized for "nb" mediums if available or the
+   generic ones otherwise. */
+extern void mult_layer_refl_ni_select(size_t nb, struct refl_ni_kernels *k);
+
+/* reflectivity for normal incidence for a set of wavelengths. The tables
+   given by mult_layer_refl_ni_table are given as nlambda consecutive rows
+   of nb - 1 and nb - 2 values respectively, the same layout used by the
+   stack cache. No derivatives are computed and repeated blocks of layers
+   are not supported. */
+extern void mult_layer_refl_ni_batch(size_t nb, size_t nlambda,
+                                     const cmpl rc[], const cmpl beta[],
+                                     const double ds[], double refl[]);
 
 #endif
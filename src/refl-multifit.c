@@ -14,101 +14,78 @@
 #include "refl-get-jacobian.h"
 
 int
-refl_multifit_fdf(const gsl_vector *x, void *params,
-                  gsl_vector *f, gsl_matrix * jacob)
+refl_multifit_sample_fdf(struct multi_fit_engine *fit, int sample,
+                         gsl_vector *f, gsl_matrix *jacob, size_t priv_col)
 {
-    struct multi_fit_engine *fit = params;
-    size_t nb_med = fit->stack_list[0]->nb;
-    size_t samples_number = fit->samples_number;
+    struct spectrum *spectrum = fit->spectra_list[sample];
+    stack_t *stack = fit->stack_list[sample];
+    struct multi_fit_sample *fs = fit->samples + sample;
+    size_t nb_med = stack->nb;
     struct {
         double const * ths;
         cmpl * ns;
     } actual;
     gsl_vector *r_th_jacob, *r_n_jacob;
-    size_t sample;
-    size_t j, j_sample;
+    size_t j;
 
-    /* STEP 1 : We apply the actual values of the fit parameters
-                to the stack. */
+    /* STEP 2 : From the stack we retrive the thicknesses and RIs
+                informations. */
 
-    multi_fit_engine_commit_parameters(fit, x);
+    actual.ths = stack_get_ths_list(stack);
 
-    j_sample = 0;
-    for(sample = 0; sample < samples_number; sample++) {
-        struct spectrum *spectrum = fit->spectra_list[sample];
+    r_th_jacob = (jacob ? fs->jac_th : NULL);
+    r_n_jacob  = (jacob ? fs->jac_n.refl : NULL);
 
-        /* STEP 2 : From the stack we retrive the thicknesses and RIs
-        informations. */
+    for(j = 0; j < spectra_points(spectrum); j++) {
+        float const * spectr_data = spectra_get_values(spectrum, j);
+        const double lambda = spectr_data[0];
+        const double r_meas = spectr_data[1];
+        double r_raw, r_theory;
+        double rmult = fit->extra.rmult;
 
-        actual.ths = stack_get_ths_list(fit->stack_list[sample]);
+        actual.ns = fs->cache.ns;
+        stack_get_ns_list(stack, actual.ns, lambda);
 
-        r_th_jacob = (jacob ? fit->jac_th : NULL);
-        r_n_jacob  = (jacob ? fit->jac_n.refl : NULL);
+        /* STEP 3 : We call the procedure mult_layer_refl_ni */
 
-        for(j = 0; j < spectra_points(spectrum); j++, j_sample++) {
-            float const * spectr_data = spectra_get_values(spectrum, j);
-            const double lambda = spectr_data[0];
-            const double r_meas = spectr_data[1];
-            double r_raw, r_theory;
-            double rmult = fit->extra.rmult;
-            const size_t nb_priv_params = fit->private_parameters->number;
+        r_raw = mult_layer_refl_ni(nb_med, actual.ns, actual.ths,
+                                   &stack->repeat, lambda,
+                                   r_th_jacob, r_n_jacob, fs->refl_ws);
 
-            actual.ns = fit->cache.ns;
-            stack_get_ns_list(fit->stack_list[sample], actual.ns, lambda);
+        r_theory = rmult * r_raw;
 
-            /* STEP 3 : We call the procedure mult_layer_refl_ni */
-
-            r_raw = mult_layer_refl_ni(nb_med, actual.ns, actual.ths, lambda,
-                                       r_th_jacob, r_n_jacob);
+        if(f != NULL) {
+            gsl_vector_set(f, j, r_theory - r_meas);
+        }
 
-            r_theory = rmult * r_raw;
+        if(jacob) {
+            size_t kp, ic;
+            struct deriv_info * ideriv = fs->cache.deriv_info;
 
-            if(f != NULL) {
-                gsl_vector_set(f, j_sample, r_theory - r_meas);
+            for(ic = 0; ic < nb_med; ic++) {
+                ideriv[ic].is_valid = 0;
             }
 
-            if(jacob) {
-                size_t kp, ikp, ic;
-                size_t nb_params =					\
-                                                    fit->common_parameters->number + \
-                                                    fit->private_parameters->number * samples_number;
-                struct deriv_info * ideriv = fit->cache.deriv_info;
-
-                for(ic = 0; ic < nb_med; ic++) {
-                    ideriv[ic].is_valid = 0;
-                }
-
-                for(kp = 0; kp < fit->common_parameters->number; kp++) {
-                    fit_param_t *fp = fit->common_parameters->values + kp;
-                    double pjac;
-
-                    pjac = get_parameter_jacob_r(fp, fit->stack_list[sample],
-                                                 ideriv, lambda,
-                                                 r_th_jacob, r_n_jacob,
-                                                 rmult, r_raw);
-
-                    gsl_matrix_set(jacob, j_sample, kp, pjac);
-                }
+            for(kp = 0; kp < fit->common_parameters->number; kp++) {
+                fit_param_t *fp = fit->common_parameters->values + kp;
+                double pjac;
 
-                for(ikp = 0; ikp < nb_priv_params * sample; kp++, ikp++) {
-                    gsl_matrix_set(jacob, j_sample, kp, 0.0);
-                }
+                pjac = get_parameter_jacob_r(fp, stack, ideriv, lambda,
+                                             r_th_jacob, r_n_jacob,
+                                             rmult, r_raw);
 
-                for(ikp = 0; ikp < nb_priv_params; kp++, ikp++) {
-                    fit_param_t *fp = fit->private_parameters->values + ikp;
-                    double pjac;
+                gsl_matrix_set(jacob, j, kp, pjac);
+            }
 
-                    pjac = get_parameter_jacob_r(fp, fit->stack_list[sample],
-                                                 ideriv, lambda,
-                                                 r_th_jacob, r_n_jacob,
-                                                 rmult, r_raw);
+            for(kp = 0; kp < fit->private_parameters->number; kp++) {
+                fit_param_t *fp = fit->private_parameters->values + kp;
+                double pjac;
 
-                    gsl_matrix_set(jacob, j_sample, kp, pjac);
-                }
+                pjac = get_parameter_jacob_r(fp, stack, ideriv, lambda,
+                                             r_th_jacob, r_n_jacob,
+                                             rmult, r_raw);
 
-                for(/* */; kp < nb_params; kp++) {
-                    gsl_matrix_set(jacob, j_sample, kp, 0.0);
-                }
+                gsl_matrix_set(jacob, j, priv_col + kp, pjac);
             }
         }
     }
@@ -116,6 +93,13 @@ refl_multifit_fdf(const gsl_vector *x, void *params,
     return GSL_SUCCESS;
 }
 
+int
+refl_multifit_fdf(const gsl_vector *x, void *params,
+                  gsl_vector *f, gsl_matrix * jacob)
+{
+    return multi_fit_engine_fdf(params, x, f, jacob);
+}
+
 int
 refl_multifit_f(const gsl_vector *x, void *params, gsl_vector * f)
 {
@@ -8,6 +8,16 @@
 
 __BEGIN_DECLS
 
+struct multi_fit_engine;
+
+/* Residuals and jacobian of a single sample. The parameters must be
+   already committed. The columns of the common parameters come first
+   and the ones of the private parameters start at priv_col, the other
+   columns are not written. */
+extern int      refl_multifit_sample_fdf(struct multi_fit_engine *fit, int sample,
+                                         gsl_vector *f, gsl_matrix *jacob,
+                                         size_t priv_col);
+
 extern int      refl_multifit_fdf(const gsl_vector *x, void *params,
                                   gsl_vector *f, gsl_matrix * jacob);
 extern int      refl_multifit_f(const gsl_vector *x, void *params,
@@ -0,0 +1,213 @@
+#include "repeat-block.h"
+
+/* The 2x2 matrices are stored as four consecutive values in row-major
+   order. */
+
+static inline void
+cmat2_mul(const cmpl a[], const cmpl b[], cmpl r[])
+{
+    cmpl r0 = a[0]*b[0] + a[1]*b[2];
+    cmpl r1 = a[0]*b[1] + a[1]*b[3];
+    cmpl r2 = a[2]*b[0] + a[3]*b[2];
+    cmpl r3 = a[2]*b[1] + a[3]*b[3];
+    r[0] = r0;
+    r[1] = r1;
+    r[2] = r2;
+    r[3] = r3;
+}
+
+/* r = da * b + a * db */
+static inline void
+cmat2_mul_deriv(const cmpl a[], const cmpl da[], const cmpl b[], const cmpl db[], cmpl r[])
+{
+    cmpl t[4];
+    cmat2_mul(da, b, t);
+    cmat2_mul(a, db, r);
+    r[0] += t[0];
+    r[1] += t[1];
+    r[2] += t[2];
+    r[3] += t[3];
+}
+
+static inline void
+cmat2_set_identity(cmpl a[])
+{
+    a[0] = 1.0;
+    a[1] = 0.0;
+    a[2] = 0.0;
+    a[3] = 1.0;
+}
+
+/* The recursion is invariant if a matrix and its derivatives are scaled by
+   the same factor. The matrices are normalized to avoid overflows for
+   large numbers of repetitions. */
+static void
+cmat2_normalize(cmpl a[], cmpl da[], int nd)
+{
+    double amax = 0.0, s;
+    int k;
+
+    for(k = 0; k < 4; k++) {
+        double x = cabs(a[k]);
+        if(x > amax) {
+            amax = x;
+        }
+    }
+
+    if(amax == 0.0) return;
+
+    s = 1 / amax;
+    for(k = 0; k < 4; k++) {
+        a[k] *= s;
+    }
+    for(k = 0; k < 4 * nd; k++) {
+        da[k] *= s;
+    }
+}
+
+static void
+step_matrix(const struct repeat_step *st, cmpl m[])
+{
+    m[0] = st->rho;
+    m[1] = st->r;
+    m[2] = st->r * st->rho;
+    m[3] = 1.0;
+}
+
+/* Add to dm the derivatives of the block matrix due to the step "i". The
+   derivatives are indexed as: thickness of the i-th medium "i", refractive
+   index of the i-th medium "length + i". Only the thicknesses are
+   considered if nd == length. */
+static void
+add_step_deriv(int length, int nd, int i, const struct repeat_step *st,
+               const cmpl pre[], const cmpl suf[], cmpl *dm)
+{
+    const int it = (i == 0 ? length - 1 : i - 1);
+    cmpl dr[4], drho[4], t[4];
+    cmpl *d;
+    int k;
+
+    /* derivatives of [[rho, r], [r rho, 1]] respect to rho and r,
+       pre- and post-multiplied by the rest of the block. */
+    drho[0] = 1.0;
+    drho[1] = 0.0;
+    drho[2] = st->r;
+    drho[3] = 0.0;
+    cmat2_mul(pre, drho, t);
+    cmat2_mul(t, suf, drho);
+
+    dr[0] = 0.0;
+    dr[1] = 1.0;
+    dr[2] = st->rho;
+    dr[3] = 0.0;
+    cmat2_mul(pre, dr, t);
+    cmat2_mul(t, suf, dr);
+
+    d = dm + 4 * i;
+    for(k = 0; k < 4; k++) {
+        d[k] += st->drhodth * drho[k];
+    }
+
+    if(nd <= length) return;
+
+    d = dm + 4 * (length + i);
+    for(k = 0; k < 4; k++) {
+        d[k] += st->drhodn * drho[k] + st->drdnb * dr[k];
+    }
+
+    d = dm + 4 * (length + it);
+    for(k = 0; k < 4; k++) {
+        d[k] += st->drdnt * dr[k];
+    }
+}
+
+cmpl
+repeat_block_apply(int length, int times, const struct repeat_step steps[],
+                   cmpl R, cmpl *dfdR, cmpl *jacth, cmpl *jacn, cmpl *work)
+{
+    const int nd = (jacth ? (jacn ? 2 * length : length) : 0);
+    cmpl *q = work, *b = work + 4, *x = work + 8;
+    cmpl *dq = work + 16;
+    cmpl *db = dq + 4 * nd, *dx = db + 4 * nd;
+    cmpl *pre = dx + 4 * nd, *suf = pre + 4 * (length + 1);
+    cmpl num, den, isqden;
+    int i, k, n;
+
+    /* The matrix of a block is Q = S[0] S[1] ... S[length-1]. Since the
+       step matrices are applied from the bottom the last step is the
+       rightmost. */
+    cmat2_set_identity(pre);
+    for(i = 0; i < length; i++) {
+        cmpl m[4];
+        step_matrix(&steps[i], m);
+        cmat2_mul(pre + 4*i, m, pre + 4*(i+1));
+    }
+    for(k = 0; k < 4; k++) {
+        q[k] = pre[4*length + k];
+    }
+
+    if(nd > 0) {
+        cmat2_set_identity(suf + 4*length);
+        for(i = length - 1; i >= 0; i--) {
+            cmpl m[4];
+            step_matrix(&steps[i], m);
+            cmat2_mul(m, suf + 4*(i+1), suf + 4*i);
+        }
+
+        for(k = 0; k < 4 * nd; k++) {
+            dq[k] = 0.0;
+        }
+        for(i = 0; i < length; i++) {
+            add_step_deriv(length, nd, i, &steps[i], pre + 4*i, suf + 4*(i+1), dq);
+        }
+    }
+
+    /* Compute X = Q^(times - 1) by repeated squaring together with its
+       derivatives. */
+    cmat2_set_identity(x);
+    for(k = 0; k < 4 * nd; k++) {
+        dx[k] = 0.0;
+        db[k] = dq[k];
+    }
+    for(k = 0; k < 4; k++) {
+        b[k] = q[k];
+    }
+
+    for(n = times - 1; n > 0; n >>= 1) {
+        if(n & 1) {
+            for(i = 0; i < nd; i++) {
+                cmat2_mul_deriv(x, dx + 4*i, b, db + 4*i, dx + 4*i);
+            }
+            cmat2_mul(x, b, x);
+            cmat2_normalize(x, dx, nd);
+        }
+        if(n > 1) {
+            for(i = 0; i < nd; i++) {
+                cmat2_mul_deriv(b, db + 4*i, b, db + 4*i, db + 4*i);
+            }
+            cmat2_mul(b, b, b);
+            cmat2_normalize(b, db, nd);
+        }
+    }
+
+    num = x[0] * R + x[1];
+    den = x[2] * R + x[3];
+    isqden = 1 / (den * den);
+
+    if(dfdR) {
+        *dfdR = (x[0] * x[3] - x[1] * x[2]) * isqden;
+    }
+
+    for(i = 0; i < nd; i++) {
+        const cmpl *d = dx + 4*i;
+        cmpl dnum = d[0] * R + d[1], dden = d[2] * R + d[3];
+        cmpl dv = (dnum * den - num * dden) * isqden;
+        if(i < length) {
+            jacth[i] = dv;
+        } else {
+            jacn[i - length] = dv;
+        }
+    }
+
+    return num / den;
+}
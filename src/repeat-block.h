@@ -0,0 +1,53 @@
+#ifndef REPEAT_BLOCK_H
+#define REPEAT_BLOCK_H
+
+#include "defs.h"
+#include "cmpl.h"
+
+__BEGIN_DECLS
+
+/* A block of consecutive layers, from the medium "first" to the medium
+   "first + length - 1", that is repeated "times" times in the actual film
+   stack. The block is stored only once in the list of mediums. */
+struct repeat_block {
+    int first;
+    int length;
+    int times;
+};
+
+#define REPEAT_BLOCK_IS_ACTIVE(rep) ((rep) != NULL && (rep)->times > 1)
+
+/* A single step of the multilayer recursion R' = (r + rho R) / (1 + r rho R)
+   that is represented by the matrix [[rho, r], [r rho, 1]] acting on
+   homogeneous coordinates. The derivatives are respect to the refractive
+   index of the top and bottom medium and to the thickness of the bottom
+   medium. */
+struct repeat_step {
+    cmpl r, rho;
+    cmpl drdnt, drdnb, drhodn, drhodth;
+};
+
+/* Number of complex values of workspace required by repeat_block_apply. */
+#define REPEAT_BLOCK_WORKSPACE(length) (32 * (length) + 32)
+
+/* Apply the "times - 1" lower copies of the block to the reflection
+   coefficient R of the mediums below the block and return the resulting
+   reflection coefficient. The element steps[i] is the step that enters the
+   medium "first + i" and steps[0] takes as top medium the last medium of
+   the block, as it does between two copies of the block.
+
+   If "dfdR" is not NULL it receives the derivative respect to R. If
+   "jacth" is not NULL it receives the derivatives respect to the
+   thicknesses of the block's mediums and, if also "jacn" is not NULL, the
+   latter receives the derivatives respect to their refractive indexes,
+   "length" values each. The derivatives account for all the copies of
+   the block since they share the same parameters. The computation takes
+   O(log(times)) matrix products. */
+extern cmpl repeat_block_apply(int length, int times,
+                               const struct repeat_step steps[], cmpl R,
+                               cmpl *dfdR, cmpl *jacth, cmpl *jacn,
+                               cmpl *work);
+
+__END_DECLS
+
+#endif
@@ -261,6 +261,31 @@ spectr_cut_range(struct spectrum *s, float inf, float sup)
     data_view_set_mask_offset(s->table, jmin, jmin + npt);
 }
 
+int
+spectra_same_grid(struct spectrum *a, struct spectrum *b)
+{
+    int j, npt = spectra_points(a);
+
+    if(a->config.system != b->config.system ||
+            a->config.aoi != b->config.aoi ||
+            a->config.analyzer != b->config.analyzer ||
+            a->config.numap != b->config.numap) {
+        return 0;
+    }
+
+    if(spectra_points(b) != npt) {
+        return 0;
+    }
+
+    for(j = 0; j < npt; j++) {
+        if(get_lambda_by_index(a, j) != get_lambda_by_index(b, j)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
 struct spectrum *
 spectra_copy(struct spectrum *src) {
     struct spectrum *copy = emalloc(sizeof(struct spectrum));
@@ -50,6 +50,11 @@ extern struct spectrum * load_gener_spectrum(const char *filename, str_ptr *erro
 extern void              spectr_cut_range(struct spectrum *s,
         float inf, float sup);
 
+/* Return 1 if the two spectra have the same system configuration and
+   the same wavelengths, 0 otherwise. */
+extern int               spectra_same_grid(struct spectrum *a,
+        struct spectrum *b);
+
 
 __END_DECLS
 
@@ -11,6 +11,9 @@ stack_init_raw(stack_t *s, size_t nb_init)
     s->disp = emalloc(nb_init * sizeof(void *));
     /* For thicknesses we allocate more space of what is actually needed. */
     s->thickness = emalloc(nb_init * sizeof(double));
+    s->repeat.first = 0;
+    s->repeat.length = 0;
+    s->repeat.times = 1;
 }
 
 void
@@ -69,6 +72,14 @@ stack_insert_layer(stack_t *s, int pos, disp_t *lyr, double th)
         s->thickness[0] = 0.0;
     }
     s->nb++;
+
+    if (s->repeat.times > 1) {
+        if (pos <= s->repeat.first) {
+            s->repeat.first ++;
+        } else if (pos < s->repeat.first + s->repeat.length) {
+            s->repeat.length ++;
+        }
+    }
 }
 
 void
@@ -84,6 +95,38 @@ stack_delete_layer(stack_t *s, int pos)
         s->thickness[i] = s->thickness[i+1];
     }
     s->nb--;
+
+    if (s->repeat.times > 1) {
+        if (pos < s->repeat.first) {
+            s->repeat.first --;
+        } else if (pos < s->repeat.first + s->repeat.length) {
+            s->repeat.length --;
+            if (s->repeat.length == 0) {
+                stack_set_repeat(s, 0, 0, 1);
+            }
+        }
+    }
+}
+
+/* Set the block of layers from "first" to "first + length - 1" to be
+   repeated "times" times. With times <= 1 no layer is repeated. Return
+   a non-zero value if the block does not contain only layers. */
+int
+stack_set_repeat(stack_t *s, int first, int length, int times)
+{
+    if (times <= 1) {
+        s->repeat.first = 0;
+        s->repeat.length = 0;
+        s->repeat.times = 1;
+        return 0;
+    }
+    if (first < 1 || length < 1 || first + length > s->nb - 1) {
+        return 1;
+    }
+    s->repeat.first = first;
+    s->repeat.length = length;
+    s->repeat.times = times;
+    return 0;
 }
 
 stack_t *
@@ -210,6 +253,10 @@ stack_write(writer_t *w, const stack_t *s)
         writer_printf(w, "%g", s->thickness[i-1]);
     }
     writer_newline(w);
+    if (s->repeat.times > 1) {
+        writer_printf(w, "repeat %d %d %d", s->repeat.first, s->repeat.length, s->repeat.times);
+        writer_newline(w);
+    }
     for (i = 0; i < s->nb; i++) {
         disp_write(w, s->disp[i]);
     }
@@ -228,10 +275,19 @@ stack_read(lexer_t *l)
     for (i = 1; i < nb - 1; i++) {
         if (lexer_number(l, s->thickness + (i - 1))) goto stack_exit;
     }
+    if (lexer_check_ident(l, "repeat") == 0) {
+        int first, length;
+        if (lexer_integer(l, &first)) goto stack_exit;
+        if (lexer_integer(l, &length)) goto stack_exit;
+        if (lexer_integer(l, &s->repeat.times)) goto stack_exit;
+        s->repeat.first = first;
+        s->repeat.length = length;
+    }
     for (i = 0; i < nb; i++, s->nb++) {
         s->disp[i] = disp_read(l);
         if (!s->disp[i]) goto stack_exit;
     }
+    if (stack_set_repeat(s, s->repeat.first, s->repeat.length, s->repeat.times)) goto stack_exit;
     return s;
 stack_exit:
     stack_free(s);
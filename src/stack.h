@@ -6,6 +6,7 @@
 #include "fit-params.h"
 #include "writer.h"
 #include "lexer.h"
+#include "repeat-block.h"
 
 __BEGIN_DECLS
 
@@ -14,6 +15,10 @@ struct stack {
     struct disp_struct ** disp;
     double *thickness;
     size_t nb_alloc;
+    /* Block of layers repeated in the film stack, active only if
+       repeat.times > 1. The parameters of the block are shared by all
+       its copies. */
+    struct repeat_block repeat;
 };
 
 typedef struct stack stack_t;
@@ -27,6 +32,7 @@ extern void     stack_init_raw(stack_t *s, size_t nb_init);
 extern void     stack_add_layer(stack_t *s, disp_t *lyr, double th);
 extern void     stack_insert_layer(stack_t *s, int pos, disp_t *lyr, double th);
 extern void     stack_delete_layer(stack_t *s, int pos);
+extern int      stack_set_repeat(stack_t *s, int first, int length, int times);
 extern const
 double *        stack_get_ths_list(const stack_t *s);
 extern void     stack_get_ns_list(stack_t *s, cmpl *ns, double lambda);
@@ -123,3 +123,49 @@ str_path_basename(str_ptr basename, const char *filename)
     str_copy_c(basename, p+1);
     return 0;
 }
+
+void
+str_append_csv_field(str_t line, const char *field)
+{
+    const char *p;
+
+    if(strpbrk(field, ",\"\n") == NULL) {
+        str_append_c(line, field, ',');
+        return;
+    }
+
+    str_append_c(line, "\"", ',');
+    for(p = field; *p; p++) {
+        char c[3] = {*p, 0, 0};
+        if(*p == '"') {
+            c[1] = '"';
+        }
+        str_append_c(line, c, 0);
+    }
+    str_append_c(line, "\"", 0);
+}
+
+const char *
+str_read_csv_field(str_t field, const char *p)
+{
+    str_trunc(field, 0);
+
+    if(*p != '"') {
+        const char *end = p + strcspn(p, ",\n");
+        str_copy_c_substr(field, p, end - p);
+        return end;
+    }
+
+    for(p++; *p; p++) {
+        char c[2] = {*p, 0};
+        if(*p == '"') {
+            if(p[1] != '"') {
+                return p + 1;
+            }
+            p++;
+        }
+        str_append_c(field, c, 0);
+    }
+
+    return NULL;
+}
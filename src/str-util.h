@@ -11,6 +11,15 @@ extern int      str_loadfile(const char *filename, str_t text);
 extern int      str_is_abs_pathname(str_t path);
 extern int      str_path_basename(str_ptr basename, const char *filename);
 
+/* Append a field to a line in CSV format, preceded by a comma. The
+   field is quoted if it contains a comma, a quote or a newline. */
+extern void     str_append_csv_field(str_t line, const char *field);
+
+/* Read in "field" the CSV field starting at "p". Return a pointer to
+   the character that follows the field, a comma or the end of the line,
+   or NULL if the field is not well formed. */
+extern const char * str_read_csv_field(str_t field, const char *p);
+
 __END_DECLS
 
 #endif
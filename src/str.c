@@ -245,8 +245,12 @@ str_vprintf(str_t d, const char *fmt, int append, va_list ap)
     char *xbuf;
     int xbuf_size;
     int ns;
+    va_list aq;
 
-    ns = vsnprintf(buffer, STR_BUFSIZE, fmt, ap);
+    /* The argument list is used again if the buffer is too small. */
+    va_copy(aq, ap);
+    ns = vsnprintf(buffer, STR_BUFSIZE, fmt, aq);
+    va_end(aq);
 
     if(ns >= STR_BUFSIZE) {
         xbuf_size = ns+1;
@@ -14,22 +14,25 @@ struct aux_param {
 
     double *ds;
     cmpl *ns;
+    const struct repeat_block *rep;
 
     enum se_type spkind;
     size_t nb;
     double phi0;
+    double numap;
     double lambda;
     double anlz;
+
+    struct elliss_workspace *ws;
+    struct refl_workspace *refl_ws;
 };
 
 static double der_aux_f(double x, void *_p);
+static double der_aux_refl_f(double x, void *_p);
 
-double
-der_aux_f(double x, void *_p)
+static void
+der_aux_set(struct aux_param *p, double x)
 {
-    struct aux_param *p = (struct aux_param *) _p;
-    ell_ab_t e;
-
     if(p->thickness) {
         p->ds[p->layer-1] = x;
     } else {
@@ -41,22 +44,43 @@ der_aux_f(double x, void *_p)
             p->ns[p->layer] = creal(z) + I * x;
         }
     }
+}
+
+double
+der_aux_f(double x, void *_p)
+{
+    struct aux_param *p = (struct aux_param *) _p;
+    ell_ab_t e;
+
+    der_aux_set(p, x);
 
     mult_layer_se_jacob(p->spkind,
-                        p->nb, p->ns, p->phi0, p->ds, p->lambda, p->anlz,
-                        e, NULL, NULL);
+                        p->nb, p->ns, p->phi0, p->numap, p->ds, p->rep, p->lambda, p->anlz,
+                        e, NULL, NULL, p->ws);
 
     return (p->channel == 0 ? e->alpha : e->beta);
 }
 
+double
+der_aux_refl_f(double x, void *_p)
+{
+    struct aux_param *p = (struct aux_param *) _p;
+
+    der_aux_set(p, x);
+
+    return mult_layer_refl_ni(p->nb, p->ns, p->ds, p->rep, p->lambda,
+                              NULL, NULL, p->refl_ws);
+}
+
 void
 test_elliss_deriv(enum se_type spkind,
-                  size_t _nb, const cmpl ns[], double phi0,
-                  const double ds[], double lambda,
-                  double anlz)
+                  size_t _nb, const cmpl ns[], double phi0, double numap,
+                  const double ds[], const struct repeat_block *rep,
+                  double lambda, double anlz)
 {
     gsl_vector *jacob_th;
     cmpl_vector *jacob_n;
+    struct elliss_workspace *ws;
     struct aux_param p[1];
     size_t j, nb = _nb;
     size_t nblyr = nb - 2;
@@ -71,17 +95,21 @@ test_elliss_deriv(enum se_type spkind,
 
     jacob_th = gsl_vector_alloc(2 * nblyr);
     jacob_n  = cmpl_vector_alloc(2 * nb);
+    ws = elliss_workspace_alloc(nb);
 
     myds = emalloc(nblyr * sizeof(double));
     myns = emalloc(nb * sizeof(cmpl));
 
-    mult_layer_se_jacob(spkind, nb, ns, phi0, ds, lambda, anlz,
-                        e, jacob_th, jacob_n);
+    mult_layer_se_jacob(spkind, nb, ns, phi0, numap, ds, rep, lambda, anlz,
+                        e, jacob_th, jacob_n, ws);
 
     p->nb = nb;
+    p->rep = rep;
+    p->ws = ws;
     p->spkind = spkind;
     p->lambda = lambda;
     p->phi0 = phi0;
+    p->numap = numap;
     p->anlz = anlz;
 
     p->ds = myds;
@@ -137,6 +165,111 @@ test_elliss_deriv(enum se_type spkind,
     free(myds), free(myns);
     gsl_vector_free(jacob_th);
     cmpl_vector_free(jacob_n);
+    elliss_workspace_free(ws);
+}
+
+void
+test_refl_deriv(size_t _nb, const cmpl ns[], const double ds[],
+                const struct repeat_block *rep, double lambda)
+{
+    gsl_vector *jacob_th, *jacob_n;
+    struct refl_workspace *ws;
+    struct aux_param p[1];
+    size_t j, nb = _nb;
+    size_t nblyr = nb - 2;
+    double *myds;
+    cmpl *myns;
+
+    printf("LAMBDA: %f\n", lambda);
+
+    jacob_th = gsl_vector_alloc(nblyr);
+    jacob_n  = gsl_vector_alloc(2 * nb);
+    ws = refl_workspace_alloc(nb);
+
+    myds = emalloc(nblyr * sizeof(double));
+    myns = emalloc(nb * sizeof(cmpl));
+
+    mult_layer_refl_ni(nb, ns, ds, rep, lambda, jacob_th, jacob_n, ws);
+
+    p->nb = nb;
+    p->rep = rep;
+    p->refl_ws = ws;
+    p->lambda = lambda;
+
+    p->ds = myds;
+    p->ns = myns;
+
+    p->thickness = 1;
+    for(j = 1; j < nb - 1; j++) {
+        gsl_function F;
+        double result, abserr;
+
+        p->layer = j;
+
+        F.function = & der_aux_refl_f;
+        F.params = p;
+
+        memcpy(myds, ds, nblyr * sizeof(double));
+        memcpy(myns, ns, nb * sizeof(cmpl));
+
+        gsl_deriv_central(&F, ds[j-1], 1e-8, &result, &abserr);
+
+        printf("TH layer: %2i, numeric: %.6f, calcul.: %.6f, err: %f\n", (int) j,
+               result, gsl_vector_get(jacob_th, j-1), abserr);
+    }
+
+    p->thickness = 0;
+    for(j = 0; j < nb; j++) {
+        gsl_function F;
+        double result, abserr;
+
+        p->layer = j;
+
+        F.function = & der_aux_refl_f;
+        F.params = p;
+
+        memcpy(myds, ds, nblyr * sizeof(double));
+        memcpy(myns, ns, nb * sizeof(cmpl));
+
+        p->real_part = 1;
+        gsl_deriv_central(&F, creal(ns[j]), 1e-8, &result, &abserr);
+        printf("Re{n} layer: %2i, numeric: %.6f, calcul.: %.6f, err: %f\n", (int) j,
+               result, gsl_vector_get(jacob_n, j), abserr);
+
+        p->real_part = 0;
+        gsl_deriv_central(&F, cimag(ns[j]), 1e-8, &result, &abserr);
+        printf("Im{n} layer: %2i, numeric: %.6f, calcul.: %.6f, err: %f\n", (int) j,
+               result, gsl_vector_get(jacob_n, nb + j), abserr);
+    }
+
+    free(myds), free(myns);
+    gsl_vector_free(jacob_th);
+    gsl_vector_free(jacob_n);
+    refl_workspace_free(ws);
+}
+
+void
+test_deriv_cases(void)
+{
+    /* Ambient, two layers repeated four times between two other layers
+       and the substrate. */
+    const cmpl ns[6] = {1.0, 1.46, 2.05 - 0.02 * I, 1.46 - 0.001 * I,
+                        1.62, 3.88 - 0.02 * I};
+    const double ds[4] = {120.0, 35.0, 80.0, 250.0};
+    const struct repeat_block rep[1] = {{2, 2, 4}};
+    const double phi0 = 65.0 * M_PI / 180.0;
+
+    printf("REPEATED BLOCK, ELLIPSOMETRY\n");
+    test_elliss_deriv(SE_PSI_DEL, 6, ns, phi0, 0.0, ds, rep, 633.0, 0.0);
+
+    printf("NUMERICAL APERTURE, ELLIPSOMETRY\n");
+    test_elliss_deriv(SE_ALPHA_BETA, 6, ns, phi0, 0.1, ds, NULL, 633.0, M_PI / 4);
+
+    printf("NUMERICAL APERTURE AND REPEATED BLOCK, ELLIPSOMETRY\n");
+    test_elliss_deriv(SE_PSI_DEL, 6, ns, phi0, 0.1, ds, rep, 633.0, 0.0);
+
+    printf("REPEATED BLOCK, REFLECTOMETRY\n");
+    test_refl_deriv(6, ns, ds, rep, 633.0);
 }
 
 #endif
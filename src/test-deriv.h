@@ -4,12 +4,29 @@
 #ifdef DEBUG_REGRESS
 
 #include "elliss.h"
+#include "refl-kernel.h"
+#include "repeat-block.h"
+
+__BEGIN_DECLS
 
 void
 test_elliss_deriv(enum se_type spkind,
-                  size_t _nb, const cmpl ns[], double phi0,
-                  const double ds[], double lambda,
-                  double anlz);
+                  size_t _nb, const cmpl ns[], double phi0, double numap,
+                  const double ds[], const struct repeat_block *rep,
+                  double lambda, double anlz);
+
+void
+test_refl_deriv(size_t _nb, const cmpl ns[], const double ds[],
+                const struct repeat_block *rep, double lambda);
+
+/* Check the derivatives of the kernels for fixed stacks covering the
+   cases not given by the stack of the fit, like a repeated block of
+   layers or a finite numerical aperture. It does not depend on any fit
+   and it is meant to be called once at the start of the program. */
+void
+test_deriv_cases(void);
+
+__END_DECLS
 
 #endif
 
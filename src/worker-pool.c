@@ -0,0 +1,158 @@
+#include <pthread.h>
+
+#include "common.h"
+#include "worker-pool.h"
+
+struct worker_pool {
+    int nb_threads;
+    pthread_t *threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+
+    /* Incremented each time a new job is submitted. */
+    unsigned long generation;
+    /* Number of background threads still working on the current job. */
+    int pending;
+    int shutdown;
+
+    worker_pool_func_t func;
+    void *data;
+    int nb_tasks;
+    int next_task;
+};
+
+static void
+run_tasks(struct worker_pool *pool, int thread)
+{
+    int k;
+    while ((k = __sync_fetch_and_add(&pool->next_task, 1)) < pool->nb_tasks) {
+        pool->func(pool->data, k, thread);
+    }
+}
+
+struct thread_start {
+    struct worker_pool *pool;
+    int index;
+};
+
+static void *
+worker_thread(void *arg)
+{
+    struct thread_start *start = arg;
+    struct worker_pool *pool = start->pool;
+    const int index = start->index;
+    unsigned long seen = 0;
+
+    free(start);
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->generation == seen && !pool->shutdown) {
+            pthread_cond_wait(&pool->start_cond, &pool->lock);
+        }
+        if (pool->shutdown) break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_tasks(pool, index);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->pending --;
+        if (pool->pending == 0) {
+            pthread_cond_signal(&pool->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+struct worker_pool *
+worker_pool_new(int nb_threads)
+{
+    struct worker_pool *pool = emalloc(sizeof(struct worker_pool));
+    int j;
+
+    pool->nb_threads = (nb_threads > 1 ? nb_threads : 1);
+    pool->threads = emalloc(pool->nb_threads * sizeof(pthread_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->generation = 0;
+    pool->pending = 0;
+    pool->shutdown = 0;
+    pool->nb_tasks = 0;
+    pool->next_task = 0;
+
+    for (j = 1; j < pool->nb_threads; j++) {
+        struct thread_start *start = emalloc(sizeof(struct thread_start));
+        start->pool = pool;
+        start->index = j;
+        if (pthread_create(&pool->threads[j], NULL, worker_thread, start)) {
+            /* Continue with the threads that we have been able to start. */
+            free(start);
+            pool->nb_threads = j;
+            break;
+        }
+    }
+
+    return pool;
+}
+
+void
+worker_pool_free(struct worker_pool *pool)
+{
+    int j;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (j = 1; j < pool->nb_threads; j++) {
+        pthread_join(pool->threads[j], NULL);
+    }
+
+    pthread_cond_destroy(&pool->start_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+int
+worker_pool_threads(const struct worker_pool *pool)
+{
+    return pool->nb_threads;
+}
+
+void
+worker_pool_run(struct worker_pool *pool, worker_pool_func_t func, void *data, int nb_tasks)
+{
+    if (pool->nb_threads == 1 || nb_tasks <= 1) {
+        int k;
+        for (k = 0; k < nb_tasks; k++) {
+            func(data, k, 0);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->func = func;
+    pool->data = data;
+    pool->nb_tasks = nb_tasks;
+    pool->next_task = 0;
+    pool->pending = pool->nb_threads - 1;
+    pool->generation ++;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    run_tasks(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
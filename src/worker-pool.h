@@ -0,0 +1,32 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include "defs.h"
+
+__BEGIN_DECLS
+
+/* Function executed for each task. The argument "thread" is the index of
+   the thread executing the task, between 0 and nb_threads - 1, and can be
+   used to select the private data of the thread. The index 0 always
+   corresponds to the thread calling worker_pool_run. */
+typedef void (*worker_pool_func_t)(void *data, int task, int thread);
+
+struct worker_pool;
+
+/* Create a pool with nb_threads - 1 background threads. The thread calling
+   worker_pool_run takes part to the computation. */
+extern struct worker_pool *worker_pool_new(int nb_threads);
+extern void worker_pool_free(struct worker_pool *pool);
+
+extern int worker_pool_threads(const struct worker_pool *pool);
+
+/* Execute the tasks 0 .. nb_tasks - 1 and return when all of them are
+   completed. The tasks are distributed dynamically among the threads and
+   are started in increasing order of index, their order of completion
+   is not specified. A task may therefore wait for a task with a lower
+   index without risk of deadlock. */
+extern void worker_pool_run(struct worker_pool *pool, worker_pool_func_t func, void *data, int nb_tasks);
+
+__END_DECLS
+
+#endif